@@ -1,13 +1,37 @@
+#ifndef NINE_MM_H
+#define NINE_MM_H
+
 #define _XOPEN_SOURCE 700
 
 #include "container.h"
+#include "lib9mm.h"
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#ifdef SELFHOST_9MM
+extern void* stdin;
+extern void* stderr;
+#endif
 
 enum {
     // Type of abstract syntax tree
@@ -165,19 +189,148 @@ struct node {
 };
 typedef struct node Node;
 
+// Header file which is loaded once per process, it is read again only if the file is changed.
+struct header_file {
+    char const* path;       // Canonical path.
+    char const* content;
+    char const* guard_name; // Macro name of the include guard, NULL if it does not have.
+    int is_pragma_once;     // 1 if it has "#pragma once".
+    int is_included;        // 1 if it has been included once at least in the current compilation.
+    size_t mtime;           // Modification time of the file in nanoseconds when it was read.
+    size_t size;            // Size of the file when it was read.
+};
+typedef struct header_file Header;
+
+// Implementation to skip spaces and comments in the tokenizer.
+enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
 struct code {
     Node const* const* asts;
     size_t count_ast;
     Map const* str_label_map;
+    Map* function_map; // Name -> "Node" of the function definition, or of the prototype if it is not defined.
+    Map* static_names; // Names of the functions and the global variables which are not visible from the other files.
 };
 typedef struct code Code;
 
+// Operation of the three-address instruction.
+enum {
+    IR_IMM = 1, // dst = imm
+    IR_MOV,     // dst = lhs, it is truncated to "imm" bytes if imm is not 0
+    IR_ADD,     // dst = lhs + rhs
+    IR_SUB,     // dst = lhs - rhs
+    IR_MUL,     // dst = lhs * rhs
+    IR_DIV,     // dst = lhs / rhs
+    IR_EQ,      // dst = lhs == rhs
+    IR_NE,      // dst = lhs != rhs
+    IR_LT,      // dst = lhs < rhs
+    IR_LE,      // dst = lhs <= rhs
+    IR_NOT,     // dst = !lhs
+    IR_LOCAL,   // dst = address of the local variable "name" at "rbp - imm"
+    IR_GLOBAL,  // dst = address of the symbol "name"
+    IR_LOAD,    // dst = the "imm" bytes at the address lhs
+    IR_STORE,   // the "imm" bytes at the address lhs = rhs
+    IR_CALL,    // dst = name(args...)
+    IR_ARG,     // dst = the imm-th argument of the function
+    IR_PHI,     // dst = args[i] if the block is entered from preds[i], only in the SSA form
+    IR_RET,     // return lhs
+    IR_JMP,     // goto then_block
+    IR_BR       // if (lhs) goto then_block else goto else_block
+};
+
+struct basic_block;
+
+// Three-address instruction, the operands are virtual registers.
+// Virtual registers are numbered from 1 in each function, 0 means none.
+struct ir_insn {
+    int op;
+    size_t dst;
+    size_t lhs;
+    size_t rhs;
+    size_t imm;
+    char const* name;
+    Vector* args; // Virtual registers of the arguments of IR_CALL and IR_PHI.
+    struct basic_block* then_block;
+    struct basic_block* else_block;
+};
+typedef struct ir_insn IrInsn;
+
+struct basic_block {
+    size_t id;
+    size_t index;    // Index in "IrFunction.blocks".
+    Vector* insns;   // "IrInsn", only the last one is IR_JMP, IR_BR or IR_RET.
+    Vector* preds;   // "BasicBlock" which jumps to this block.
+    Vector* succs;   // "BasicBlock" which this block jumps to.
+    int is_reachable;
+};
+typedef struct basic_block BasicBlock;
+
+struct ir_function {
+    char const* name;
+    Vector const* args;     // "Node" of the arguments.
+    Context const* context; // Offsets of the local variables.
+    size_t frame_size;      // Bytes of the local variables, it grows when the callees are inlined.
+    Vector* blocks;         // "BasicBlock" in the layout order, the first one is the entry.
+    size_t count_vregs;
+};
+typedef struct ir_function IrFunction;
+
+// Operand of the instruction which is assembled into the object, like "r10", "42", "[rbp+r11*8-16]" or "main".
+struct asm_operand {
+    int kind;        // ASM_REG, ASM_IMM, ASM_MEM or ASM_SYM.
+    int size;        // Bytes of the register or the memory, 0 if the memory has no "PTR".
+    int reg;         // Number of the register or the base of the memory, ASM_NO_REG if it is missing.
+    int index_reg;   // Index register of the memory, ASM_NO_REG if it is missing.
+    int scale;       // Scale of the index register.
+    size_t value;    // Immediate, or the displacement of the memory.
+    char const* sym; // Symbol of the operand or the memory, NULL if it is missing.
+};
+typedef struct asm_operand AsmOperand;
+
+// Piece of a section of the object, the jumps are resized by the layout.
+struct asm_item {
+    int kind;            // ASM_CODE, ASM_JUMP, ASM_LABEL, ASM_ALIGN or ASM_SPACE.
+    int section;         // SECTION_TEXT, SECTION_DATA or SECTION_BSS.
+    size_t offset;       // Offset in the section, it is set by the layout.
+    size_t size;         // Bytes in the section, it is set by the layout.
+    char const* bytes;   // Encoded bytes of ASM_CODE.
+    size_t len;          // Bytes of ASM_CODE, the bytes of ASM_SPACE or the alignment of ASM_ALIGN.
+    char const* target;  // Symbol of the 32-bit field or the jump, NULL if it is missing.
+    size_t fixup_pos;    // Offset of the 32-bit field in the bytes.
+    size_t fixup_value;  // Displacement which is added to the address of the target.
+    int fixup_type;      // Relocation type of the 32-bit field.
+    int jump_opcode;     // Opcode of the short jump.
+    int is_long;         // The jump has the 32-bit displacement if it is 1.
+};
+typedef struct asm_item AsmItem;
+
+struct asm_symbol {
+    char const* name;
+    AsmItem const* label; // Label which defines the symbol, NULL if it is undefined.
+    int is_global;
+    size_t sym_index;     // Index in ".symtab", 0 if the relocations use the section symbol.
+};
+typedef struct asm_symbol AsmSymbol;
+
+// File in the cache directory which is found by the scan of the eviction.
+struct cache_entry {
+    char* path;
+    size_t mtime; // Nanoseconds of the last use.
+    size_t size;
+};
+typedef struct cache_entry CacheEntry;
+
 
 #ifndef SELFHOST_9MM
-// main.c
+// lib9mm.c
 void error_at(char const*, char const*);
 void log_internal(char const*, const char*, const char*, size_t, char const*, ...);
-char* read_file(char const*);
+char const* read_file(char const*);
+void stat_file(char const*, size_t*, size_t*);
 
 #define log_base(level, ...) \
     log_internal(level, __FILE__, __func__, __LINE__, __VA_ARGS__);
@@ -185,7 +338,7 @@ char* read_file(char const*);
 #define error(...)                                         \
     {                                                      \
         log_base("\033[1;31m[ERROR]\033[0m", __VA_ARGS__); \
-        exit(1);                                           \
+        mm_fail(MM_ERROR_COMPILE);                         \
     }
 
 #define error_if_null(var)          \
@@ -199,16 +352,78 @@ char* read_file(char const*);
     log_base("\033[1;34m[DEBUG]\033[0m", __VA_ARGS__);
 
 // preprocessor.c
-char const* preprocess(char*, char const*);
+char const* preprocess(char const*, char const*);
+void discard_preprocess(void);
+void print_preprocess_stats(void);
 
 // tokenize.c
 Vector const* tokenize(char const*);
+int set_scan_level(int);
 
 // parse.c
 Code const* program(Vector const*);
 
+// fold.c
+Node* fold_constants(Node*);
+void print_fold_stats(void);
+
+// ir.c
+Vector const* lower_ir(Code const*);
+BasicBlock* new_block(void);
+void dump_ir(Vector const*);
+
+// inline.c
+void set_inline_limit(size_t);
+size_t get_inline_limit(void);
+void inline_calls(Vector const*, Map*);
+void print_inline_stats(void);
+
+// ssa.c
+void optimize_ir(IrFunction*);
+void print_ssa_stats(void);
+
+// loop.c
+int optimize_loops(IrFunction*, BasicBlock* const*);
+void print_loop_stats(void);
+
 // codegen.c
-void generate(Code const*);
+void generate(Code const*, Vector const*);
+void print_codegen_stats(void);
+
+// emit.c
+void init_emitter(void);
+void emit(char const*);
+void emit_num(size_t);
+void emit_ptr(void const*);
+void emit_op0(char const*);
+void emit_op1(char const*, char const*);
+void emit_op2(char const*, char const*, char const*);
+void emit_op_num(char const*, char const*, size_t);
+void emit_op_reg_mem(char const*, char const*, char const*, size_t);
+void emit_op_mem_reg(char const*, char const*, size_t, char const*);
+void emit_jump(char const*, char const*, void const*);
+void emit_label(char const*);
+void emit_label_ptr(char const*, void const*);
+void emit_flush(Buffer*);
+size_t count_emitted_insns(void);
+void print_peephole_stats(void);
+
+// cache.c
+void cache_key(char*, char const*, size_t);
+int load_cache(char const*, char const*, Buffer*);
+void store_cache(char const*, char const*, char const*, size_t, size_t);
+void print_cache_stats(void);
+
+// elf.c
+void assemble_elf(char const*, size_t, Buffer*);
+void print_elf_stats(void);
+
+// server.c
+void run_server(char const*, size_t, MmContext const*);
+int request_server(char const*, char const*, char const*, Buffer*);
+int write_all(int, char const*, size_t);
 
 void runtest();
 #endif
+
+#endif
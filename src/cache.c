@@ -0,0 +1,307 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static size_t hash_lane(size_t, size_t, size_t, char const*, size_t);
+static char* cache_path(char const*, char const*, char const*);
+static void make_dirs(char const*);
+static void make_dir(char const*);
+static int write_cache_file(char const*, char const*, char const*, char const*, size_t);
+static int read_cache_total(char const*, size_t*);
+static void write_cache_total(char const*, size_t);
+static size_t evict_entries(char const*, size_t);
+static void sort_cache_entries(CacheEntry**, CacheEntry**, size_t);
+#endif
+
+enum {
+    CACHE_FORMAT_VERSION = 1, // Bump it when the key or the entry is changed.
+    CACHE_STALE_SECONDS = 60  // The temporary file older than it is left by the crashed compilation.
+};
+
+// Statistics of the cache.
+static size_t count_cache_hits;
+static size_t count_cache_misses;
+static size_t count_cache_stores;
+static size_t count_cache_evictions;
+static size_t count_cache_scans;
+
+// Write the key of the assembly of the preprocessed source into the buffer of 33 bytes.
+// The key is hashed from the source, the options which change the assembly and the compiler itself,
+// so the rebuilt compiler never reuses the assembly of the old one.
+void cache_key(char* key, char const* source, size_t inline_limit)
+{
+    size_t exe_mtime = 0;
+    size_t exe_size = 0;
+    stat_file("/proc/self/exe", &exe_mtime, &exe_size);
+
+    char header[128];
+    size_t header_len = sprintf(header, "9mm cache %d\n%zd\n", CACHE_FORMAT_VERSION, inline_limit);
+    header_len += sprintf(header + header_len, "%zd %zd\n", exe_mtime, exe_size);
+    size_t len = strlen(source);
+
+    // Four polynomial hashes modulo the different primes make the key of 124 bits.
+    size_t h0 = hash_lane(0, 1000003, 2147483647, header, header_len);
+    size_t h1 = hash_lane(0, 1000033, 2147483629, header, header_len);
+    size_t h2 = hash_lane(0, 1000037, 2147483587, header, header_len);
+    size_t h3 = hash_lane(0, 1000039, 2147483579, header, header_len);
+    h0 = hash_lane(h0, 1000003, 2147483647, source, len);
+    h1 = hash_lane(h1, 1000033, 2147483629, source, len);
+    h2 = hash_lane(h2, 1000037, 2147483587, source, len);
+    h3 = hash_lane(h3, 1000039, 2147483579, source, len);
+
+    sprintf(key, "%08zx%08zx", h0, h1);
+    sprintf(key + 16, "%08zx%08zx", h2, h3);
+}
+
+// The value is kept below 2^31, so the product never overflows and the signed division of the self-hosted build works.
+static size_t hash_lane(size_t h, size_t factor, size_t prime, char const* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        int c = data[i];
+        if (c < 0) {
+            c = c + 256;
+        }
+        h = h * factor + c;
+        h = h - h / prime * prime;
+    }
+    return h;
+}
+
+// Append the assembly of the key in the cache directory to the output, return 1 if it is found.
+// The entry is written by rename, so it is complete if it exists.
+int load_cache(char const* dir, char const* key, Buffer* out)
+{
+    char* path = cache_path(dir, key, ".s");
+    void* fp = fopen(path, "r");
+    if (fp == NULL) {
+        ++count_cache_misses;
+        free(path);
+        return 0;
+    }
+
+    char chunk[4096];
+    while (1) {
+        size_t size = fread(chunk, 1, 4096, fp);
+        if (size == 0) {
+            break;
+        }
+        buf_append(out, chunk, size);
+    }
+    fclose(fp);
+
+    // The modification time is the last use, the eviction removes the entries which are not used for the longest time.
+    utime(path, NULL);
+    free(path);
+
+    ++count_cache_hits;
+    return 1;
+}
+
+// Store the assembly of the key into the cache directory, and evict the old entries over the limit of the total bytes.
+// The entry is written into a temporary file and renamed, so the parallel compilations never read the partial entry.
+// The cache is best effort, it is not stored if the directory cannot be written.
+void store_cache(char const* dir, char const* key, char const* data, size_t len, size_t limit)
+{
+    make_dirs(dir);
+    if (!write_cache_file(dir, key, ".s", data, len)) {
+        return;
+    }
+    ++count_cache_stores;
+
+    // The directory is scanned only if the total which is kept in the file goes over the limit.
+    size_t total = 0;
+    if (read_cache_total(dir, &total) && total + len <= limit) {
+        write_cache_total(dir, total + len);
+        return;
+    }
+    write_cache_total(dir, evict_entries(dir, limit));
+}
+
+// Write the data into the file of the name in the cache directory by rename, return 1 if it succeeded.
+static int write_cache_file(char const* dir, char const* name, char const* suffix, char const* data, size_t len)
+{
+    char* path = cache_path(dir, name, suffix);
+    char* tmp_path = malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.%d.tmp", path, getpid());
+
+    int is_stored = 0;
+#ifndef SELFHOST_9MM
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#else
+    // FIXME: use O_WRONLY | O_CREAT | O_TRUNC and 0644.
+    int fd = open(tmp_path, 577, 420);
+#endif
+    if (0 <= fd) {
+        int is_written = write_all(fd, data, len);
+        close(fd);
+        if (is_written && rename(tmp_path, path) == 0) {
+            is_stored = 1;
+        } else {
+            unlink(tmp_path);
+        }
+    }
+    free(tmp_path);
+    free(path);
+    return is_stored;
+}
+
+// Read the total bytes of the entries which is kept in the file "total", return 1 if it is found.
+// The parallel compilations may lose the updates of each other, the scan of the eviction corrects it.
+static int read_cache_total(char const* dir, size_t* total)
+{
+    char* path = cache_path(dir, "total", "");
+    void* fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL) {
+        return 0;
+    }
+    int count = fscanf(fp, "%zd", total);
+    fclose(fp);
+    return count == 1;
+}
+
+static void write_cache_total(char const* dir, size_t total)
+{
+    char line[32];
+    size_t len = sprintf(line, "%zd\n", total);
+    write_cache_file(dir, "total", "", line, len);
+}
+
+static char* cache_path(char const* dir, char const* key, char const* suffix)
+{
+    char* path = malloc(strlen(dir) + strlen(key) + strlen(suffix) + 2);
+    sprintf(path, "%s/%s%s", dir, key, suffix);
+    return path;
+}
+
+// Create the directory and its parents if they do not exist.
+static void make_dirs(char const* dir)
+{
+    char* path = strdup(dir);
+    for (char* p = path + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            make_dir(path);
+            *p = '/';
+        }
+    }
+    make_dir(path);
+    free(path);
+}
+
+static void make_dir(char const* path)
+{
+#ifndef SELFHOST_9MM
+    mkdir(path, 0755);
+#else
+    mkdir(path, 493); // FIXME: use 0755.
+#endif
+}
+
+// Remove the least recently used entries until the total bytes of the entries is at most the limit, and return the total.
+// The directory is scanned once, and the temporary files which are left by the crashed compilations are removed.
+static size_t evict_entries(char const* dir, size_t limit)
+{
+    void* dp = opendir(dir);
+    if (dp == NULL) {
+        return 0;
+    }
+    ++count_cache_scans;
+
+    size_t stale_mtime = (time(NULL) - CACHE_STALE_SECONDS) * 1000000000;
+    size_t capacity = 64;
+    size_t count_entries = 0;
+    CacheEntry** entries = malloc(sizeof(CacheEntry*) * capacity);
+    size_t total = 0;
+    while (1) {
+#ifndef SELFHOST_9MM
+        struct dirent* dirent = readdir(dp);
+        if (dirent == NULL) {
+            break;
+        }
+        char const* name = dirent->d_name;
+#else
+        // FIXME: use struct dirent, "d_name" is at offset 19.
+        char* dirent = readdir(dp);
+        if (dirent == NULL) {
+            break;
+        }
+        char const* name = dirent + 19;
+#endif
+        size_t len = strlen(name);
+        int is_entry = 2 <= len && strcmp(name + len - 2, ".s") == 0;
+        int is_tmp = 4 <= len && strcmp(name + len - 4, ".tmp") == 0;
+        if (is_entry || is_tmp) {
+            CacheEntry* entry = calloc(1, sizeof(CacheEntry));
+            entry->path = cache_path(dir, name, "");
+            stat_file(entry->path, &entry->mtime, &entry->size);
+
+            if (is_tmp) {
+                // The temporary file which is being written by the other compilation is left.
+                if (entry->mtime < stale_mtime) {
+                    unlink(entry->path);
+                }
+                free(entry->path);
+                free(entry);
+            } else {
+                if (count_entries == capacity) {
+                    capacity *= 2;
+                    entries = realloc(entries, sizeof(CacheEntry*) * capacity);
+                }
+                entries[count_entries++] = entry;
+                total += entry->size;
+            }
+        }
+    }
+    closedir(dp);
+
+    // The oldest entries are removed first, the other compilation may have removed them.
+    CacheEntry** work = malloc(sizeof(CacheEntry*) * capacity);
+    sort_cache_entries(entries, work, count_entries);
+    for (size_t i = 0; i < count_entries; i++) {
+        CacheEntry* entry = entries[i];
+        if (limit < total) {
+            unlink(entry->path);
+            total -= entry->size;
+            ++count_cache_evictions;
+        }
+        free(entry->path);
+        free(entry);
+    }
+    free(work);
+    free(entries);
+
+    return total;
+}
+
+// Merge sort the entries by the modification time in ascending order, the work has the same length.
+static void sort_cache_entries(CacheEntry** entries, CacheEntry** work, size_t len)
+{
+    if (len < 2) {
+        return;
+    }
+    size_t mid = len / 2;
+    sort_cache_entries(entries, work, mid);
+    sort_cache_entries(entries + mid, work, len - mid);
+
+    size_t i = 0;
+    size_t j = mid;
+    for (size_t k = 0; k < len; k++) {
+        if (j == len || (i < mid && entries[i]->mtime <= entries[j]->mtime)) {
+            work[k] = entries[i++];
+        } else {
+            work[k] = entries[j++];
+        }
+    }
+    memcpy(entries, work, sizeof(CacheEntry*) * len);
+}
+
+void print_cache_stats(void)
+{
+    size_t count_lookups = count_cache_hits + count_cache_misses;
+    size_t hit_rate = 0;
+    if (0 < count_lookups) {
+        hit_rate = count_cache_hits * 100 / count_lookups;
+    }
+    fprintf(stderr, "# cache: %zd hits, %zd misses, %zd%% hit rate\n", count_cache_hits, count_cache_misses, hit_rate);
+    fprintf(stderr, "# cache: %zd stored, %zd evicted, %zd scans\n", count_cache_stores, count_cache_evictions, count_cache_scans);
+}
@@ -1,460 +1,1380 @@
 #include "9mm.h"
 
-static Context const* codegen_context;
+// Physical registers.
+// The first COUNT_ALLOC_REGS ones are allocated to the virtual registers.
+// "rax" and "rcx" are the scratch registers for the spilled operands, "rdx" is clobbered by idiv
+// and is the scratch register for the spilled index of the memory operand,
+// and the argument registers are written only to call functions.
+enum {
+    COUNT_ALLOC_REGS = 7,
+    FIRST_CALLEE_SAVED_REG = 2, // rbx and r12-r15 are preserved over calls.
+    REG_RAX = 7,
+    REG_RCX = 8,
+    REG_RDX = 9
+};
+
+static char const* regs64[10];
+static char const* regs32[10];
+static char const* regs8[10];
+
+static char const* arg_regs64[6];
+static char const* arg_regs32[6];
+static char const* arg_regs8[6];
+
+// Location and live interval of each virtual register in the current function.
+static size_t* vreg_reg;   // "index + 1" of the physical register, 0 if it is spilled.
+static size_t* vreg_slot;  // Offset of the spill slot from rbp.
+static size_t* vreg_start; // Position of the first instruction which refers it.
+static size_t* vreg_end;   // Position of the last instruction which refers it.
+static size_t* vreg_defs;  // The number of instructions which write it.
+static size_t* vreg_imm;   // 1 + the constant if it is written by IR_IMM, 0 otherwise.
+static size_t* vreg_uses;  // The number of instructions which read it.
+static size_t* vreg_cond;  // Comparison which is fused into the following IR_BR, 0 otherwise.
+static size_t* vreg_scale; // Scale if the multiplication is fused into the following IR_ADD, 0 otherwise.
+static size_t* vreg_index; // Index which is multiplied by the scale.
+static IrInsn const** vreg_mem_def; // Definition of the address folded into the memory operand, NULL otherwise.
+static int* vreg_tail_call; // 1 if the call which writes it is returned at once, it jumps to the callee instead.
+
+// Components of the memory operand which is being built by collect_mem().
+static char const* mem_base;
+static char const* mem_symbol;
+static char const* mem_index;
+static size_t mem_scale;
+static size_t mem_disp;
+
+// Statistics of the strength reduction.
+static size_t count_shifts;
+static size_t count_leas;
+static size_t count_magic_divs;
+
+// The number of the addresses folded into the memory operands.
+static size_t count_folded_addrs;
+
+// The number of the calls which reuse the frame of the caller.
+static size_t count_tail_calls;
+
+// The number of the constants which are used as the immediate operands instead of the registers.
+static size_t count_forwarded_imms;
+
+// Function which is being generated.
+static IrFunction const* codegen_function;
+
+// 1 if the current function calls itself in tail position, it jumps back after the prologue.
+static int has_self_tail_call;
+
+// Virtual register which occupies the physical register, 0 if it is free.
+static size_t reg_owner[7];
+
+// 1 if the callee-saved register is used in the current function.
+static int is_reg_saved[7];
+
+static size_t count_spills;
 
 #ifndef SELFHOST_9MM
-static void gen(Node const*);
-static void gen_loading_value(Node const*);
-static void gen_var_addr(Node const*);
+static void emit_global(Code const*, char const*);
+static void init_regs(void);
+static void gen_function(IrFunction const*);
+static void compute_intervals(IrFunction const*, size_t*);
+static void allocate_regs(IrFunction const*, size_t const*, size_t);
+static void alloc_vreg(size_t, int, size_t);
+static void gen_insn(IrInsn const*, BasicBlock const*);
+static void find_fused_conds(IrFunction const*);
+static void find_scaled_indexes(IrFunction const*);
+static void find_tail_calls(IrFunction const*);
+static void select_addresses(IrFunction const*);
+static int select_address(BasicBlock const*, size_t, size_t, int, size_t);
+static IrInsn const* find_def(BasicBlock const*, size_t, size_t);
+static size_t add_base(IrInsn const*);
+static void keep_alive(size_t, size_t);
+static void gen_mem(char*, size_t, size_t);
+static void collect_mem(size_t);
+static void append_num(char*, size_t);
+static void gen_scaled_add(IrInsn const*, size_t);
+static int gen_mul_const(IrInsn const*);
+static int gen_div_const(IrInsn const*);
+static size_t div_magic(size_t, int);
+static int log2_exact(size_t);
+static int is_small_const(size_t);
+static void gen_cond_jump(int, BasicBlock const*, BasicBlock const*, BasicBlock const*);
+static void gen_epilogue(char const*);
+static size_t dst_reg(size_t);
+static size_t use_vreg(size_t, size_t);
+static void load_vreg(size_t, size_t);
+static void store_dst(size_t, size_t);
+static void emit_op_vreg(char const*, size_t, size_t);
+static int is_const(size_t);
+static size_t const_value(size_t);
+static int fits_imm(size_t, size_t);
 #endif
 
-void generate(Code const* code)
+void generate(Code const* code, Vector const* functions)
 {
-    puts(".intel_syntax noprefix");
-    puts(".global main\n");
+    init_regs();
+
+    emit(".intel_syntax noprefix\n\n");
 
     Vector const* keys = code->str_label_map->keys;
     if (keys->len != 0) {
         // Define string literals.
-        puts(".data");
-        puts(".align 8");
+        emit(".data\n");
+        emit(".align 8\n");
         for (size_t i = keys->len; 0 < i; i--) {
             char const* str = code->str_label_map->keys->data[i - 1];
             char const* label = code->str_label_map->vals->data[i - 1];
-            printf("%s:\n", label);
-            printf("  .string %s\n", str);
+            emit_label(label);
+            emit("  .string ");
+            emit(str);
+            emit("\n");
         }
-        putchar('\n');
+        emit("\n");
     }
 
     // Allocate the global variable spaces.
-    puts("# Global variables");
-    puts(".bss");
-    puts(".align 32");
+    emit("# Global variables\n");
+    emit(".bss\n");
+    emit(".align 32\n");
     Node const* const* asts = code->asts;
     for (size_t i = 0; i < code->count_ast; ++i) {
         if (asts[i]->ty == ND_GVAR_NEW) {
-            printf("%s:\n", asts[i]->name);
-            printf("  .zero %zd\n", asts[i]->rtype->size);
+            emit_global(code, asts[i]->name);
+            emit_label(asts[i]->name);
+            emit("  .zero ");
+            emit_num(asts[i]->rtype->size);
+            emit("\n");
         }
     }
-    putchar('\n');
-    puts(".text");
+    emit("\n.text\n");
 
-    for (size_t i = 0; i < code->count_ast; ++i) {
-        gen(asts[i]);
+    for (size_t i = 0; i < functions->len; ++i) {
+        IrFunction const* func = functions->data[i];
+        emit("\n");
+        emit_global(code, func->name);
+        gen_function(func);
     }
 }
 
-static void gen(Node const* node)
+// Export the symbol to the other files unless it is static.
+static void emit_global(Code const* code, char const* name)
 {
-    char* regs64[6];
-    regs64[0] = "rdi";
-    regs64[1] = "rsi";
-    regs64[2] = "rdx";
-    regs64[3] = "rcx";
-    regs64[4] = "r8";
-    regs64[5] = "r9";
+    if (map_get(code->static_names, name) != NULL) {
+        return;
+    }
+    emit(".global ");
+    emit(name);
+    emit("\n");
+}
 
-    char* regs32[6];
-    regs32[0] = "edi";
-    regs32[1] = "esi";
-    regs32[2] = "edx";
-    regs32[3] = "ecx";
-    regs32[4] = "r8d";
-    regs32[5] = "r9d";
+static void init_regs(void)
+{
+    regs64[0] = "r10";
+    regs64[1] = "r11";
+    regs64[2] = "rbx";
+    regs64[3] = "r12";
+    regs64[4] = "r13";
+    regs64[5] = "r14";
+    regs64[6] = "r15";
+    regs64[REG_RAX] = "rax";
+    regs64[REG_RCX] = "rcx";
+    regs64[REG_RDX] = "rdx";
+
+    regs32[0] = "r10d";
+    regs32[1] = "r11d";
+    regs32[2] = "ebx";
+    regs32[3] = "r12d";
+    regs32[4] = "r13d";
+    regs32[5] = "r14d";
+    regs32[6] = "r15d";
+    regs32[REG_RAX] = "eax";
+    regs32[REG_RCX] = "ecx";
+    regs32[REG_RDX] = "edx";
+
+    regs8[0] = "r10b";
+    regs8[1] = "r11b";
+    regs8[2] = "bl";
+    regs8[3] = "r12b";
+    regs8[4] = "r13b";
+    regs8[5] = "r14b";
+    regs8[6] = "r15b";
+    regs8[REG_RAX] = "al";
+    regs8[REG_RCX] = "cl";
+    regs8[REG_RDX] = "dl";
+
+
+    arg_regs64[0] = "rdi";
+    arg_regs64[1] = "rsi";
+    arg_regs64[2] = "rdx";
+    arg_regs64[3] = "rcx";
+    arg_regs64[4] = "r8";
+    arg_regs64[5] = "r9";
+
+    arg_regs32[0] = "edi";
+    arg_regs32[1] = "esi";
+    arg_regs32[2] = "edx";
+    arg_regs32[3] = "ecx";
+    arg_regs32[4] = "r8d";
+    arg_regs32[5] = "r9d";
+
+    arg_regs8[0] = "dil";
+    arg_regs8[1] = "sil";
+    arg_regs8[2] = "dl";
+    arg_regs8[3] = "cl";
+    arg_regs8[4] = "r8b";
+    arg_regs8[5] = "r9b";
+}
 
-    if (node->ty == '!') {
-        gen(node->lhs);
-        printf("  xor rdx, rdx\n");
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  sete dl\n");
-        printf("  push rdx\n");
+static void gen_function(IrFunction const* func)
+{
+    codegen_function = func;
+    has_self_tail_call = 0;
+
+    size_t count_vregs = func->count_vregs + 1;
+    vreg_reg = calloc(count_vregs, sizeof(size_t));
+    vreg_slot = calloc(count_vregs, sizeof(size_t));
+    vreg_start = calloc(count_vregs, sizeof(size_t));
+    vreg_end = calloc(count_vregs, sizeof(size_t));
+    vreg_defs = calloc(count_vregs, sizeof(size_t));
+    vreg_imm = calloc(count_vregs, sizeof(size_t));
+    vreg_uses = calloc(count_vregs, sizeof(size_t));
+    vreg_cond = calloc(count_vregs, sizeof(size_t));
+    vreg_scale = calloc(count_vregs, sizeof(size_t));
+    vreg_index = calloc(count_vregs, sizeof(size_t));
+    vreg_mem_def = calloc(count_vregs, sizeof(IrInsn*));
+    vreg_tail_call = calloc(count_vregs, sizeof(int));
+
+    // The number of calls until each position to find the intervals over calls.
+    size_t count_insns = 0;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        count_insns += block->insns->len;
+    }
+    size_t* count_calls_until = calloc(count_insns + 1, sizeof(size_t));
+
+    // The spill slots are placed under the local variables.
+    size_t locals_size = (func->frame_size + 7) / 8 * 8;
+
+    compute_intervals(func, count_calls_until);
+    find_fused_conds(func);
+    find_scaled_indexes(func);
+    find_tail_calls(func);
+    select_addresses(func);
+    allocate_regs(func, count_calls_until, locals_size);
+
+    // Keep rsp aligned with 16 bytes at calls, nothing is pushed in the body.
+    size_t count_saved = 0;
+    for (int i = FIRST_CALLEE_SAVED_REG; i < COUNT_ALLOC_REGS; i++) {
+        count_saved += is_reg_saved[i];
+    }
+    size_t frame_size = locals_size + count_spills * 8;
+    size_t total_size = frame_size + count_saved * 8;
+    if (total_size / 16 * 16 != total_size) {
+        frame_size += 8;
+    }
 
-        return;
+    emit_label(func->name);
+
+    // Prologue.
+    emit_op1("push", "rbp");
+    emit_op2("mov", "rbp", "rsp");
+    if (frame_size != 0) {
+        emit_op_num("sub", "rsp", frame_size);
+    }
+    for (int i = FIRST_CALLEE_SAVED_REG; i < COUNT_ALLOC_REGS; i++) {
+        if (is_reg_saved[i]) {
+            emit_op1("push", regs64[i]);
+        }
+    }
+    if (has_self_tail_call) {
+        emit_label_ptr(".L_entry_", func);
     }
 
-    if (node->ty == ND_AND) {
-        gen(node->lhs);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .false_%p\n", node);
-        gen(node->rhs);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .true_%p\n", node);
-        printf(".false_%p:\n", node);
-        printf("  push 0\n");
-        printf("  jmp .end_and_%p\n", node);
-        printf(".true_%p:\n", node);
-        printf("  push 1\n");
-        printf(".end_and_%p:\n", node);
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        BasicBlock const* next = NULL;
+        if (i + 1 < func->blocks->len) {
+            next = func->blocks->data[i + 1];
+        }
 
-        return;
+        if (block->preds->len != 0) {
+            emit_label_ptr(".L_bb_", block);
+        }
+        for (size_t j = 0; j < block->insns->len; j++) {
+            gen_insn(block->insns->data[j], next);
+        }
     }
 
-    if (node->ty == ND_OR) {
-        gen(node->lhs);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .true_%p\n", node);
-        gen(node->rhs);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .true_%p\n", node);
-        printf(".false_%p:\n", node);
-        printf("  push 0\n");
-        printf("  jmp .end_or_%p\n", node);
-        printf(".true_%p:\n", node);
-        printf("  push 1\n");
-        printf(".end_or_%p:\n", node);
+    free(vreg_reg);
+    free(vreg_slot);
+    free(vreg_start);
+    free(vreg_end);
+    free(vreg_defs);
+    free(vreg_imm);
+    free(vreg_uses);
+    free(vreg_cond);
+    free(vreg_scale);
+    free(vreg_index);
+    free(vreg_mem_def);
+    free(vreg_tail_call);
+    codegen_function = NULL;
+    free(count_calls_until);
+}
 
-        return;
+// Find the live interval of each virtual register in the layout order of the instructions.
+// The positions start from 1.
+static void compute_intervals(IrFunction const* func, size_t* count_calls_until)
+{
+    size_t count_blocks = func->blocks->len;
+    size_t* block_first = calloc(count_blocks, sizeof(size_t));
+    size_t* block_last = calloc(count_blocks, sizeof(size_t));
+
+    size_t pos = 0;
+    for (size_t i = 0; i < count_blocks; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        block_first[i] = pos + 1;
+
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            ++pos;
+
+            if (insn->dst != 0) {
+                ++vreg_defs[insn->dst];
+                if (insn->op == IR_IMM) {
+                    vreg_imm[insn->dst] = insn->imm + 1;
+                }
+            }
+
+            size_t refs[9];
+            size_t count_refs = 0;
+            refs[count_refs++] = insn->dst;
+            refs[count_refs++] = insn->lhs;
+            refs[count_refs++] = insn->rhs;
+            if (insn->args != NULL) {
+                for (size_t k = 0; k < insn->args->len; k++) {
+                    refs[count_refs++] = (size_t)insn->args->data[k];
+                }
+            }
+
+            for (size_t k = 1; k < count_refs; k++) {
+                if (refs[k] != 0) {
+                    ++vreg_uses[refs[k]];
+                }
+            }
+
+            for (size_t k = 0; k < count_refs; k++) {
+                size_t v = refs[k];
+                if (v != 0) {
+                    if (vreg_start[v] == 0 || pos < vreg_start[v]) {
+                        vreg_start[v] = pos;
+                    }
+                    if (vreg_end[v] < pos) {
+                        vreg_end[v] = pos;
+                    }
+                }
+            }
+
+            count_calls_until[pos] = count_calls_until[pos - 1];
+            if (insn->op == IR_CALL) {
+                ++count_calls_until[pos];
+            }
+        }
+
+        block_last[i] = pos;
     }
 
-    if (node->ty == ND_INCL_POST || node->ty == ND_DECL_POST) {
-        // Load value from variable.
-        gen(node->lhs);
-        // Keep the loaded value on the stack and update the variable.
-        gen(node->rhs);
-        // Discard the result of update.
-        printf("  pop rax\n");
-        return;
+    // The values which are live at the head of a loop have to survive until its back edge.
+    int is_changed = 1;
+    while (is_changed) {
+        is_changed = 0;
+        for (size_t i = 0; i < count_blocks; i++) {
+            BasicBlock const* block = func->blocks->data[i];
+            for (size_t j = 0; j < block->succs->len; j++) {
+                BasicBlock const* succ = block->succs->data[j];
+                size_t head = block_first[succ->index];
+                size_t tail = block_last[i];
+
+                // Only the back edges are checked.
+                for (size_t v = 1; head <= tail && v <= func->count_vregs; v++) {
+                    if (vreg_start[v] < head && head <= vreg_end[v] && vreg_end[v] < tail) {
+                        vreg_end[v] = tail;
+                        is_changed = 1;
+                    }
+                }
+            }
+        }
     }
 
-    if (node->ty == ND_STR) {
-        printf("  lea rax, %s\n", node->label);
-        printf("  push rax\n");
-        return;
+    free(block_first);
+    free(block_last);
+}
+
+// Find the comparisons whose results are used only by the branches just after them.
+// They set the flags for the conditional jumps instead of their registers.
+static void find_fused_conds(IrFunction const* func)
+{
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        size_t len = block->insns->len;
+        if (2 <= len) {
+            IrInsn const* last = block->insns->data[len - 1];
+            IrInsn const* prev = block->insns->data[len - 2];
+            int op = prev->op;
+            int is_cmp = op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE;
+            size_t v = prev->dst;
+            if (last->op == IR_BR && is_cmp && last->lhs == v && vreg_defs[v] == 1 && vreg_uses[v] == 1) {
+                vreg_cond[v] = op;
+            }
+        }
     }
+}
 
-    if (node->ty == ND_GVAR_NEW) {
-        return;
+// Find the multiplications by 2, 4 or 8 whose results are used only by the additions just after them.
+// They are computed by "lea" of the additions like "[base+index*4]".
+static void find_scaled_indexes(IrFunction const* func)
+{
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j + 1 < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            IrInsn const* next = block->insns->data[j + 1];
+            size_t v = insn->dst;
+            if (insn->op == IR_MUL && next->op == IR_ADD && (next->lhs == v) != (next->rhs == v) &&
+                vreg_defs[v] == 1 && vreg_uses[v] == 1) {
+                size_t scale = insn->rhs;
+                size_t index = insn->lhs;
+                if (is_const(index)) {
+                    scale = insn->lhs;
+                    index = insn->rhs;
+                }
+
+                if (is_const(scale) && !is_const(index)) {
+                    size_t n = const_value(scale);
+                    if (n == 2 || n == 4 || n == 8) {
+                        vreg_scale[v] = n;
+                        vreg_index[v] = index;
+                    }
+                }
+            }
+        }
     }
+}
 
-    if (node->ty == ND_REF) {
-        gen_var_addr(node->lhs);
-        return;
+// Find the calls whose results are returned just after them.
+// They jump to the callees after the frame is released, so the arguments must not point into the frame.
+// All the arguments are passed by the registers because there are 6 of them at most.
+static void find_tail_calls(IrFunction const* func)
+{
+    size_t count_vregs = func->count_vregs + 1;
+    int* is_local_addr = calloc(count_vregs, sizeof(int));
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->op == IR_LOCAL) {
+                is_local_addr[insn->dst] = 1;
+            }
+        }
+    }
+
+    // The address of the local escapes unless it is used only to load and store.
+    int is_escaped = 0;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->op != IR_LOAD && insn->op != IR_STORE && is_local_addr[insn->lhs]) {
+                is_escaped = 1;
+            }
+            if (is_local_addr[insn->rhs]) {
+                is_escaped = 1;
+            }
+            if (insn->op == IR_CALL) {
+                for (size_t k = 0; k < insn->args->len; k++) {
+                    size_t v = (size_t)insn->args->data[k];
+                    if (is_local_addr[v]) {
+                        is_escaped = 1;
+                    }
+                }
+            }
+        }
     }
+    free(is_local_addr);
 
-    if (node->ty == ND_DEREF) {
-        gen(node->lhs);
-        gen_loading_value(node);
+    if (is_escaped) {
         return;
     }
 
-    if (node->ty == ND_FUNCTION) {
-        if (node->lhs == NULL) {
-            // Skip protorype.
-            // FIXME: do not include this node in AST.
-            return;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        size_t len = block->insns->len;
+        if (2 <= len) {
+            IrInsn const* insn = block->insns->data[len - 2];
+            IrInsn const* ret = block->insns->data[len - 1];
+            if (insn->op == IR_CALL && ret->op == IR_RET && ret->lhs == insn->dst) {
+                vreg_tail_call[insn->dst] = 1;
+                ++count_tail_calls;
+                if (strcmp(insn->name, func->name) == 0) {
+                    has_self_tail_call = 1;
+                }
+            }
         }
+    }
+}
 
-        printf("\n%s:\n", node->function->name);
-
-        codegen_context = node->function->context;
-
-        // Prorogue.
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-
-        // Store arguments into the local stack.
-        // FIXME: keep this size in the context.
-        size_t used_size = 0;
-        for (size_t i = 0; i < node->function->args->len; i++) {
-            Node* arg = node->function->args->data[i];
-
-            if (arg->rtype->size == 1) {
-                printf("  mov rax, %s\n", regs64[i]);
-                printf("  sub rsp, 1\n");
-                printf("  mov [rsp], al\n");
-                used_size += 1;
-            } else if (arg->rtype->size == 4) {
-                printf("  sub rsp, 4\n");
-                printf("  mov [rsp], %s\n", regs32[i]);
-                used_size += 4;
-            } else if (arg->rtype->size == 8) {
-                printf("  push %s\n", regs64[i]);
-                used_size += 8;
-            } else {
-                error("Not supported");
+// Fold the addresses which are used only by IR_LOAD or IR_STORE into their memory operands
+// like "[rbp-8]", "[rip+name+4]" and "[base+index*4+8]".
+static void select_addresses(IrFunction const* func)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            ++pos;
+            if ((insn->op == IR_LOAD || insn->op == IR_STORE) && select_address(block, j, insn->lhs, 0, pos)) {
+                ++count_folded_addrs;
             }
         }
+    }
+}
 
-        // Allocate the local variable space without argumens.
-        printf("  sub rsp, %zd\n", codegen_context->current_offset - used_size);
-
-        gen(node->lhs);
+// Return 1 if the address v is folded into the memory operand of the j-th instruction at pos.
+// The registers which the operand refers are kept alive until pos.
+static int select_address(BasicBlock const* block, size_t j, size_t v, int has_index, size_t pos)
+{
+    if (vreg_defs[v] != 1 || vreg_uses[v] != 1) {
+        return 0;
+    }
+    IrInsn const* def = find_def(block, j, v);
+    if (def == NULL) {
+        return 0;
+    }
 
-        // Epilogue.
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+    if (def->op == IR_LOCAL || (def->op == IR_GLOBAL && !has_index)) {
+        vreg_mem_def[v] = def;
+        return 1;
+    }
 
-        codegen_context = NULL;
+    if (def->op != IR_ADD) {
+        return 0;
+    }
 
-        return;
+    size_t base = add_base(def);
+    size_t other = def->lhs;
+    if (base == other) {
+        other = def->rhs;
+    }
+    if (is_const(base) || vreg_scale[base] != 0 || vreg_defs[base] != 1) {
+        return 0;
     }
 
-    if (node->ty == ND_CALL) {
-        Vector* args = node->call->arguments;
-        if (6 < args->len) {
-            error("The number of arguments has to be less than 6");
+    if (is_const(other)) {
+        // [base+disp]
+        if (!fits_imm(const_value(other), 4)) {
+            return 0;
+        }
+    } else {
+        // [base+index*scale]
+        size_t index = other;
+        if (vreg_scale[other] != 0) {
+            index = vreg_index[other];
+        }
+        if (has_index || vreg_defs[index] != 1) {
+            return 0;
         }
+        has_index = 1;
+        keep_alive(index, pos);
+    }
 
-        for (size_t i = 0; i < args->len; i++) {
-            gen(args->data[i]);
+    vreg_mem_def[v] = def;
+    if (!select_address(block, j, base, has_index, pos)) {
+        keep_alive(base, pos);
+    }
+    return 1;
+}
+
+// Return the definition of v in the block before the j-th instruction, NULL if it is not found.
+static IrInsn const* find_def(BasicBlock const* block, size_t j, size_t v)
+{
+    for (size_t k = j; 0 < k; k--) {
+        IrInsn const* insn = block->insns->data[k - 1];
+        if (insn->dst == v) {
+            return insn;
         }
+    }
+    return NULL;
+}
 
-        printf("  # call %s\n", node->call->name);
-        for (size_t i = 0; i < args->len; i++) {
-            printf("  pop %s\n", regs64[args->len - 1 - i]);
+// Return the operand of the addition which is used as the base register, the other is the index or the displacement.
+static size_t add_base(IrInsn const* add)
+{
+    if (vreg_scale[add->lhs] != 0 || is_const(add->lhs)) {
+        return add->rhs;
+    }
+    return add->lhs;
+}
+
+static void keep_alive(size_t v, size_t pos)
+{
+    if (vreg_end[v] < pos) {
+        vreg_end[v] = pos;
+    }
+}
+
+// Assign the physical registers to the virtual registers by linear scan.
+static void allocate_regs(IrFunction const* func, size_t const* count_calls_until, size_t locals_size)
+{
+    for (int i = 0; i < COUNT_ALLOC_REGS; i++) {
+        reg_owner[i] = 0;
+        is_reg_saved[i] = 0;
+    }
+    count_spills = 0;
+
+    size_t pos = 0;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            ++pos;
+
+            // Release the registers whose intervals end here, the result can reuse them.
+            for (int r = 0; r < COUNT_ALLOC_REGS; r++) {
+                if (reg_owner[r] != 0 && vreg_end[reg_owner[r]] <= pos) {
+                    reg_owner[r] = 0;
+                }
+            }
+
+            // The constants are given to their users as the immediates.
+            size_t v = insn->dst;
+            if (v != 0 && vreg_start[v] == pos && !is_const(v) && vreg_cond[v] == 0 && vreg_scale[v] == 0 &&
+                vreg_mem_def[v] == NULL) {
+                size_t end = vreg_end[v];
+                int is_over_call = pos + 1 < end && count_calls_until[pos] < count_calls_until[end - 1];
+                alloc_vreg(v, is_over_call, locals_size);
+            }
         }
+    }
+}
 
-        // Align rsp with 16bytes.
-        printf("  mov rax, rsp\n");
-        printf("  and rsp, -8\n");
-        printf("  push rax\n");
-        printf("  xor al, al\n"); // for variadic function call.
-        printf("  call %s\n", node->call->name);
-        printf("  pop rsp\n");
-        printf("  push rax\n");
+static void alloc_vreg(size_t v, int is_over_call, size_t locals_size)
+{
+    // Only the callee-saved registers survive calls.
+    int first = 0;
+    if (is_over_call) {
+        first = FIRST_CALLEE_SAVED_REG;
+    }
 
-        return;
+    int reg = COUNT_ALLOC_REGS;
+    for (int r = first; r < COUNT_ALLOC_REGS; r++) {
+        if (reg == COUNT_ALLOC_REGS && reg_owner[r] == 0) {
+            reg = r;
+        }
     }
 
-    if (node->ty == ND_BLOCK) {
-        for (size_t i = 0; i < node->stmts->len; i++) {
-            gen(node->stmts->data[i]);
-            printf("  pop rax\n");
+    if (reg == COUNT_ALLOC_REGS) {
+        // Spill the interval which ends last.
+        size_t spilled = v;
+        for (int r = first; r < COUNT_ALLOC_REGS; r++) {
+            if (vreg_end[spilled] < vreg_end[reg_owner[r]]) {
+                spilled = reg_owner[r];
+                reg = r;
+            }
+        }
+
+        vreg_reg[spilled] = 0;
+        ++count_spills;
+        vreg_slot[spilled] = locals_size + count_spills * 8;
+        if (spilled == v) {
+            return;
         }
-        // The last one is used the result.
-        printf("  push rax\n");
-        return;
     }
 
-    if (node->ty == ND_IF) {
-        gen(node->if_else->condition);
+    vreg_reg[v] = reg + 1;
+    reg_owner[reg] = v;
+    if (FIRST_CALLEE_SAVED_REG <= reg) {
+        is_reg_saved[reg] = 1;
+    }
+}
 
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L_else_%p\n", node->if_else);
+static void gen_insn(IrInsn const* insn, BasicBlock const* next)
+{
+    int op = insn->op;
 
-        gen(node->if_else->body);
+    if (op == IR_IMM) {
+        if (is_const(insn->dst)) {
+            ++count_forwarded_imms;
+            return;
+        }
 
-        if (node->if_else->else_body == NULL) {
-            printf("  .L_else_%p:\n", node->if_else);
-            // Push dummy value.
-            printf("  push 0\n");
+        size_t dst = dst_reg(insn->dst);
+        emit_op_num("mov", regs64[dst], insn->imm);
+        store_dst(dst, insn->dst);
+        return;
+    }
+
+    if (op == IR_MOV) {
+        size_t dst = dst_reg(insn->dst);
+        if (insn->imm == 1) {
+            size_t src = use_vreg(insn->lhs, dst);
+            emit_op2("movzx", regs64[dst], regs8[src]);
+        } else if (insn->imm == 4) {
+            // Writing the 32-bit register clears the upper half.
+            size_t src = use_vreg(insn->lhs, dst);
+            emit_op2("mov", regs32[dst], regs32[src]);
         } else {
-            printf("  jmp .L_if_end_%p\n", node->if_else);
-            printf("  .L_else_%p:\n", node->if_else);
-            gen(node->if_else->else_body);
-            printf("  .L_if_end_%p:\n", node->if_else);
+            load_vreg(dst, insn->lhs);
         }
+        store_dst(dst, insn->dst);
+        return;
+    }
 
+    if (op == IR_ARG) {
+        size_t dst = dst_reg(insn->dst);
+        emit_op2("mov", regs64[dst], arg_regs64[insn->imm]);
+        store_dst(dst, insn->dst);
         return;
     }
 
-    if (node->ty == ND_BREAK) {
-        // Push dummy value.
-        printf("  push 0\n");
-        printf("  jmp %s\n", node->break_label);
+    if (insn->dst != 0 && vreg_mem_def[insn->dst] != NULL) {
+        // It is folded into the memory operand of its user.
+        return;
+    }
 
+    if (op == IR_MUL && vreg_scale[insn->dst] != 0) {
+        // It is computed by the following addition.
         return;
     }
 
-    if (node->ty == ND_WHILE) {
-        printf("  .L_while_begin_%p:\n", node);
+    if (op == IR_ADD && vreg_scale[insn->rhs] != 0) {
+        gen_scaled_add(insn, insn->rhs);
+        return;
+    }
 
-        gen(node->lhs);
+    if (op == IR_ADD && vreg_scale[insn->lhs] != 0) {
+        gen_scaled_add(insn, insn->lhs);
+        return;
+    }
 
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je %s\n", node->break_label);
+    if (op == IR_MUL && gen_mul_const(insn)) {
+        return;
+    }
 
-        gen(node->rhs);
-        printf("  jmp .L_while_begin_%p\n", node);
+    if (op == IR_DIV && gen_div_const(insn)) {
+        return;
+    }
 
-        printf("  %s:\n", node->break_label);
+    if (op == IR_ADD || op == IR_SUB || op == IR_MUL) {
+        char* mnemonic = "add";
+        if (op == IR_SUB) {
+            mnemonic = "sub";
+        } else if (op == IR_MUL) {
+            mnemonic = "imul";
+        }
 
+        size_t dst = dst_reg(insn->dst);
+        if (vreg_reg[insn->rhs] == dst + 1 && vreg_reg[insn->lhs] != dst + 1) {
+            // The result register has rhs, so lhs cannot be moved into it first.
+            if (op == IR_SUB) {
+                load_vreg(REG_RAX, insn->lhs);
+                emit_op_vreg(mnemonic, REG_RAX, insn->rhs);
+                emit_op2("mov", regs64[dst], "rax");
+            } else {
+                emit_op_vreg(mnemonic, dst, insn->lhs);
+            }
+        } else {
+            load_vreg(dst, insn->lhs);
+            emit_op_vreg(mnemonic, dst, insn->rhs);
+        }
+        store_dst(dst, insn->dst);
         return;
     }
 
-    if (node->ty == ND_FOR) {
-        if (node->fors->initializing != NULL) {
-            gen(node->fors->initializing);
+    if (op == IR_DIV) {
+        // cqo instruction expands value in rax 128 and set rdx and rax.
+        load_vreg(REG_RAX, insn->lhs);
+        emit_op0("cqo");
+        size_t rhs = use_vreg(insn->rhs, REG_RCX);
+        emit_op1("idiv", regs64[rhs]);
+
+        size_t dst = dst_reg(insn->dst);
+        if (dst != REG_RAX) {
+            emit_op2("mov", regs64[dst], "rax");
         }
-        printf("  .L_for_begin_%p:\n", node->fors);
+        store_dst(dst, insn->dst);
+        return;
+    }
 
-        if (node->fors->condition != NULL) {
-            gen(node->fors->condition);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je %s\n", node->fors->break_label);
+    if (op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE || op == IR_NOT) {
+        size_t lhs = use_vreg(insn->lhs, REG_RAX);
+        if (vreg_cond[insn->dst] != 0) {
+            // Only the flags are set for the following branch.
+            emit_op_vreg("cmp", lhs, insn->rhs);
+            return;
         }
 
-        gen(node->fors->body);
-        if (node->fors->updating != NULL) {
-            gen(node->fors->updating);
+        if (op == IR_NOT) {
+            emit_op2("cmp", regs64[lhs], "0");
+            emit_op1("sete", "al");
+        } else {
+            emit_op_vreg("cmp", lhs, insn->rhs);
+            if (op == IR_EQ) {
+                emit_op1("sete", "al");
+            } else if (op == IR_NE) {
+                emit_op1("setne", "al");
+            } else if (op == IR_LT) {
+                emit_op1("setl", "al");
+            } else {
+                emit_op1("setle", "al");
+            }
         }
 
-        printf("  jmp .L_for_begin_%p\n", node->fors);
+        size_t dst = dst_reg(insn->dst);
+        emit_op2("movzx", regs64[dst], "al");
+        store_dst(dst, insn->dst);
+        return;
+    }
+
+    if (op == IR_LOCAL) {
+        size_t dst = dst_reg(insn->dst);
+        emit_op_reg_mem("lea", regs64[dst], "rbp", insn->imm);
+        store_dst(dst, insn->dst);
+        return;
+    }
+
+    if (op == IR_GLOBAL) {
+        size_t dst = dst_reg(insn->dst);
+        emit_op2("lea", regs64[dst], insn->name);
+        store_dst(dst, insn->dst);
+        return;
+    }
 
-        printf("  %s:\n", node->fors->break_label);
+    if (op == IR_LOAD) {
+        char mem[160];
+        gen_mem(mem, insn->lhs, insn->imm == 1);
+        size_t dst = dst_reg(insn->dst);
+        if (insn->imm == 1) {
+            emit_op2("movzx", regs64[dst], mem);
+        } else if (insn->imm == 4) {
+            emit_op2("mov", regs32[dst], mem);
+        } else if (insn->imm == 8) {
+            emit_op2("mov", regs64[dst], mem);
+        } else {
+            error("Not supported");
+        }
+        store_dst(dst, insn->dst);
+        return;
+    }
 
+    if (op == IR_STORE) {
+        char mem[160];
+        if (is_const(insn->rhs) && fits_imm(const_value(insn->rhs), insn->imm)) {
+            if (insn->imm == 1) {
+                strcpy(mem, "BYTE PTR ");
+            } else if (insn->imm == 4) {
+                strcpy(mem, "DWORD PTR ");
+            } else {
+                strcpy(mem, "QWORD PTR ");
+            }
+            gen_mem(mem + strlen(mem), insn->lhs, 0);
+            emit_op_num("mov", mem, const_value(insn->rhs));
+            return;
+        }
+
+        gen_mem(mem, insn->lhs, 0);
+        size_t value = use_vreg(insn->rhs, REG_RCX);
+        if (insn->imm == 1) {
+            emit_op2("mov", mem, regs8[value]);
+        } else if (insn->imm == 4) {
+            emit_op2("mov", mem, regs32[value]);
+        } else if (insn->imm == 8) {
+            emit_op2("mov", mem, regs64[value]);
+        } else {
+            error("Not supported");
+        }
         return;
     }
 
-    if (node->ty == ND_RETURN) {
-        gen(node->lhs);
-        printf("  pop rax\n");
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+    if (op == IR_CALL) {
+        emit("  # call ");
+        emit(insn->name);
+        emit("\n");
+
+        // The argument registers are not allocated, so they can be written in any order.
+        for (size_t i = 0; i < insn->args->len; i++) {
+            size_t v = (size_t)insn->args->data[i];
+            if (is_const(v)) {
+                emit_op_num("mov", arg_regs64[i], const_value(v));
+            } else if (vreg_reg[v] == 0) {
+                emit_op_reg_mem("mov", arg_regs64[i], "rbp", vreg_slot[v]);
+            } else {
+                emit_op2("mov", arg_regs64[i], regs64[vreg_reg[v] - 1]);
+            }
+        }
+
+        emit_op2("xor", "al", "al"); // for variadic function call.
+        if (vreg_tail_call[insn->dst]) {
+            if (strcmp(insn->name, codegen_function->name) == 0) {
+                // The arguments are read again from the registers as well as the first call.
+                emit_jump("jmp", ".L_entry_", codegen_function);
+            } else {
+                // The callee returns to the caller of this function.
+                gen_epilogue(insn->name);
+            }
+            return;
+        }
+        emit_op1("call", insn->name);
+
+        size_t dst = dst_reg(insn->dst);
+        if (dst != REG_RAX) {
+            emit_op2("mov", regs64[dst], "rax");
+        }
+        store_dst(dst, insn->dst);
         return;
     }
 
-    if (node->ty == ND_NUM) {
-        printf("  mov rax, %zd\n", node->val);
-        printf("  push rax\n");
+    if (op == IR_RET) {
+        if (!vreg_tail_call[insn->lhs]) {
+            load_vreg(REG_RAX, insn->lhs);
+            gen_epilogue(NULL);
+        }
         return;
     }
 
-    if (node->ty == ND_LVAR_NEW) {
-        // Push a dummy value for pop after that because it's based on stack machine.
-        printf("  push 0\n");
+    if (op == IR_JMP) {
+        if (insn->then_block != next) {
+            emit_jump("jmp", ".L_bb_", insn->then_block);
+        }
         return;
     }
 
-    if (node->ty == ND_LVAR || node->ty == ND_GVAR || node->ty == ND_DOT_REF || node->ty == ND_ARROW_REF) {
-        gen_var_addr(node);
+    if (op == IR_BR) {
+        int cond_op = vreg_cond[insn->lhs];
+        if (cond_op == 0) {
+            size_t cond = use_vreg(insn->lhs, REG_RAX);
+            emit_op2("cmp", regs64[cond], "0");
+            cond_op = IR_NE;
+        }
+        gen_cond_jump(cond_op, insn->then_block, insn->else_block, next);
+        return;
+    }
 
-        error_if_null(node->rtype);
+    error("Not supported instruction: %d", op);
+}
 
-        if (node->rtype->ty != ARRAY) {
-            gen_loading_value(node);
+// Write the memory operand of the address v into mem, the spilled registers are loaded into the scratch registers.
+static void gen_mem(char* mem, size_t v, size_t is_byte)
+{
+    mem_base = NULL;
+    mem_symbol = NULL;
+    mem_index = NULL;
+    mem_scale = 1;
+    mem_disp = 0;
+    collect_mem(v);
+
+    if (is_byte) {
+        strcpy(mem, "BYTE PTR [");
+    } else {
+        strcpy(mem, "[");
+    }
+    strcat(mem, mem_base);
+    if (mem_symbol != NULL) {
+        strcat(mem, "+");
+        strcat(mem, mem_symbol);
+    }
+    if (mem_index != NULL) {
+        strcat(mem, "+");
+        strcat(mem, mem_index);
+        if (mem_scale == 2) {
+            strcat(mem, "*2");
+        } else if (mem_scale == 4) {
+            strcat(mem, "*4");
+        } else if (mem_scale == 8) {
+            strcat(mem, "*8");
         }
+    }
+    if (mem_disp != 0) {
+        append_num(mem, mem_disp);
+    }
+    strcat(mem, "]");
+}
 
+static void collect_mem(size_t v)
+{
+    IrInsn const* def = vreg_mem_def[v];
+    if (def == NULL) {
+        size_t reg = use_vreg(v, REG_RAX);
+        mem_base = regs64[reg];
         return;
     }
 
-    if (node->ty == ND_INIT) {
-        gen(node->lhs);
-        printf("  pop rax\n");
-        gen(node->rhs);
+    if (def->op == IR_LOCAL) {
+        mem_base = "rbp";
+        mem_disp = mem_disp - def->imm;
         return;
     }
 
-    if (node->ty == '=') {
-        // Assignment.
-        gen_var_addr(node->lhs);
-        gen(node->rhs);
+    if (def->op == IR_GLOBAL) {
+        mem_base = "rip";
+        mem_symbol = def->name;
+        return;
+    }
+
+    size_t base = add_base(def);
+    size_t other = def->lhs;
+    if (base == other) {
+        other = def->rhs;
+    }
+
+    if (is_const(other)) {
+        mem_disp = mem_disp + const_value(other);
+    } else if (vreg_scale[other] != 0) {
+        size_t index = use_vreg(vreg_index[other], REG_RDX);
+        mem_index = regs64[index];
+        mem_scale = vreg_scale[other];
+    } else {
+        size_t index = use_vreg(other, REG_RDX);
+        mem_index = regs64[index];
+    }
+    collect_mem(base);
+}
+
+// Append the signed number with its sign like "+8" or "-8".
+static void append_num(char* s, size_t n)
+{
+    char digits[24];
+    size_t i = 24;
+    digits[--i] = '\0';
+
+#ifndef SELFHOST_9MM
+    int is_negative = (long)n < 0;
+#else
+    int is_negative = n < 0;
+#endif
+    if (is_negative) {
+        n = 0 - n;
+    }
+
+    while (1) {
+        digits[--i] = '0' + n - n / 10 * 10;
+        n = n / 10;
+        if (n == 0) {
+            break;
+        }
+    }
+
+    if (is_negative) {
+        digits[--i] = '-';
+    } else {
+        digits[--i] = '+';
+    }
+    strcat(s, digits + i);
+}
+
+// "lea dst, [base+index*scale]" for the addition of the scaled index.
+static void gen_scaled_add(IrInsn const* insn, size_t scaled)
+{
+    size_t base_vreg = insn->lhs;
+    if (base_vreg == scaled) {
+        base_vreg = insn->rhs;
+    }
+
+    size_t base = use_vreg(base_vreg, REG_RAX);
+    size_t index = use_vreg(vreg_index[scaled], REG_RCX);
+
+    char mem[32];
+    strcpy(mem, "[");
+    strcat(mem, regs64[base]);
+    strcat(mem, "+");
+    strcat(mem, regs64[index]);
+    if (vreg_scale[scaled] == 2) {
+        strcat(mem, "*2]");
+    } else if (vreg_scale[scaled] == 4) {
+        strcat(mem, "*4]");
+    } else {
+        strcat(mem, "*8]");
+    }
+
+    size_t dst = dst_reg(insn->dst);
+    emit_op2("lea", regs64[dst], mem);
+    store_dst(dst, insn->dst);
+    ++count_leas;
+}
+
+// Multiply by the power of two with "shl" and by 3, 5 or 9 with "lea", return 0 for the others.
+static int gen_mul_const(IrInsn const* insn)
+{
+    size_t n = insn->rhs;
+    size_t x = insn->lhs;
+    if (!is_small_const(n)) {
+        n = insn->lhs;
+        x = insn->rhs;
+    }
+    if (!is_small_const(n) || is_const(x)) {
+        return 0;
+    }
+
+    size_t value = const_value(n);
+    int shift = log2_exact(value);
+    size_t dst = dst_reg(insn->dst);
 
-        printf("  # Assignment\n");
-        printf("  pop rdx\n");
-        printf("  pop rax\n");
+    if (shift != 0) {
+        load_vreg(dst, x);
+        emit_op_num("shl", regs64[dst], shift);
+        store_dst(dst, insn->dst);
+        ++count_shifts;
+        return 1;
+    }
 
-        error_if_null(node->rtype);
-        if (node->rtype->size == 1) {
-            printf("  mov [rax], dl\n");
-        } else if (node->rtype->size == 4) {
-            printf("  mov [rax], edx\n");
-        } else if (node->rtype->size == 8) {
-            printf("  mov [rax], rdx\n");
+    if (value == 3 || value == 5 || value == 9) {
+        // x * 5 -> [x+x*4]
+        size_t reg = use_vreg(x, REG_RCX);
+        char mem[32];
+        strcpy(mem, "[");
+        strcat(mem, regs64[reg]);
+        strcat(mem, "+");
+        strcat(mem, regs64[reg]);
+        if (value == 3) {
+            strcat(mem, "*2]");
+        } else if (value == 5) {
+            strcat(mem, "*4]");
         } else {
-            error("Not supported");
+            strcat(mem, "*8]");
         }
+        emit_op2("lea", regs64[dst], mem);
+        store_dst(dst, insn->dst);
+        ++count_leas;
+        return 1;
+    }
 
-        printf("  push rdx\n");
-        return;
+    return 0;
+}
+
+// Divide by the positive constant without idiv, return 0 if the divisor is not the constant.
+// The quotient is rounded toward zero as well as idiv.
+static int gen_div_const(IrInsn const* insn)
+{
+    if (!is_small_const(insn->rhs) || is_const(insn->lhs)) {
+        return 0;
     }
 
-    gen(node->lhs);
-    gen(node->rhs);
-
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
-
-    int ty = node->ty;
-
-    if (ty == ND_EQ) {
-        printf("  cmp rax, rdi\n");
-        printf("  sete al\n");
-        printf("  movzb rax, al\n");
-    } else if (ty == ND_NE) {
-        printf("  cmp rax, rdi\n");
-        printf("  setne al\n");
-        printf("  movzb rax, al\n");
-    } else if (ty == '<') {
-        printf("  cmp rax, rdi\n");
-        printf("  setl al\n");
-        printf("  movzb rax, al\n");
-    } else if (ty == TK_LE) {
-        printf("  cmp rax, rdi\n");
-        printf("  setle al\n");
-        printf("  movzb rax, al\n");
-    } else if (ty == TK_GE || ty == '>') {
-        error("parser has a bug");
-    } else if (ty == '+') {
-        printf("  add rax, rdi\n");
-    } else if (ty == '-') {
-        printf("  sub rax, rdi\n");
-    } else if (ty == '*') {
-        // rax * rdi
-        // rdx has upper bits, rax has lower bits.
-        printf("  imul rdi\n");
-    } else if (ty == '/') {
-        // cqo instruction expands value in rax 128 and set rdx and rax.
-        printf("  cqo\n");
-        printf("  idiv rdi\n");
-    }
-
-    printf("  push rax\n");
-}
-
-// Push the address of the given variable on the stack top.
-static void gen_var_addr(Node const* node)
-{
-    if (node->ty == ND_LVAR) {
-        printf("  # Reference local var: %s\n", node->name);
-        printf("  mov rax, rbp\n");
-        printf("  sub rax, %zd\n", (size_t)map_get(codegen_context->var_offset_map, node->name));
-        printf("  push rax\n");
-    } else if (node->ty == ND_GVAR) {
-        printf("  # Reference global var: %s\n", node->name);
-        printf("  lea rax, %s\n", node->name);
-        printf("  push rax\n");
-    } else if (node->ty == ND_DEREF || node->ty == ND_STR) {
-        gen(node->lhs);
-    } else if (node->ty == ND_DOT_REF || node->ty == ND_ARROW_REF) {
-        gen_var_addr(node->lhs);
-        printf("  pop rax\n");
-        printf("  add rax, %zd\n", node->member_offset);
-        printf("  push rax\n");
+    size_t d = const_value(insn->rhs);
+    int shift = log2_exact(d);
+    size_t x = use_vreg(insn->lhs, REG_RCX);
+
+    if (shift != 0) {
+        // Add "2^shift - 1" to the negative dividend before the arithmetic shift.
+        size_t dst = dst_reg(insn->dst);
+        size_t reg = dst;
+        if (dst == x) {
+            reg = REG_RAX;
+        }
+        char const* r = regs64[reg];
+        emit_op2("mov", r, regs64[x]);
+        if (shift != 1) {
+            emit_op2("sar", r, "63");
+        }
+        emit_op_num("shr", r, 64 - shift);
+        emit_op2("add", r, regs64[x]);
+        emit_op_num("sar", r, shift);
+        if (reg != dst) {
+            emit_op2("mov", regs64[dst], r);
+        }
+        store_dst(dst, insn->dst);
+        ++count_shifts;
+        return 1;
+    }
+
+    // Granlund and Montgomery, "Division by Invariant Integers using Multiplication", Figure 5.2.
+    // q = SRA(x + MULSH(m - 2^64, x), l - 1) - XSIGN(x), where 2^(l-1) < d < 2^l.
+    int l = 1;
+    size_t p = 2;
+    while (p < d) {
+        p = p * 2;
+        ++l;
+    }
+    emit_op_num("mov", "rax", div_magic(d, l));
+    emit_op1("imul", regs64[x]);
+    emit_op2("add", "rdx", regs64[x]);
+    emit_op_num("sar", "rdx", l - 1);
+    emit_op2("mov", "rax", regs64[x]);
+    emit_op2("sar", "rax", "63");
+    emit_op2("sub", "rdx", "rax");
+
+    size_t dst = dst_reg(insn->dst);
+    emit_op2("mov", regs64[dst], "rdx");
+    store_dst(dst, insn->dst);
+    ++count_magic_divs;
+    return 1;
+}
+
+// Return "1 + floor(2^(63+l) / d) - 2^64" in 64 bits by the long division bit by bit.
+// d is less than 2^31, so the remainder never overflows.
+static size_t div_magic(size_t d, int l)
+{
+    size_t q = 0;
+    size_t r = 1;
+    for (int i = 0; i < 63 + l; i++) {
+        r = r * 2;
+        q = q * 2;
+        if (d <= r) {
+            r = r - d;
+            q = q + 1;
+        }
+    }
+    return q + 1;
+}
+
+// Return k if n is 2^k for 1 <= k, otherwise 0.
+static int log2_exact(size_t n)
+{
+    size_t p = 2;
+    for (int k = 1; k < 31; k++) {
+        if (p == n) {
+            return k;
+        }
+        p = p * 2;
+    }
+    return 0;
+}
+
+// Return 1 if the virtual register is the constant in [2, 2^31).
+static int is_small_const(size_t v)
+{
+    if (!is_const(v)) {
+        return 0;
+    }
+#ifndef SELFHOST_9MM
+    long n = (long)const_value(v);
+#else
+    size_t n = const_value(v);
+#endif
+    return 2 <= n && n <= 2147483647;
+}
+
+void print_codegen_stats(void)
+{
+    fprintf(stderr, "# strength: %zd shifts, %zd leas, %zd magic divisions\n", count_shifts, count_leas, count_magic_divs);
+    fprintf(stderr, "# addressing: %zd folded addresses\n", count_folded_addrs);
+    fprintf(stderr, "# tail calls: %zd\n", count_tail_calls);
+    fprintf(stderr, "# immediates: %zd forwarded\n", count_forwarded_imms);
+}
+
+// Jump to then_block if the flags satisfy the comparison, otherwise to else_block.
+// The jump to the next block is omitted.
+static void gen_cond_jump(int op, BasicBlock const* then_block, BasicBlock const* else_block, BasicBlock const* next)
+{
+    char const* jump = "je";
+    char const* inverse = "jne";
+    if (op == IR_NE) {
+        jump = "jne";
+        inverse = "je";
+    } else if (op == IR_LT) {
+        jump = "jl";
+        inverse = "jge";
+    } else if (op == IR_LE) {
+        jump = "jle";
+        inverse = "jg";
+    }
+
+    if (then_block == next) {
+        emit_jump(inverse, ".L_bb_", else_block);
+    } else {
+        emit_jump(jump, ".L_bb_", then_block);
+        if (else_block != next) {
+            emit_jump("jmp", ".L_bb_", else_block);
+        }
+    }
+}
+
+// Release the frame and return, or jump to the callee of the tail call if it is not NULL.
+static void gen_epilogue(char const* callee)
+{
+    for (int i = COUNT_ALLOC_REGS; FIRST_CALLEE_SAVED_REG < i; i--) {
+        if (is_reg_saved[i - 1]) {
+            emit_op1("pop", regs64[i - 1]);
+        }
+    }
+    emit_op2("mov", "rsp", "rbp");
+    emit_op1("pop", "rbp");
+    if (callee == NULL) {
+        emit_op0("ret");
     } else {
-        error("You can only get address of variable");
+        emit_op1("jmp", callee);
+    }
+}
+
+// Return the register to compute the virtual register, it is "rax" if it is spilled.
+static size_t dst_reg(size_t v)
+{
+    if (vreg_reg[v] == 0) {
+        return REG_RAX;
+    }
+    return vreg_reg[v] - 1;
+}
+
+// Return the register which has the virtual register, the spilled one is loaded into the scratch register.
+static size_t use_vreg(size_t v, size_t scratch)
+{
+    if (vreg_reg[v] == 0) {
+        load_vreg(scratch, v);
+        return scratch;
     }
+    return vreg_reg[v] - 1;
 }
 
-// Load the value which is pointed by the address on the stacktop.
-static void gen_loading_value(Node const* node)
+static void load_vreg(size_t reg, size_t v)
 {
-    error_if_null(node);
-    error_if_null(node->rtype);
+    if (is_const(v)) {
+        emit_op_num("mov", regs64[reg], const_value(v));
+    } else if (vreg_reg[v] == 0) {
+        emit_op_reg_mem("mov", regs64[reg], "rbp", vreg_slot[v]);
+    } else if (vreg_reg[v] != reg + 1) {
+        emit_op2("mov", regs64[reg], regs64[vreg_reg[v] - 1]);
+    }
+}
 
-    printf("  pop rax\n");
+// Write the result back into the spill slot.
+static void store_dst(size_t reg, size_t v)
+{
+    if (vreg_reg[v] == 0) {
+        emit_op_mem_reg("mov", "rbp", vreg_slot[v], regs64[reg]);
+    }
+}
 
-    if (node->rtype->size == 1) {
-        printf("  movzx rax, BYTE PTR [rax]\n");
-    } else if (node->rtype->size == 4) {
-        printf("  mov eax, [rax]\n");
-    } else if (node->rtype->size == 8) {
-        printf("  mov rax, [rax]\n");
+// "op reg, v", v can be in the spill slot or the immediate.
+static void emit_op_vreg(char const* op, size_t reg, size_t v)
+{
+    if (is_const(v) && fits_imm(const_value(v), 8)) {
+        emit_op_num(op, regs64[reg], const_value(v));
+    } else if (is_const(v)) {
+        load_vreg(REG_RCX, v);
+        emit_op2(op, regs64[reg], "rcx");
+    } else if (vreg_reg[v] == 0) {
+        emit_op_reg_mem(op, regs64[reg], "rbp", vreg_slot[v]);
     } else {
-        error("Not supported");
+        emit_op2(op, regs64[reg], regs64[vreg_reg[v] - 1]);
     }
+}
+
+// Return 1 if the virtual register is written only by IR_IMM, it does not have the register.
+static int is_const(size_t v)
+{
+    return vreg_defs[v] == 1 && vreg_imm[v] != 0;
+}
+
+static size_t const_value(size_t v)
+{
+    return vreg_imm[v] - 1;
+}
 
-    printf("  push rax\n");
+// Return 1 if the constant can be encoded as the immediate of the operand of the size.
+static int fits_imm(size_t n, size_t size)
+{
+#ifndef SELFHOST_9MM
+    long value = (long)n;
+#else
+    size_t value = n;
+#endif
+    if (size == 1) {
+        return 0 - 128 <= value && value <= 255;
+    }
+    return 0 - 2147483647 - 1 <= value && value <= 2147483647;
 }
@@ -1,9 +1,132 @@
 #include "9mm.h"
 
+Arena* token_arena;
+Arena* ast_arena;
+Arena* type_arena;
+Arena* container_arena;
+Arena* ir_arena;
+
+Arena* new_arena(char const* name, size_t chunk_size)
+{
+    Arena* arena = calloc(1, sizeof(Arena));
+    arena->name = name;
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+// Allocate zero-filled memory which is released by free_arena.
+void* arena_alloc(Arena* arena, size_t size)
+{
+    // Align to 8 bytes.
+    size = (size + 7) / 8 * 8;
+
+    ArenaChunk* chunk = arena->chunk;
+    if (chunk == NULL || chunk->capacity < chunk->used + size) {
+        size_t capacity = arena->chunk_size;
+        if (capacity < size) {
+            capacity = size;
+        }
+
+        // Put the header and the data in a single allocation.
+        char* buf = calloc(1, sizeof(ArenaChunk) + capacity);
+        if (buf == NULL) {
+            error("cannot allocate %zd bytes for %s arena", capacity, arena->name);
+        }
+        chunk = (ArenaChunk*)buf;
+        chunk->prev = arena->chunk;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        chunk->data = buf + sizeof(ArenaChunk);
+
+        arena->chunk = chunk;
+        ++arena->count_chunks;
+    }
+
+    void* p = chunk->data + chunk->used;
+    chunk->used += size;
+
+    ++arena->count_allocs;
+    arena->used_size += size;
+
+    return p;
+}
+
+char* arena_strndup(Arena* arena, char const* str, size_t len)
+{
+    char* copied = arena_alloc(arena, len + 1);
+    memcpy(copied, str, len);
+    copied[len] = '\0';
+    return copied;
+}
+
+void free_arena(Arena* arena)
+{
+    ArenaChunk* chunk = arena->chunk;
+    while (chunk != NULL) {
+        ArenaChunk* prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    free(arena);
+}
+
+void init_arenas(void)
+{
+    token_arena = new_arena("token", 1024 * 1024);
+    ast_arena = new_arena("ast", 1024 * 1024);
+    type_arena = new_arena("type", 256 * 1024);
+    container_arena = new_arena("container", 1024 * 1024);
+    ir_arena = new_arena("ir", 1024 * 1024);
+}
+
+void free_arenas(void)
+{
+    free_arena(token_arena);
+    free_arena(ast_arena);
+    free_arena(type_arena);
+    free_arena(container_arena);
+    free_arena(ir_arena);
+}
+
+Buffer* new_buffer(size_t capacity)
+{
+    Buffer* buf = arena_alloc(container_arena, sizeof(Buffer));
+    buf->data = malloc(capacity + 1);
+    buf->data[0] = '\0';
+    buf->len = 0;
+    buf->capacity = capacity;
+    return buf;
+}
+
+void buf_append(Buffer* buf, char const* str, size_t len)
+{
+    if (buf->capacity < buf->len + len) {
+        if (buf->capacity == 0) {
+            buf->capacity = 1;
+        }
+        while (buf->capacity < buf->len + len) {
+            buf->capacity *= 2;
+        }
+        buf->data = realloc(buf->data, buf->capacity + 1);
+        if (buf->data == NULL) {
+            error("cannot allocate %zd bytes for buffer", buf->capacity + 1);
+        }
+    }
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+void buf_append_str(Buffer* buf, char const* str)
+{
+    buf_append(buf, str, strlen(str));
+}
+
 Vector* new_vector()
 {
-    Vector* vec = malloc(sizeof(Vector));
-    vec->data = malloc(sizeof(void*) * 16);
+    Vector* vec = arena_alloc(container_arena, sizeof(Vector));
+    vec->data = arena_alloc(container_arena, sizeof(void*) * 16);
     vec->capacity = 16;
     vec->len = 0;
     return vec;
@@ -17,24 +140,83 @@ void vec_push(Vector* vec, void* elem)
     }
 
     if (vec->capacity == vec->len) {
+        // The old data is left in the arena.
+        void** data = arena_alloc(container_arena, sizeof(void*) * vec->capacity * 2);
+        memcpy(data, vec->data, sizeof(void*) * vec->capacity);
+        vec->data = data;
         vec->capacity *= 2;
-        vec->data = realloc(vec->data, sizeof(void*) * vec->capacity);
     }
     vec->data[vec->len++] = elem;
 }
 
 Map* new_map()
 {
-    Map* map = malloc(sizeof(Map));
+    Map* map = arena_alloc(container_arena, sizeof(Map));
     map->keys = new_vector();
     map->vals = new_vector();
+    map->capacity = 16;
+    map->slots = arena_alloc(container_arena, sizeof(size_t) * map->capacity);
     return map;
 }
 
+// Hash the first len characters of the given string.
+// Keep the value small enough so that the signed division of the self-hosted build works.
+static size_t hash_str(char const* str, size_t len)
+{
+    size_t h = 5381;
+    for (size_t i = 0; i < len; i++) {
+        h = h * 33 + str[i];
+        h = h - h / 16777213 * 16777213;
+    }
+    return h;
+}
+
+// Return the slot which has the given key or the empty slot to store it.
+// The key is the first len characters of the given string.
+static size_t find_slot(Map* map, char const* key, size_t len)
+{
+    size_t h = hash_str(key, len);
+    size_t i = h - h / map->capacity * map->capacity;
+
+    while (map->slots[i] != 0) {
+        char const* k = map->keys->data[map->slots[i] - 1];
+        if ((k == key || strncmp(k, key, len) == 0) && k[len] == '\0') {
+            return i;
+        }
+
+        ++i;
+        if (i == map->capacity) {
+            i = 0;
+        }
+    }
+
+    return i;
+}
+
+static void rehash_map(Map* map)
+{
+    map->capacity *= 2;
+    map->slots = arena_alloc(container_arena, sizeof(size_t) * map->capacity);
+
+    // Insert by insertion order to prefer newer key.
+    for (size_t i = 0; i < map->keys->len; i++) {
+        char const* key = map->keys->data[i];
+        map->slots[find_slot(map, key, strlen(key))] = i + 1;
+    }
+}
+
 void map_put(Map* map, char const* key, void* val)
 {
     vec_push(map->keys, (char*)key);
     vec_push(map->vals, val);
+
+    // Keep the load factor less than 1/2.
+    if (map->capacity < map->keys->len * 2) {
+        rehash_map(map);
+    } else {
+        // Overwrite the older one if the same key exists.
+        map->slots[find_slot(map, key, strlen(key))] = map->keys->len;
+    }
 }
 
 void* map_get(Map* map, char const* key)
@@ -44,19 +226,112 @@ void* map_get(Map* map, char const* key)
         return NULL;
     }
 
-    Vector const* keys = map->keys;
-    if (keys->len == 0) {
+    size_t index = map->slots[find_slot(map, key, strlen(key))];
+    if (index == 0) {
         return NULL;
     }
 
-    // Prefer newer key by traversing by reverse order.
-    for (size_t i = keys->len; 0 < i; i--) {
-        if (strcmp(keys->data[i - 1], key) == 0) {
-            return map->vals->data[i - 1];
-        }
+    return map->vals->data[index - 1];
+}
+
+// Interned string -> itself.
+static Map* intern_map;
+
+// Return the unique copy of the first len characters of the given string.
+// The returned strings can be compared by their address.
+char const* intern_n(char const* str, size_t len)
+{
+    if (intern_map == NULL) {
+        intern_map = new_map();
+    }
+
+    size_t index = intern_map->slots[find_slot(intern_map, str, len)];
+    if (index != 0) {
+        return intern_map->keys->data[index - 1];
+    }
+
+    char* interned = arena_strndup(token_arena, str, len);
+    map_put(intern_map, interned, interned);
+
+    return interned;
+}
+
+char const* intern(char const* str)
+{
+    return intern_n(str, strlen(str));
+}
+
+// Release the memory of the arena except its first chunk, and reuse the chunk from its head.
+void rewind_arena(Arena* arena)
+{
+    ArenaChunk* chunk = arena->chunk;
+    if (chunk == NULL) {
+        return;
+    }
+    while (chunk->prev != NULL) {
+        ArenaChunk* prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+
+    // The allocated memory has to be zero-filled.
+    memset(chunk->data, 0, chunk->used);
+    chunk->used = 0;
+
+    arena->chunk = chunk;
+    arena->count_allocs = 0;
+    arena->count_chunks = 1;
+    arena->used_size = 0;
+}
+
+// Give the arenas to the compilation which is starting, the current ones are saved into the set.
+// The kept arenas of the previous compilation are rewound and reused if they are given, otherwise the new ones are made.
+void enter_arenas(ArenaSet* saved, ArenaSet const* kept)
+{
+    saved->token_arena = token_arena;
+    saved->ast_arena = ast_arena;
+    saved->type_arena = type_arena;
+    saved->container_arena = container_arena;
+    saved->ir_arena = ir_arena;
+    saved->intern_map = intern_map;
+
+    if (kept != NULL && kept->token_arena != NULL) {
+        token_arena = kept->token_arena;
+        ast_arena = kept->ast_arena;
+        type_arena = kept->type_arena;
+        container_arena = kept->container_arena;
+        ir_arena = kept->ir_arena;
+        rewind_arena(token_arena);
+        rewind_arena(ast_arena);
+        rewind_arena(type_arena);
+        rewind_arena(container_arena);
+        rewind_arena(ir_arena);
+    } else {
+        init_arenas();
+    }
+    intern_map = NULL;
+}
+
+// Finish the arenas of the compilation and restore the saved ones.
+// The arenas are kept into the set for the next compilation if it is given, otherwise they are released.
+void leave_arenas(ArenaSet const* saved, ArenaSet* kept)
+{
+    if (kept != NULL) {
+        kept->token_arena = token_arena;
+        kept->ast_arena = ast_arena;
+        kept->type_arena = type_arena;
+        kept->container_arena = container_arena;
+        kept->ir_arena = ir_arena;
+    } else {
+        free_arenas();
     }
 
-    return NULL;
+    token_arena = saved->token_arena;
+    ast_arena = saved->ast_arena;
+    type_arena = saved->type_arena;
+    container_arena = saved->container_arena;
+    ir_arena = saved->ir_arena;
+    intern_map = saved->intern_map;
 }
 
 #ifndef SELFHOST_9MM
@@ -83,7 +358,75 @@ static inline void test_map()
     map_put(map, "foo", (void*)6);
     expect(__LINE__, 6, (long)map_get(map, "foo"));
 
-    free(map);
+    // Grow the table and keep preferring newer keys.
+    char keys[100][8];
+    for (long i = 0; i < 100; i++) {
+        sprintf(keys[i], "k%ld", i);
+        map_put(map, keys[i], (void*)i);
+    }
+    map_put(map, "k42", (void*)420);
+    expect(__LINE__, 0, (long)map_get(map, "k0"));
+    expect(__LINE__, 99, (long)map_get(map, "k99"));
+    expect(__LINE__, 420, (long)map_get(map, "k42"));
+    expect(__LINE__, 6, (long)map_get(map, "foo"));
+    expect(__LINE__, 0, (long)map_get(map, "k100"));
+}
+
+static inline void test_arena()
+{
+    Arena* arena = new_arena("test", 64);
+
+    char* p = arena_alloc(arena, 3);
+    char* q = arena_alloc(arena, 8);
+    expect(__LINE__, 8, q - p);
+    expect(__LINE__, 0, q[7]);
+
+    // Larger allocation than the chunk size.
+    char* r = arena_alloc(arena, 100);
+    expect(__LINE__, 0, r[99]);
+
+    expect(__LINE__, 3, arena->count_allocs);
+    expect(__LINE__, 2, arena->count_chunks);
+    expect(__LINE__, 120, arena->used_size);
+
+    char* s = arena_strndup(arena, "foobar", 3);
+    expect(__LINE__, 0, strcmp(s, "foo"));
+
+    free_arena(arena);
+}
+
+static inline void test_buffer()
+{
+    Buffer* buf = new_buffer(1);
+    expect(__LINE__, 0, buf->len);
+    expect(__LINE__, 0, strcmp(buf->data, ""));
+
+    buf_append(buf, "foobar", 3);
+    buf_append_str(buf, "bar");
+    for (int i = 0; i < 100; i++) {
+        buf_append_str(buf, "x");
+    }
+
+    expect(__LINE__, 106, buf->len);
+    expect(__LINE__, 0, strncmp(buf->data, "foobarx", 7));
+    expect(__LINE__, 0, buf->data[106]);
+    free(buf->data);
+
+    buf = new_buffer(0);
+    buf_append_str(buf, "foo");
+    expect(__LINE__, 0, strcmp(buf->data, "foo"));
+    free(buf->data);
+}
+
+static inline void test_intern()
+{
+    char const* foo = intern("foo");
+    expect(__LINE__, 1, foo == intern("foo"));
+    expect(__LINE__, 1, foo == intern_n("foobar", 3));
+    expect(__LINE__, 0, foo == intern("foobar"));
+    expect(__LINE__, 0, foo == intern_n("fo", 2));
+    expect(__LINE__, 0, strcmp(intern_n(foo, 2), "fo"));
+    expect(__LINE__, 0, strcmp(foo, "foo"));
 }
 
 static inline void test_vector()
@@ -98,16 +441,61 @@ static inline void test_vector()
     expect(__LINE__, 0, (uintptr_t)vec->data[0]);
     expect(__LINE__, 50, (uintptr_t)vec->data[50]);
     expect(__LINE__, 99, (uintptr_t)vec->data[99]);
+}
+
+static inline void test_compile()
+{
+    MmContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    Buffer* out = new_buffer(64);
+
+    char const* valid = "int main() { return 3; }";
+    expect(__LINE__, MM_OK, mm_compile(&ctx, valid, strlen(valid), out));
+    expect(__LINE__, 1, strstr(out->data, "main:") != NULL);
+    size_t len = out->len;
+
+    // The error is reported to stderr, and it returns instead of exiting.
+    char const* invalid = "int main() { return undeclared; }";
+    expect(__LINE__, MM_ERROR_SOURCE, mm_compile(&ctx, invalid, strlen(invalid), out));
+    expect(__LINE__, len, out->len);
+
+    // The next compilation starts from the clean state.
+    expect(__LINE__, MM_OK, mm_compile(&ctx, valid, strlen(valid), out));
+    expect(__LINE__, 1, len < out->len);
+
+    // The source which ends with "\n\0" is compiled without the copy.
+    len = out->len;
+    char const* terminated = "int main() { return 3; }\n";
+    expect(__LINE__, MM_OK, mm_compile(&ctx, terminated, strlen(terminated), out));
+    expect(__LINE__, 1, len < out->len);
+
+    // The preprocessing which fails drops its output too.
+    len = out->len;
+    ctx.filename = "unterminated.c";
+    char const* unterminated = "#ifdef X\nint x;\n";
+    expect(__LINE__, MM_ERROR_COMPILE, mm_compile(&ctx, unterminated, strlen(unterminated), out));
+    expect(__LINE__, len, out->len);
+    ctx.filename = NULL;
+
+    // The intermediate representation is appended to the output instead of stdout.
+    ctx.is_dump_ir = 1;
+    expect(__LINE__, MM_OK, mm_compile(&ctx, valid, strlen(valid), out));
+    expect(__LINE__, 1, strstr(out->data + len, "function main") != NULL);
+    ctx.is_dump_ir = 0;
 
-    free(vec);
+    free(out->data);
 }
 #endif
 
 void runtest()
 {
 #ifndef SELFHOST_9MM
+    test_arena();
     test_vector();
     test_map();
+    test_intern();
+    test_buffer();
+    test_compile();
 #endif
     return;
 }
@@ -1,5 +1,40 @@
+#pragma once
+
 #include <stddef.h>
 
+struct arena_chunk {
+    struct arena_chunk* prev; // The previous chunk of the same arena.
+    size_t capacity;
+    size_t used;
+    char* data;
+};
+typedef struct arena_chunk ArenaChunk;
+
+struct arena {
+    char const* name;
+    ArenaChunk* chunk; // The current chunk.
+    size_t chunk_size;
+    size_t count_allocs;
+    size_t count_chunks;
+    size_t used_size;
+};
+typedef struct arena Arena;
+
+// Growing string which is always terminated by '\0'.
+struct buffer {
+    char* data;
+    size_t len;
+    size_t capacity;
+};
+typedef struct buffer Buffer;
+
+// Per-phase arenas, they are released at once when the compilation finished.
+extern Arena* token_arena;     // Tokens and interned strings.
+extern Arena* ast_arena;       // Nodes and contexts.
+extern Arena* type_arena;      // Types and user types.
+extern Arena* container_arena; // Vectors and maps.
+extern Arena* ir_arena;        // Instructions and basic blocks.
+
 struct vector {
     void** data;
     size_t capacity;
@@ -8,16 +43,47 @@ struct vector {
 typedef struct vector Vector;
 
 struct map {
-    Vector* keys;
-    Vector* vals;
+    Vector* keys;     // Keys in insertion order.
+    Vector* vals;     // Values in insertion order.
+    size_t* slots;    // Open addressing table of "index + 1" into keys, 0 means empty.
+    size_t capacity;  // The number of slots.
 };
 typedef struct map Map;
 
+// Arenas and the strings interned into them, they are saved while a compilation has its own ones.
+struct arena_set {
+    Arena* token_arena;
+    Arena* ast_arena;
+    Arena* type_arena;
+    Arena* container_arena;
+    Arena* ir_arena;
+    Map* intern_map;
+};
+typedef struct arena_set ArenaSet;
+
 #ifndef SELFHOST_9MM
+Arena* new_arena(char const*, size_t);
+void* arena_alloc(Arena*, size_t);
+char* arena_strndup(Arena*, char const*, size_t);
+void free_arena(Arena*);
+void init_arenas(void);
+void free_arenas(void);
+
+Buffer* new_buffer(size_t);
+void buf_append(Buffer*, char const*, size_t);
+void buf_append_str(Buffer*, char const*);
+
 Vector* new_vector();
 void vec_push(Vector*, void*);
 
 Map* new_map();
 void map_put(Map*, char const*, void*);
 void* map_get(Map*, char const*);
+
+char const* intern(char const*);
+char const* intern_n(char const*, size_t);
+
+void rewind_arena(Arena*);
+void enter_arenas(ArenaSet*, ArenaSet const*);
+void leave_arenas(ArenaSet const*, ArenaSet*);
 #endif
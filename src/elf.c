@@ -0,0 +1,1394 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static void init_assembler(void);
+static void assemble_line(char const*, char const*);
+static void assemble_directive(char const*, char const*, char const*);
+static void assemble_string(char const*, char const*);
+static void assemble_insn(char const*, char const*, char const*);
+static int assemble_alu(char const*, AsmOperand const*, AsmOperand const*);
+static int assemble_mov(AsmOperand const*, AsmOperand const*);
+static int assemble_misc(char const*, AsmOperand const*, AsmOperand const*, int);
+static int parse_asm_operands(AsmOperand*, AsmOperand*, char const*, char const*);
+static void parse_asm_operand(AsmOperand*, char const*, char const*);
+static void parse_asm_memory(AsmOperand*, char const*, char const*);
+static int find_asm_register(char const*, size_t, int*);
+static size_t parse_asm_number(char const*, char const*);
+static AsmSymbol* find_asm_symbol(char const*, size_t);
+static AsmItem* push_asm_item(int);
+static int asm_condition(char const*);
+static int asm_fits(size_t, size_t);
+static int asm_low3(int);
+static void asm_byte(int);
+static void asm_imm(size_t, int);
+static void asm_rex(int, int, int, AsmOperand const*);
+static void asm_modrm(int, AsmOperand const*);
+static void asm_fixup(char const*, size_t, int);
+static void push_asm_code(void);
+static int is_local_target(AsmSymbol const*, int);
+static void layout_asm_items(void);
+static void build_asm_symtab(Buffer*, Buffer*);
+static void emit_asm_sections(Buffer*, Buffer*, Buffer*);
+static void apply_asm_fixup(Buffer*, AsmItem const*, Buffer*);
+static void write_elf(Buffer*, Buffer const**, size_t const*);
+static void asm_put(Buffer*, size_t, int);
+static void asm_patch(char*, size_t, int);
+static void asm_pad(Buffer*, size_t);
+#endif
+
+enum {
+    // Kind of the operand.
+    ASM_REG = 1,
+    ASM_IMM,
+    ASM_MEM,
+    ASM_SYM,
+
+    // Pseudo registers of the memory operand.
+    ASM_RIP = 16,
+    ASM_NO_REG,
+
+    // Kind of the item.
+    ASM_CODE = 1,
+    ASM_JUMP,
+    ASM_LABEL,
+    ASM_ALIGN,
+    ASM_SPACE,
+
+    // Sections of the object.
+    SECTION_TEXT = 1,
+    SECTION_DATA,
+    SECTION_BSS,
+    SECTION_RELA_TEXT,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_NOTE,
+    COUNT_SECTIONS,
+
+    // Relocation types of x86-64.
+    RELOC_PC32 = 2,
+    RELOC_PLT32 = 4,
+    RELOC_32S = 11,
+
+    // Opcodes of the jumps.
+    OPCODE_JMP_SHORT = 235, // EB rel8
+    OPCODE_JMP_LONG = 233,  // E9 rel32
+    OPCODE_JCC_SHORT = 112  // 70+cc rel8, the long one is 0F 80+cc rel32.
+};
+
+// Names of the registers by their numbers in the encoding.
+static char const* asm_regs64[16];
+static char const* asm_regs32[16];
+static char const* asm_regs8[16];
+
+// Items of all the sections in the order of the assembly.
+static Vector* asm_items;
+
+// Name -> "AsmSymbol" of the labels and the referenced symbols.
+static Map* asm_symbols;
+
+static int asm_section;
+static size_t asm_section_align[4];
+
+// The number of the local symbols in ".symtab", the global ones follow them.
+static size_t count_asm_local_symbols;
+
+// Instruction which is being encoded, it is pushed by push_asm_code.
+static char asm_code[16];
+static size_t asm_code_len;
+static char const* asm_fixup_target;
+static size_t asm_fixup_pos;
+static size_t asm_fixup_value;
+static int asm_fixup_type;
+
+// Statistics of the assembler.
+static size_t count_asm_insns;
+static size_t count_short_jumps;
+static size_t count_jumps;
+static size_t count_relocations;
+
+// Assemble the text which is generated by the code generator into the ELF64 relocatable object, and append it to the output.
+// It accepts only the instructions and the directives which the code generator uses,
+// and encodes them like GNU as, so "objdump -d -r" of both objects are the same.
+void assemble_elf(char const* text, size_t len, Buffer* out)
+{
+    init_assembler();
+
+    char const* end = text + len;
+    char const* line = text;
+    while (line < end) {
+        char const* eol = line;
+        while (eol < end && *eol != '\n') {
+            ++eol;
+        }
+        assemble_line(line, eol);
+        line = eol + 1;
+    }
+
+    layout_asm_items();
+
+    Buffer* symtab = new_buffer(4096);
+    Buffer* strtab = new_buffer(4096);
+    build_asm_symtab(symtab, strtab);
+
+    Buffer* text_section = new_buffer(len / 4 + 16);
+    Buffer* data_section = new_buffer(4096);
+    Buffer* rela = new_buffer(4096);
+    emit_asm_sections(text_section, data_section, rela);
+
+    Buffer const* contents[9];
+    contents[SECTION_TEXT] = text_section;
+    contents[SECTION_DATA] = data_section;
+    contents[SECTION_RELA_TEXT] = rela;
+    contents[SECTION_SYMTAB] = symtab;
+    contents[SECTION_STRTAB] = strtab;
+
+    // The size of ".bss" is the end of its last item.
+    size_t bss_size[1];
+    bss_size[0] = 0;
+    for (size_t i = 0; i < asm_items->len; i++) {
+        AsmItem const* item = asm_items->data[i];
+        if (item->section == SECTION_BSS) {
+            bss_size[0] = item->offset + item->size;
+        }
+    }
+    write_elf(out, contents, bss_size);
+
+    free(text_section->data);
+    free(data_section->data);
+    free(rela->data);
+    free(symtab->data);
+    free(strtab->data);
+}
+
+static void init_assembler(void)
+{
+    asm_regs64[0] = "rax";
+    asm_regs64[1] = "rcx";
+    asm_regs64[2] = "rdx";
+    asm_regs64[3] = "rbx";
+    asm_regs64[4] = "rsp";
+    asm_regs64[5] = "rbp";
+    asm_regs64[6] = "rsi";
+    asm_regs64[7] = "rdi";
+
+    asm_regs32[0] = "eax";
+    asm_regs32[1] = "ecx";
+    asm_regs32[2] = "edx";
+    asm_regs32[3] = "ebx";
+    asm_regs32[4] = "esp";
+    asm_regs32[5] = "ebp";
+    asm_regs32[6] = "esi";
+    asm_regs32[7] = "edi";
+
+    asm_regs8[0] = "al";
+    asm_regs8[1] = "cl";
+    asm_regs8[2] = "dl";
+    asm_regs8[3] = "bl";
+    asm_regs8[4] = "spl";
+    asm_regs8[5] = "bpl";
+    asm_regs8[6] = "sil";
+    asm_regs8[7] = "dil";
+
+    // "r8" to "r15" have the suffixes of the sizes.
+    for (int i = 8; i < 16; i++) {
+        char name[8];
+        sprintf(name, "r%d", i);
+        asm_regs64[i] = intern(name);
+        sprintf(name, "r%dd", i);
+        asm_regs32[i] = intern(name);
+        sprintf(name, "r%db", i);
+        asm_regs8[i] = intern(name);
+    }
+
+    asm_items = new_vector();
+    asm_symbols = new_map();
+    asm_section = SECTION_TEXT;
+    for (int i = 0; i < 4; i++) {
+        asm_section_align[i] = 1;
+    }
+}
+
+// Assemble a line, which is a label, a directive, an instruction, a comment or empty.
+static void assemble_line(char const* line, char const* end)
+{
+    while (line < end && *line == ' ') {
+        ++line;
+    }
+    while (line < end && end[-1] == ' ') {
+        --end;
+    }
+    if (line == end || *line == '#') {
+        return;
+    }
+
+    if (end[-1] == ':') {
+        AsmSymbol* sym = find_asm_symbol(line, end - line - 1);
+        if (sym->label != NULL) {
+            error("%s is defined twice", sym->name);
+        }
+        sym->label = push_asm_item(ASM_LABEL);
+        return;
+    }
+
+    char const* args = line;
+    while (args < end && *args != ' ') {
+        ++args;
+    }
+    char const* word_end = args;
+    while (args < end && *args == ' ') {
+        ++args;
+    }
+
+    char word[16];
+    if (16 <= word_end - line) {
+        error("cannot assemble %s", arena_strndup(token_arena, line, end - line));
+    }
+    memcpy(word, line, word_end - line);
+    word[word_end - line] = '\0';
+
+    if (word[0] == '.') {
+        assemble_directive(word, args, end);
+    } else {
+        assemble_insn(word, args, end);
+    }
+}
+
+static void assemble_directive(char const* name, char const* args, char const* end)
+{
+    if (strcmp(name, ".intel_syntax") == 0) {
+        return;
+    }
+
+    if (strcmp(name, ".text") == 0) {
+        asm_section = SECTION_TEXT;
+    } else if (strcmp(name, ".data") == 0) {
+        asm_section = SECTION_DATA;
+    } else if (strcmp(name, ".bss") == 0) {
+        asm_section = SECTION_BSS;
+    } else if (strcmp(name, ".global") == 0) {
+        AsmSymbol* sym = find_asm_symbol(args, end - args);
+        sym->is_global = 1;
+    } else if (strcmp(name, ".align") == 0) {
+        AsmItem* item = push_asm_item(ASM_ALIGN);
+        item->len = parse_asm_number(args, end);
+        if (asm_section_align[asm_section] < item->len) {
+            asm_section_align[asm_section] = item->len;
+        }
+    } else if (strcmp(name, ".zero") == 0) {
+        AsmItem* item = push_asm_item(ASM_SPACE);
+        item->len = parse_asm_number(args, end);
+    } else if (strcmp(name, ".string") == 0) {
+        assemble_string(args, end);
+    } else {
+        error("unknown directive %s", name);
+    }
+}
+
+// Decode the quoted string with the escape sequences of GNU as, it is terminated by '\0'.
+static void assemble_string(char const* p, char const* end)
+{
+    if (end - p < 2 || *p != '"' || end[-1] != '"') {
+        error("invalid string %s", arena_strndup(token_arena, p, end - p));
+    }
+    ++p;
+    --end;
+
+    Buffer* buf = new_buffer(end - p + 1);
+    while (p < end) {
+        int c = *p;
+        ++p;
+
+        // FIXME: use '\\', the self-hosted tokenizer does not support it.
+        if (c == 92 && p < end) {
+            c = *p;
+            ++p;
+            if (c == 'n') {
+                c = 10;
+            } else if (c == 't') {
+                c = 9;
+            } else if (c == 'r') {
+                c = 13;
+            } else if (c == 'b') {
+                c = 8;
+            } else if (c == 'f') {
+                c = 12;
+            } else if ('0' <= c && c <= '7') {
+                // At most 3 octal digits.
+                c = c - '0';
+                for (int i = 0; i < 2 && p < end && '0' <= *p && *p <= '7'; i++) {
+                    c = c * 8 + *p - '0';
+                    ++p;
+                }
+            } else if (c == 'x') {
+                c = 0;
+                while (p < end && isxdigit(*p)) {
+                    int d = tolower(*p);
+                    if (d <= '9') {
+                        c = c * 16 + d - '0';
+                    } else {
+                        c = c * 16 + d - 'a' + 10;
+                    }
+                    ++p;
+                }
+            }
+        }
+
+        char byte[1];
+        byte[0] = c;
+        buf_append(buf, byte, 1);
+    }
+
+    // The terminator is the last byte.
+    AsmItem* item = push_asm_item(ASM_CODE);
+    item->len = buf->len + 1;
+    item->bytes = arena_strndup(ir_arena, buf->data, buf->len);
+    free(buf->data);
+}
+
+static void assemble_insn(char const* name, char const* args, char const* end)
+{
+    AsmOperand a;
+    AsmOperand b;
+    memset(&a, 0, sizeof(AsmOperand));
+    memset(&b, 0, sizeof(AsmOperand));
+    int count = parse_asm_operands(&a, &b, args, end);
+
+    asm_code_len = 0;
+    asm_fixup_target = NULL;
+    ++count_asm_insns;
+
+    // The jumps are encoded by the layout.
+    int cond = 0;
+    if (name[0] == 'j') {
+        cond = asm_condition(name + 1);
+    }
+    if (count == 1 && a.kind == ASM_SYM && (strcmp(name, "jmp") == 0 || 0 < cond)) {
+        AsmItem* item = push_asm_item(ASM_JUMP);
+        item->target = a.sym;
+        item->jump_opcode = OPCODE_JMP_SHORT;
+        if (0 < cond) {
+            item->jump_opcode = OPCODE_JCC_SHORT + cond;
+        }
+        find_asm_symbol(a.sym, strlen(a.sym));
+        ++count_jumps;
+        return;
+    }
+
+    int is_done = 0;
+    if (count == 2 && strcmp(name, "mov") == 0) {
+        is_done = assemble_mov(&a, &b);
+    } else if (count == 2) {
+        is_done = assemble_alu(name, &a, &b);
+    }
+    if (!is_done) {
+        is_done = assemble_misc(name, &a, &b, count);
+    }
+    if (!is_done) {
+        error("cannot assemble %s", arena_strndup(token_arena, name, strlen(name)));
+    }
+
+    push_asm_code();
+}
+
+// "add", "or", "and", "sub", "xor" and "cmp" share the encodings by the digit.
+static int assemble_alu(char const* name, AsmOperand const* a, AsmOperand const* b)
+{
+    int digit = -1;
+    if (strcmp(name, "add") == 0) {
+        digit = 0;
+    } else if (strcmp(name, "or") == 0) {
+        digit = 1;
+    } else if (strcmp(name, "and") == 0) {
+        digit = 4;
+    } else if (strcmp(name, "sub") == 0) {
+        digit = 5;
+    } else if (strcmp(name, "xor") == 0) {
+        digit = 6;
+    } else if (strcmp(name, "cmp") == 0) {
+        digit = 7;
+    } else {
+        return 0;
+    }
+
+    // The size of the memory is of the register.
+    int size = a->size;
+    if (b->kind == ASM_REG) {
+        size = b->size;
+    }
+    int w = size == 8;
+    int is_byte = size == 1;
+    if (b->kind == ASM_REG) {
+        // 01 /r, 00 /r for the bytes
+        asm_rex(w, b->reg, b->size, a);
+        asm_byte(digit * 8 + 1 - is_byte);
+        asm_modrm(b->reg, a);
+        return 1;
+    }
+
+    if (a->kind == ASM_REG && b->kind == ASM_MEM) {
+        // 03 /r, 02 /r for the bytes
+        asm_rex(w, a->reg, a->size, b);
+        asm_byte(digit * 8 + 3 - is_byte);
+        asm_modrm(a->reg, b);
+        return 1;
+    }
+
+    if (b->kind != ASM_IMM) {
+        return 0;
+    }
+    if (is_byte) {
+        // 80 /digit ib
+        asm_rex(0, 0, 0, a);
+        asm_byte(128);
+        asm_modrm(digit, a);
+        asm_imm(b->value, 1);
+    } else if (asm_fits(b->value, 1)) {
+        // 83 /digit ib
+        asm_rex(w, 0, 0, a);
+        asm_byte(131);
+        asm_modrm(digit, a);
+        asm_imm(b->value, 1);
+    } else if (a->kind == ASM_REG && a->reg == 0) {
+        // 05 id of "rax" and "eax"
+        asm_rex(w, 0, 0, a);
+        asm_byte(digit * 8 + 5);
+        asm_imm(b->value, 4);
+    } else {
+        // 81 /digit id
+        asm_rex(w, 0, 0, a);
+        asm_byte(129);
+        asm_modrm(digit, a);
+        asm_imm(b->value, 4);
+    }
+    return 1;
+}
+
+static int assemble_mov(AsmOperand const* a, AsmOperand const* b)
+{
+    // The size of the memory is of the register.
+    int size = a->size;
+    if (b->kind == ASM_REG) {
+        size = b->size;
+    }
+    int w = size == 8;
+    int is_byte = size == 1;
+
+    if (b->kind == ASM_REG) {
+        // 89 /r, 88 /r for the bytes
+        asm_rex(w, b->reg, b->size, a);
+        asm_byte(137 - is_byte);
+        asm_modrm(b->reg, a);
+        return 1;
+    }
+
+    if (a->kind == ASM_REG && b->kind == ASM_MEM) {
+        // 8B /r, 8A /r for the bytes
+        asm_rex(w, a->reg, a->size, b);
+        asm_byte(139 - is_byte);
+        asm_modrm(a->reg, b);
+        return 1;
+    }
+
+    if (b->kind != ASM_IMM) {
+        return 0;
+    }
+
+    if (a->kind == ASM_REG && (!w || !asm_fits(b->value, 4))) {
+        // B8+r id, B8+r io of the 64-bit register, B0+r ib for the bytes
+        asm_rex(w, 0, a->size, a);
+        if (is_byte) {
+            asm_byte(176 + asm_low3(a->reg));
+        } else {
+            asm_byte(184 + asm_low3(a->reg));
+        }
+        asm_imm(b->value, a->size);
+        return 1;
+    }
+
+    if (a->size == 0) {
+        return 0;
+    }
+
+    // C7 /0 id, C6 /0 ib for the bytes
+    asm_rex(w, 0, 0, a);
+    asm_byte(199 - is_byte);
+    asm_modrm(0, a);
+    if (is_byte) {
+        asm_imm(b->value, 1);
+    } else {
+        asm_imm(b->value, 4);
+    }
+    return 1;
+}
+
+static int assemble_misc(char const* name, AsmOperand const* a, AsmOperand const* b, int count)
+{
+    int w = a->size == 8;
+
+    if (count == 0 && strcmp(name, "ret") == 0) {
+        asm_byte(195); // C3
+        return 1;
+    }
+
+    if (count == 0 && strcmp(name, "cqo") == 0) {
+        asm_byte(72); // 48 99
+        asm_byte(153);
+        return 1;
+    }
+
+    if (count == 1 && a->kind == ASM_REG && (strcmp(name, "push") == 0 || strcmp(name, "pop") == 0)) {
+        // 50+r, 58+r
+        asm_rex(0, 0, 0, a);
+        if (strcmp(name, "push") == 0) {
+            asm_byte(80 + asm_low3(a->reg));
+        } else {
+            asm_byte(88 + asm_low3(a->reg));
+        }
+        return 1;
+    }
+
+    if (count == 1 && a->kind == ASM_SYM && strcmp(name, "call") == 0) {
+        asm_byte(232); // E8 rel32
+        asm_fixup(a->sym, 0, RELOC_PLT32);
+        return 1;
+    }
+
+    if (count == 1 && (strcmp(name, "imul") == 0 || strcmp(name, "idiv") == 0)) {
+        // F7 /5, F7 /7
+        asm_rex(w, 0, 0, a);
+        asm_byte(247);
+        if (strcmp(name, "imul") == 0) {
+            asm_modrm(5, a);
+        } else {
+            asm_modrm(7, a);
+        }
+        return 1;
+    }
+
+    if (count == 2 && strcmp(name, "imul") == 0 && b->kind != ASM_IMM) {
+        // 0F AF /r
+        asm_rex(w, a->reg, a->size, b);
+        asm_byte(15);
+        asm_byte(175);
+        asm_modrm(a->reg, b);
+        return 1;
+    }
+
+    if (count == 2 && strcmp(name, "imul") == 0) {
+        // 6B /r ib, 69 /r id, the destination is the source.
+        asm_rex(w, a->reg, a->size, a);
+        if (asm_fits(b->value, 1)) {
+            asm_byte(107);
+            asm_modrm(a->reg, a);
+            asm_imm(b->value, 1);
+        } else {
+            asm_byte(105);
+            asm_modrm(a->reg, a);
+            asm_imm(b->value, 4);
+        }
+        return 1;
+    }
+
+    if (count == 2 && a->kind == ASM_REG && strcmp(name, "lea") == 0) {
+        // 8D /r
+        asm_rex(w, a->reg, a->size, b);
+        asm_byte(141);
+        asm_modrm(a->reg, b);
+        return 1;
+    }
+
+    if (count == 2 && a->kind == ASM_REG && strcmp(name, "movzx") == 0 && (b->size == 1 || b->kind == ASM_REG)) {
+        // 0F B6 /r
+        asm_rex(w, a->reg, a->size, b);
+        asm_byte(15);
+        asm_byte(182);
+        asm_modrm(a->reg, b);
+        return 1;
+    }
+
+    if (count == 2 && b->kind == ASM_IMM && a->size != 1) {
+        int digit = -1;
+        if (strcmp(name, "shl") == 0) {
+            digit = 4;
+        } else if (strcmp(name, "shr") == 0) {
+            digit = 5;
+        } else if (strcmp(name, "sar") == 0) {
+            digit = 7;
+        }
+        if (0 <= digit) {
+            // D1 /digit, C1 /digit ib
+            asm_rex(w, 0, 0, a);
+            if (b->value == 1) {
+                asm_byte(209);
+                asm_modrm(digit, a);
+            } else {
+                asm_byte(193);
+                asm_modrm(digit, a);
+                asm_imm(b->value, 1);
+            }
+            return 1;
+        }
+    }
+
+    if (count == 1 && strncmp(name, "set", 3) == 0 && 0 < asm_condition(name + 3) && a->size == 1) {
+        // 0F 90+cc /0
+        asm_rex(0, 0, 0, a);
+        asm_byte(15);
+        asm_byte(144 + asm_condition(name + 3));
+        asm_modrm(0, a);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Return the number of the operands which are separated by ",".
+static int parse_asm_operands(AsmOperand* a, AsmOperand* b, char const* p, char const* end)
+{
+    if (p == end) {
+        return 0;
+    }
+
+    char const* comma = p;
+    while (comma < end && *comma != ',') {
+        ++comma;
+    }
+    parse_asm_operand(a, p, comma);
+    if (comma == end) {
+        return 1;
+    }
+
+    parse_asm_operand(b, comma + 1, end);
+    return 2;
+}
+
+static void parse_asm_operand(AsmOperand* op, char const* p, char const* end)
+{
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    while (p < end && end[-1] == ' ') {
+        --end;
+    }
+    if (p == end) {
+        error("missing operand");
+    }
+
+    op->size = 0;
+    op->reg = ASM_NO_REG;
+    op->index_reg = ASM_NO_REG;
+    op->scale = 1;
+    op->value = 0;
+    op->sym = NULL;
+
+    if (strncmp(p, "BYTE PTR ", 9) == 0) {
+        op->size = 1;
+        p += 9;
+    } else if (strncmp(p, "DWORD PTR ", 10) == 0) {
+        op->size = 4;
+        p += 10;
+    } else if (strncmp(p, "QWORD PTR ", 10) == 0) {
+        op->size = 8;
+        p += 10;
+    }
+
+    if (*p == '[' && end[-1] == ']') {
+        op->kind = ASM_MEM;
+        parse_asm_memory(op, p + 1, end - 1);
+        return;
+    }
+
+    int size = 0;
+    int reg = find_asm_register(p, end - p, &size);
+    if (reg != ASM_NO_REG) {
+        op->kind = ASM_REG;
+        op->reg = reg;
+        op->size = size;
+    } else if (*p == '-' || isdigit(*p)) {
+        op->kind = ASM_IMM;
+        op->value = parse_asm_number(p, end);
+    } else {
+        AsmSymbol const* sym = find_asm_symbol(p, end - p);
+        op->kind = ASM_SYM;
+        op->sym = sym->name;
+    }
+}
+
+// Parse the terms of the memory operand like "rip+name+4" and "rbp+r10*8-16".
+// The first register is the base and the second one is the index.
+static void parse_asm_memory(AsmOperand* op, char const* p, char const* end)
+{
+    int is_negative = 0;
+    while (p < end) {
+        char const* term_end = p;
+        char const* star = NULL;
+        while (term_end < end && *term_end != '+' && *term_end != '-') {
+            if (*term_end == '*') {
+                star = term_end;
+            }
+            ++term_end;
+        }
+
+        char const* reg_end = term_end;
+        if (star != NULL) {
+            reg_end = star;
+        }
+
+        int size = 0;
+        int reg = find_asm_register(p, reg_end - p, &size);
+        if (reg != ASM_NO_REG) {
+            if (op->reg == ASM_NO_REG && star == NULL) {
+                op->reg = reg;
+            } else {
+                op->index_reg = reg;
+                if (star != NULL) {
+                    op->scale = parse_asm_number(star + 1, term_end);
+                }
+            }
+        } else if (isdigit(*p)) {
+            size_t n = parse_asm_number(p, term_end);
+            if (is_negative) {
+                op->value -= n;
+            } else {
+                op->value += n;
+            }
+        } else {
+            AsmSymbol const* sym = find_asm_symbol(p, term_end - p);
+            op->sym = sym->name;
+        }
+
+        if (term_end == end) {
+            break;
+        }
+        is_negative = *term_end == '-';
+        p = term_end + 1;
+    }
+}
+
+// Return the number of the register and set its bytes, or return ASM_NO_REG.
+static int find_asm_register(char const* p, size_t len, int* size)
+{
+    if (len == 3 && strncmp(p, "rip", 3) == 0) {
+        *size = 8;
+        return ASM_RIP;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        if (strlen(asm_regs64[i]) == len && strncmp(p, asm_regs64[i], len) == 0) {
+            *size = 8;
+            return i;
+        }
+        if (strlen(asm_regs32[i]) == len && strncmp(p, asm_regs32[i], len) == 0) {
+            *size = 4;
+            return i;
+        }
+        if (strlen(asm_regs8[i]) == len && strncmp(p, asm_regs8[i], len) == 0) {
+            *size = 1;
+            return i;
+        }
+    }
+    return ASM_NO_REG;
+}
+
+static size_t parse_asm_number(char const* p, char const* end)
+{
+    int is_negative = 0;
+    if (p < end && *p == '-') {
+        is_negative = 1;
+        ++p;
+    }
+    if (p == end) {
+        error("missing number");
+    }
+
+    size_t n = 0;
+    while (p < end) {
+        if (!isdigit(*p)) {
+            error("invalid number %s", arena_strndup(token_arena, p, end - p));
+        }
+        n = n * 10 + *p - '0';
+        ++p;
+    }
+
+    if (is_negative) {
+        return 0 - n;
+    }
+    return n;
+}
+
+static AsmSymbol* find_asm_symbol(char const* name, size_t len)
+{
+    char const* interned = intern_n(name, len);
+    AsmSymbol* sym = map_get(asm_symbols, interned);
+    if (sym == NULL) {
+        sym = arena_alloc(ir_arena, sizeof(AsmSymbol));
+        sym->name = interned;
+        map_put(asm_symbols, interned, sym);
+    }
+    return sym;
+}
+
+static AsmItem* push_asm_item(int kind)
+{
+    AsmItem* item = arena_alloc(ir_arena, sizeof(AsmItem));
+    item->kind = kind;
+    item->section = asm_section;
+    vec_push(asm_items, item);
+    return item;
+}
+
+// Return the condition code of the suffix of "jcc" and "setcc", 0 if it is unknown.
+// The overflow condition of the code 0 is never generated.
+static int asm_condition(char const* suffix)
+{
+    if (strcmp(suffix, "e") == 0) {
+        return 4;
+    } else if (strcmp(suffix, "ne") == 0) {
+        return 5;
+    } else if (strcmp(suffix, "l") == 0) {
+        return 12;
+    } else if (strcmp(suffix, "ge") == 0) {
+        return 13;
+    } else if (strcmp(suffix, "le") == 0) {
+        return 14;
+    } else if (strcmp(suffix, "g") == 0) {
+        return 15;
+    }
+    return 0;
+}
+
+// Return 1 if the signed value fits in the bytes.
+static int asm_fits(size_t n, size_t size)
+{
+#ifndef SELFHOST_9MM
+    long value = (long)n;
+#else
+    size_t value = n;
+#endif
+    if (size == 1) {
+        if (value < 0 - 128 || 127 < value) {
+            return 0;
+        }
+        return 1;
+    }
+    if (value < 0 - 2147483647 - 1 || 2147483647 < value) {
+        return 0;
+    }
+    return 1;
+}
+
+// The lower 3 bits of the register number, the upper bit is in REX.
+static int asm_low3(int reg)
+{
+    if (8 <= reg) {
+        return reg - 8;
+    }
+    return reg;
+}
+
+static void asm_byte(int byte)
+{
+    asm_code[asm_code_len++] = byte;
+}
+
+static void asm_imm(size_t value, int size)
+{
+    asm_patch(asm_code + asm_code_len, value, size);
+    asm_code_len += size;
+}
+
+// Emit REX of the register in ModRM.reg and the register or the memory in ModRM.rm if it is needed.
+// The byte registers "spl", "bpl", "sil" and "dil" need REX, they are "ah", "ch", "dh" and "bh" without it.
+static void asm_rex(int w, int reg, int reg_size, AsmOperand const* rm)
+{
+    int rex = 0;
+    int is_needed = 0;
+    if (w) {
+        rex += 8;
+    }
+    if (8 <= reg) {
+        rex += 4;
+    }
+    if (reg_size == 1 && 4 <= reg && reg < 8) {
+        is_needed = 1;
+    }
+
+    if (rm->kind == ASM_REG) {
+        if (8 <= rm->reg) {
+            rex += 1;
+        }
+        if (rm->size == 1 && 4 <= rm->reg && rm->reg < 8) {
+            is_needed = 1;
+        }
+    } else {
+        if (8 <= rm->index_reg && rm->index_reg < 16) {
+            rex += 2;
+        }
+        if (8 <= rm->reg && rm->reg < 16) {
+            rex += 1;
+        }
+    }
+
+    if (rex != 0 || is_needed) {
+        asm_byte(64 + rex);
+    }
+}
+
+// Emit ModRM, SIB and the displacement of the register in ModRM.reg and the register or the memory in ModRM.rm.
+static void asm_modrm(int reg, AsmOperand const* rm)
+{
+    int r = asm_low3(reg) * 8;
+    if (rm->kind == ASM_REG) {
+        asm_byte(192 + r + asm_low3(rm->reg));
+        return;
+    }
+
+    // "lea r, name" is the absolute address.
+    if (rm->kind == ASM_SYM) {
+        asm_byte(4 + r);
+        asm_byte(37);
+        asm_fixup(rm->sym, 0, RELOC_32S);
+        return;
+    }
+
+    if (rm->reg == ASM_RIP) {
+        asm_byte(5 + r);
+        asm_fixup(rm->sym, rm->value, RELOC_PC32);
+        return;
+    }
+
+    if (rm->sym != NULL || rm->reg == ASM_NO_REG) {
+        error("cannot encode the memory of %s", rm->sym);
+    }
+
+    // "rbp" and "r13" without the displacement mean RIP or no base, so they have the zero displacement.
+    int base = asm_low3(rm->reg);
+    int mod = 128;
+    if (rm->value == 0 && base != 5) {
+        mod = 0;
+    } else if (asm_fits(rm->value, 1)) {
+        mod = 64;
+    }
+
+    // "rsp" and "r12" as the base need SIB, whose index 4 means no index.
+    if (rm->index_reg == ASM_NO_REG && base != 4) {
+        asm_byte(mod + r + base);
+    } else {
+        int index = 4;
+        if (rm->index_reg != ASM_NO_REG) {
+            index = asm_low3(rm->index_reg);
+        }
+        int ss = 0;
+        if (rm->scale == 2) {
+            ss = 1;
+        } else if (rm->scale == 4) {
+            ss = 2;
+        } else if (rm->scale == 8) {
+            ss = 3;
+        }
+        asm_byte(mod + r + 4);
+        asm_byte(ss * 64 + index * 8 + base);
+    }
+
+    if (mod == 64) {
+        asm_imm(rm->value, 1);
+    } else if (mod == 128) {
+        asm_imm(rm->value, 4);
+    }
+}
+
+// Emit the 32-bit field of the address of the symbol, it is resolved by the layout or the relocation.
+static void asm_fixup(char const* target, size_t value, int type)
+{
+    asm_fixup_target = target;
+    asm_fixup_pos = asm_code_len;
+    asm_fixup_value = value;
+    asm_fixup_type = type;
+    asm_imm(0, 4);
+}
+
+static void push_asm_code(void)
+{
+    AsmItem* item = push_asm_item(ASM_CODE);
+    item->len = asm_code_len;
+    item->bytes = arena_strndup(ir_arena, asm_code, asm_code_len);
+    item->target = asm_fixup_target;
+    item->fixup_pos = asm_fixup_pos;
+    item->fixup_value = asm_fixup_value;
+    item->fixup_type = asm_fixup_type;
+}
+
+// The label which is local in the section is resolved without the relocation.
+static int is_local_target(AsmSymbol const* sym, int section)
+{
+    if (sym->label == NULL || sym->is_global || sym->label->section != section) {
+        return 0;
+    }
+    return 1;
+}
+
+// Set the offsets of the items. The jumps start short and grow until all the displacements fit like GNU as.
+static void layout_asm_items(void)
+{
+    for (size_t i = 0; i < asm_items->len; i++) {
+        AsmItem* item = asm_items->data[i];
+        if (item->kind == ASM_JUMP) {
+            AsmSymbol const* sym = map_get(asm_symbols, item->target);
+            if (sym->label == NULL && strncmp(sym->name, ".L", 2) == 0) {
+                error("undefined label %s", sym->name);
+            }
+            if (sym->label == NULL || sym->label->section != item->section) {
+                item->is_long = 1;
+            }
+        }
+    }
+
+    int is_changed = 1;
+    while (is_changed) {
+        is_changed = 0;
+
+        size_t offsets[4];
+        for (int i = 0; i < 4; i++) {
+            offsets[i] = 0;
+        }
+
+        for (size_t i = 0; i < asm_items->len; i++) {
+            AsmItem* item = asm_items->data[i];
+            size_t offset = offsets[item->section];
+            item->offset = offset;
+
+            if (item->kind == ASM_CODE || item->kind == ASM_SPACE) {
+                item->size = item->len;
+            } else if (item->kind == ASM_LABEL) {
+                item->size = 0;
+            } else if (item->kind == ASM_ALIGN) {
+                size_t rest = offset - offset / item->len * item->len;
+                item->size = 0;
+                if (rest != 0) {
+                    item->size = item->len - rest;
+                }
+            } else if (!item->is_long) {
+                item->size = 2;
+            } else if (item->jump_opcode == OPCODE_JMP_SHORT) {
+                item->size = 5;
+            } else {
+                item->size = 6;
+            }
+
+            offsets[item->section] = offset + item->size;
+        }
+
+        for (size_t i = 0; i < asm_items->len; i++) {
+            AsmItem* item = asm_items->data[i];
+            if (item->kind == ASM_JUMP && !item->is_long) {
+                AsmSymbol const* sym = map_get(asm_symbols, item->target);
+                if (!asm_fits(sym->label->offset - item->offset - 2, 1)) {
+                    item->is_long = 1;
+                    is_changed = 1;
+                }
+            }
+        }
+    }
+}
+
+// The local symbols are followed by the global ones, and the temporary labels ".L" are omitted like GNU as.
+// The undefined symbols are global.
+static void build_asm_symtab(Buffer* symtab, Buffer* strtab)
+{
+    buf_append(strtab, "", 1);
+
+    // The null symbol and the symbols of ".text", ".data" and ".bss".
+    for (int i = 0; i < SECTION_RELA_TEXT; i++) {
+        asm_put(symtab, 0, 4);
+        if (i == 0) {
+            asm_put(symtab, 0, 2);
+        } else {
+            asm_put(symtab, 3, 1); // STB_LOCAL, STT_SECTION
+            asm_put(symtab, 0, 1);
+        }
+        asm_put(symtab, i, 2);
+        asm_put(symtab, 0, 8);
+        asm_put(symtab, 0, 8);
+    }
+
+    size_t count_symbols = SECTION_RELA_TEXT;
+    for (int is_global = 0; is_global < 2; is_global++) {
+        Vector const* syms = asm_symbols->vals;
+        for (size_t i = 0; i < syms->len; i++) {
+            AsmSymbol* sym = syms->data[i];
+            int is_sym_global = sym->is_global || sym->label == NULL;
+            if (is_sym_global == is_global && strncmp(sym->name, ".L", 2) != 0) {
+                sym->sym_index = count_symbols++;
+
+                asm_put(symtab, strtab->len, 4);
+                buf_append(strtab, sym->name, strlen(sym->name) + 1);
+                asm_put(symtab, is_global * 16, 1); // STB_GLOBAL or STB_LOCAL, STT_NOTYPE
+                asm_put(symtab, 0, 1);
+                if (sym->label != NULL) {
+                    asm_put(symtab, sym->label->section, 2);
+                    asm_put(symtab, sym->label->offset, 8);
+                } else {
+                    asm_put(symtab, 0, 2);
+                    asm_put(symtab, 0, 8);
+                }
+                asm_put(symtab, 0, 8);
+            }
+        }
+
+        // ".symtab" has the index of the first global symbol in "sh_info".
+        if (!is_global) {
+            count_asm_local_symbols = count_symbols;
+        }
+    }
+}
+
+static void emit_asm_sections(Buffer* text, Buffer* data, Buffer* rela)
+{
+    for (size_t i = 0; i < asm_items->len; i++) {
+        AsmItem const* item = asm_items->data[i];
+        Buffer* buf = text;
+        if (item->section == SECTION_DATA) {
+            buf = data;
+        } else if (item->section == SECTION_BSS) {
+            buf = NULL;
+        }
+
+        if (buf == NULL) {
+            if (item->kind == ASM_CODE || item->kind == ASM_JUMP) {
+                error("no content can be in .bss");
+            }
+        } else if (item->kind == ASM_CODE) {
+            buf_append(buf, item->bytes, item->len);
+            if (item->target != NULL) {
+                apply_asm_fixup(buf, item, rela);
+            }
+        } else if (item->kind == ASM_SPACE || item->kind == ASM_ALIGN) {
+            for (size_t j = 0; j < item->size; j++) {
+                asm_put(buf, 0, 1);
+            }
+        } else if (item->kind == ASM_JUMP) {
+            if (!item->is_long) {
+                ++count_short_jumps;
+                AsmSymbol const* sym = map_get(asm_symbols, item->target);
+                asm_put(buf, item->jump_opcode, 1);
+                asm_put(buf, sym->label->offset - item->offset - 2, 1);
+            } else {
+                if (item->jump_opcode == OPCODE_JMP_SHORT) {
+                    asm_put(buf, OPCODE_JMP_LONG, 1);
+                } else {
+                    asm_put(buf, 15, 1);
+                    asm_put(buf, item->jump_opcode + 16, 1);
+                }
+                // GNU as resolves the jump to the global symbol in the same section, but not the call.
+                AsmSymbol const* sym = map_get(asm_symbols, item->target);
+                if (sym->label != NULL && sym->label->section == item->section) {
+                    asm_put(buf, sym->label->offset - item->offset - item->size, 4);
+                } else {
+                    asm_put(buf, 0, 4);
+
+                    AsmItem fixup;
+                    fixup.section = item->section;
+                    fixup.offset = item->offset;
+                    fixup.len = item->size;
+                    fixup.target = item->target;
+                    fixup.fixup_pos = item->size - 4;
+                    fixup.fixup_value = 0;
+                    fixup.fixup_type = RELOC_PLT32;
+                    apply_asm_fixup(buf, &fixup, rela);
+                }
+            }
+        }
+    }
+}
+
+// Resolve the 32-bit field of the item, or append the relocation of it.
+// The relocations of the local symbols refer to the symbols of their sections like GNU as.
+static void apply_asm_fixup(Buffer* buf, AsmItem const* item, Buffer* rela)
+{
+    AsmSymbol const* sym = map_get(asm_symbols, item->target);
+    size_t pos = item->offset + item->fixup_pos;
+    size_t addend = item->fixup_value;
+
+    // The displacement is from the end of the instruction, the immediate may follow the field.
+    if (item->fixup_type != RELOC_32S) {
+        addend -= item->len - item->fixup_pos;
+        if (is_local_target(sym, item->section)) {
+            asm_patch(buf->data + pos, sym->label->offset - pos + addend, 4);
+            return;
+        }
+    }
+
+    if (item->section != SECTION_TEXT) {
+        error("relocation out of .text is not supported");
+    }
+
+    size_t sym_index = sym->sym_index;
+    if (sym->label != NULL && !sym->is_global) {
+        sym_index = sym->label->section;
+        addend += sym->label->offset;
+    }
+
+    asm_put(rela, pos, 8);
+    asm_put(rela, sym_index * 4294967296 + item->fixup_type, 8);
+    asm_put(rela, addend, 8);
+    ++count_relocations;
+}
+
+// Write the ELF header, the sections and the section headers.
+static void write_elf(Buffer* out, Buffer const** contents, size_t const* bss_size)
+{
+    size_t start = out->len;
+
+    // Names of the sections.
+    Buffer* shstrtab = new_buffer(128);
+    size_t names[9];
+    char const* section_names[9];
+    section_names[0] = "";
+    section_names[SECTION_TEXT] = ".text";
+    section_names[SECTION_DATA] = ".data";
+    section_names[SECTION_BSS] = ".bss";
+    section_names[SECTION_RELA_TEXT] = ".rela.text";
+    section_names[SECTION_SYMTAB] = ".symtab";
+    section_names[SECTION_STRTAB] = ".strtab";
+    section_names[SECTION_SHSTRTAB] = ".shstrtab";
+    section_names[SECTION_NOTE] = ".note.GNU-stack";
+    for (int i = 0; i < COUNT_SECTIONS; i++) {
+        names[i] = shstrtab->len;
+        buf_append(shstrtab, section_names[i], strlen(section_names[i]) + 1);
+    }
+    contents[SECTION_SHSTRTAB] = shstrtab;
+
+    // FIXME: use SHT_PROGBITS, SHT_SYMTAB, SHT_STRTAB, SHT_RELA and SHT_NOBITS.
+    size_t types[9];
+    size_t flags[9];
+    size_t links[9];
+    size_t infos[9];
+    size_t aligns[9];
+    size_t entsizes[9];
+    for (int i = 0; i < COUNT_SECTIONS; i++) {
+        types[i] = 1;
+        flags[i] = 0;
+        links[i] = 0;
+        infos[i] = 0;
+        aligns[i] = 1;
+        entsizes[i] = 0;
+    }
+    types[0] = 0;
+    flags[SECTION_TEXT] = 6; // SHF_ALLOC | SHF_EXECINSTR
+    aligns[SECTION_TEXT] = asm_section_align[SECTION_TEXT];
+    flags[SECTION_DATA] = 3; // SHF_WRITE | SHF_ALLOC
+    aligns[SECTION_DATA] = asm_section_align[SECTION_DATA];
+    types[SECTION_BSS] = 8;
+    flags[SECTION_BSS] = 3;
+    aligns[SECTION_BSS] = asm_section_align[SECTION_BSS];
+    types[SECTION_RELA_TEXT] = 4;
+    flags[SECTION_RELA_TEXT] = 64; // SHF_INFO_LINK
+    links[SECTION_RELA_TEXT] = SECTION_SYMTAB;
+    infos[SECTION_RELA_TEXT] = SECTION_TEXT;
+    aligns[SECTION_RELA_TEXT] = 8;
+    entsizes[SECTION_RELA_TEXT] = 24;
+    types[SECTION_SYMTAB] = 2;
+    links[SECTION_SYMTAB] = SECTION_STRTAB;
+    infos[SECTION_SYMTAB] = count_asm_local_symbols;
+    aligns[SECTION_SYMTAB] = 8;
+    entsizes[SECTION_SYMTAB] = 24;
+    types[SECTION_STRTAB] = 3;
+    types[SECTION_SHSTRTAB] = 3;
+
+    // ELF header, "e_shoff" is filled later.
+    asm_put(out, 127, 1);
+    buf_append(out, "ELF", 3);
+    asm_put(out, 2, 1); // ELFCLASS64
+    asm_put(out, 1, 1); // ELFDATA2LSB
+    asm_put(out, 1, 1); // EV_CURRENT
+    asm_put(out, 0, 8);
+    asm_put(out, 0, 1);
+    asm_put(out, 1, 2);  // ET_REL
+    asm_put(out, 62, 2); // EM_X86_64
+    asm_put(out, 1, 4);
+    asm_put(out, 0, 8);
+    asm_put(out, 0, 8);
+    asm_put(out, 0, 8);
+    asm_put(out, 0, 4);
+    asm_put(out, 64, 2);
+    asm_put(out, 0, 2);
+    asm_put(out, 0, 2);
+    asm_put(out, 64, 2);
+    asm_put(out, COUNT_SECTIONS, 2);
+    asm_put(out, SECTION_SHSTRTAB, 2);
+
+    size_t offsets[9];
+    size_t sizes[9];
+    for (int i = 0; i < COUNT_SECTIONS; i++) {
+        offsets[i] = 0;
+        sizes[i] = 0;
+        if (i == SECTION_BSS) {
+            sizes[i] = bss_size[0];
+        } else if (i != 0 && i != SECTION_NOTE) {
+            asm_pad(out, aligns[i]);
+            offsets[i] = out->len - start;
+            sizes[i] = contents[i]->len;
+            buf_append(out, contents[i]->data, contents[i]->len);
+        }
+    }
+
+    asm_pad(out, 8);
+    asm_patch(out->data + start + 40, out->len - start, 8);
+    for (int i = 0; i < COUNT_SECTIONS; i++) {
+        asm_put(out, names[i], 4);
+        asm_put(out, types[i], 4);
+        asm_put(out, flags[i], 8);
+        asm_put(out, 0, 8);
+        asm_put(out, offsets[i], 8);
+        asm_put(out, sizes[i], 8);
+        asm_put(out, links[i], 4);
+        asm_put(out, infos[i], 4);
+        asm_put(out, aligns[i], 8);
+        asm_put(out, entsizes[i], 8);
+    }
+
+    free(shstrtab->data);
+}
+
+// Append the value in little endian.
+static void asm_put(Buffer* buf, size_t value, int size)
+{
+    char bytes[8];
+    asm_patch(bytes, value, size);
+    buf_append(buf, bytes, size);
+}
+
+// Store the value in little endian, the negative value is in two's complement.
+static void asm_patch(char* p, size_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        size_t rest = value / 256;
+        size_t byte = value - rest * 256;
+
+        // The division of the self-hosted build is signed.
+#ifndef SELFHOST_9MM
+        if ((long)byte < 0) {
+#else
+        if (byte < 0) {
+#endif
+            byte += 256;
+            rest -= 1;
+        }
+        p[i] = byte;
+        value = rest;
+    }
+}
+
+static void asm_pad(Buffer* buf, size_t align)
+{
+    while (buf->len - buf->len / align * align != 0) {
+        asm_put(buf, 0, 1);
+    }
+}
+
+void print_elf_stats(void)
+{
+    fprintf(stderr, "# elf: %zd instructions, %zd relocations\n", count_asm_insns, count_relocations);
+    fprintf(stderr, "# elf: %zd of %zd jumps are short\n", count_short_jumps, count_jumps);
+}
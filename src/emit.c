@@ -0,0 +1,479 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static void grow_emitter(void);
+static void emit_char(char);
+static void emit_digits(char const*, size_t);
+static void emit_operands(char const*, char const*);
+static void end_insn(void);
+static void peephole(void);
+static int remove_self_move(void);
+static int remove_reload(void);
+static int fold_branch(void);
+static void remove_insns(size_t);
+static void find_field(size_t, int, size_t*, size_t*);
+static int is_op(size_t, char const*);
+static int is_field(size_t, int, char const*);
+static int is_same_field(size_t, int, size_t, int);
+static void copy_field(size_t, int, char*, size_t);
+static int is_reg64(size_t, int);
+#endif
+
+// Generated assembly, it is appended to the output at once by emit_flush.
+// It is not NUL-terminated unlike Buffer to copy the small pieces without strlen.
+static char* emit_data;
+static size_t emit_len;
+static size_t emit_capacity;
+
+// The number of emitted instructions.
+static size_t count_insns;
+
+// Start offsets of the last instructions which are adjacent in the buffer.
+// Labels and the other lines break the sequence, so the peephole rules never cross them.
+static size_t window[4];
+static size_t count_window;
+static size_t window_end;
+static size_t insn_start;
+
+// The number of the instructions eliminated by each peephole rule.
+static size_t count_self_moves;
+static size_t count_reloads;
+static size_t count_branches;
+
+void init_emitter(void)
+{
+    // The buffer is left if the previous compilation failed.
+    free(emit_data);
+    emit_capacity = 1024 * 1024;
+    emit_data = malloc(emit_capacity);
+    emit_len = 0;
+    count_insns = 0;
+    count_window = 0;
+    window_end = 0;
+}
+
+static void grow_emitter(void)
+{
+    emit_capacity *= 2;
+    emit_data = realloc(emit_data, emit_capacity);
+    if (emit_data == NULL) {
+        error("cannot allocate %zd bytes for assembly", emit_capacity);
+    }
+}
+
+void emit(char const* str)
+{
+    // Keep the cursor in the local variables, the stores may alias the globals.
+    char* p = emit_data + emit_len;
+    char* end = emit_data + emit_capacity;
+    while (*str) {
+        if (p == end) {
+            emit_len = p - emit_data;
+            grow_emitter();
+            p = emit_data + emit_len;
+            end = emit_data + emit_capacity;
+        }
+        *p = *str;
+        ++p;
+        ++str;
+    }
+    emit_len = p - emit_data;
+}
+
+static void emit_char(char c)
+{
+    if (emit_len == emit_capacity) {
+        grow_emitter();
+    }
+    emit_data[emit_len] = c;
+    ++emit_len;
+}
+
+static void emit_digits(char const* digits, size_t len)
+{
+    while (emit_capacity < emit_len + len) {
+        grow_emitter();
+    }
+    memcpy(emit_data + emit_len, digits, len);
+    emit_len += len;
+}
+
+// Append the signed decimal number.
+void emit_num(size_t n)
+{
+    char digits[24];
+    size_t i = 24;
+
+#ifndef SELFHOST_9MM
+    int is_negative = (long)n < 0;
+#else
+    int is_negative = n < 0;
+#endif
+    if (is_negative) {
+        n = 0 - n;
+    }
+
+    while (1) {
+        digits[--i] = '0' + n - n / 10 * 10;
+        n = n / 10;
+        if (n == 0) {
+            break;
+        }
+    }
+
+    if (is_negative) {
+        digits[--i] = '-';
+    }
+
+    emit_digits(digits + i, 24 - i);
+}
+
+// Append the address as the hexadecimal number like "%p".
+void emit_ptr(void const* ptr)
+{
+    char digits[24];
+    size_t i = 24;
+    size_t n = (size_t)ptr;
+
+    while (1) {
+        size_t d = n - n / 16 * 16;
+        if (d < 10) {
+            digits[--i] = '0' + d;
+        } else {
+            digits[--i] = 'a' + d - 10;
+        }
+        n = n / 16;
+        if (n == 0) {
+            break;
+        }
+    }
+
+    emit("0x");
+    emit_digits(digits + i, 24 - i);
+}
+
+// "  op\n"
+void emit_op0(char const* op)
+{
+    insn_start = emit_len;
+    emit("  ");
+    emit(op);
+    emit_char('\n');
+    end_insn();
+}
+
+// "  op a\n"
+void emit_op1(char const* op, char const* a)
+{
+    emit_operands(op, a);
+    emit_char('\n');
+    end_insn();
+}
+
+// "  op a, b\n"
+void emit_op2(char const* op, char const* a, char const* b)
+{
+    emit_operands(op, a);
+    emit(", ");
+    emit(b);
+    emit_char('\n');
+    end_insn();
+}
+
+// "  op a, n\n"
+void emit_op_num(char const* op, char const* a, size_t n)
+{
+    emit_operands(op, a);
+    emit(", ");
+    emit_num(n);
+    emit_char('\n');
+    end_insn();
+}
+
+// "  op a, [base-offset]\n"
+void emit_op_reg_mem(char const* op, char const* a, char const* base, size_t offset)
+{
+    emit_operands(op, a);
+    emit(", [");
+    emit(base);
+    emit_char('-');
+    emit_num(offset);
+    emit("]\n");
+    end_insn();
+}
+
+// "  op [base-offset], b\n"
+void emit_op_mem_reg(char const* op, char const* base, size_t offset, char const* b)
+{
+    emit_operands(op, "[");
+    emit(base);
+    emit_char('-');
+    emit_num(offset);
+    emit("], ");
+    emit(b);
+    emit_char('\n');
+    end_insn();
+}
+
+// "  op prefix0x...\n"
+void emit_jump(char const* op, char const* prefix, void const* ptr)
+{
+    emit_operands(op, prefix);
+    emit_ptr(ptr);
+    emit_char('\n');
+    end_insn();
+}
+
+// "name:\n"
+void emit_label(char const* name)
+{
+    emit(name);
+    emit(":\n");
+}
+
+// "prefix0x...:\n"
+void emit_label_ptr(char const* prefix, void const* ptr)
+{
+    emit(prefix);
+    emit_ptr(ptr);
+    emit(":\n");
+}
+
+// Append "  op a".
+static void emit_operands(char const* op, char const* a)
+{
+    insn_start = emit_len;
+    emit("  ");
+    emit(op);
+    emit_char(' ');
+    emit(a);
+}
+
+// Count the instruction which has been appended from insn_start and optimize the tail of the sequence.
+static void end_insn(void)
+{
+    ++count_insns;
+
+    if (insn_start != window_end) {
+        count_window = 0;
+    }
+    if (count_window == 4) {
+        for (size_t i = 1; i < 4; i++) {
+            window[i - 1] = window[i];
+        }
+        --count_window;
+    }
+    window[count_window++] = insn_start;
+    window_end = emit_len;
+
+    peephole();
+}
+
+// Apply the rules to the last instructions.
+// The rewritten instructions are emitted again, so the rules are chained.
+static void peephole(void)
+{
+    // Every rule ends with "mov", "movzx" or a conditional jump.
+    char c = emit_data[window[count_window - 1] + 2];
+    if (c == 'm') {
+        if (remove_self_move()) {
+            ++count_self_moves;
+        } else if (remove_reload()) {
+            ++count_reloads;
+        }
+    } else if (c == 'j' && fold_branch()) {
+        ++count_branches;
+    }
+}
+
+// "mov r, r" -> nothing
+static int remove_self_move(void)
+{
+    if (!is_op(0, "mov") || !is_same_field(0, 1, 0, 2)) {
+        return 0;
+    }
+
+    // "mov r32, r32" clears the upper half.
+    if (!is_reg64(0, 1)) {
+        return 0;
+    }
+
+    remove_insns(1);
+    return 1;
+}
+
+// "mov [m], r" + "mov r, [m]" -> "mov [m], r"
+static int remove_reload(void)
+{
+    if (count_window < 2 || !is_op(1, "mov") || !is_op(0, "mov")) {
+        return 0;
+    }
+    if (!is_same_field(1, 1, 0, 2) || !is_same_field(1, 2, 0, 1)) {
+        return 0;
+    }
+
+    // The narrow load would clear the upper bits of the register.
+    if (!is_reg64(0, 1)) {
+        return 0;
+    }
+
+    remove_insns(1);
+    return 1;
+}
+
+// "setcc al" + "movzx r, al" + "cmp r, 0" + "je L" -> "setcc al" + "movzx r, al" + "jncc L"
+// The flags of the first comparison are still valid because setcc and movzx do not change them.
+static int fold_branch(void)
+{
+    if (count_window < 4 || !is_op(1, "cmp") || !is_field(1, 2, "0")) {
+        return 0;
+    }
+    if (!is_op(2, "movzx") || !is_field(2, 2, "al") || !is_same_field(2, 1, 1, 1)) {
+        return 0;
+    }
+
+    int is_je = is_op(0, "je");
+    if (!is_je && !is_op(0, "jne")) {
+        return 0;
+    }
+
+    // "setcc" is taken when the boolean is 1, so "je" jumps on the inverted condition.
+    char const* jump = NULL;
+    if (is_op(3, "sete")) {
+        jump = "je";
+        if (is_je) {
+            jump = "jne";
+        }
+    } else if (is_op(3, "setne")) {
+        jump = "jne";
+        if (is_je) {
+            jump = "je";
+        }
+    } else if (is_op(3, "setl")) {
+        jump = "jl";
+        if (is_je) {
+            jump = "jge";
+        }
+    } else if (is_op(3, "setle")) {
+        jump = "jle";
+        if (is_je) {
+            jump = "jg";
+        }
+    } else {
+        return 0;
+    }
+
+    char label[64];
+    copy_field(0, 1, label, 64);
+
+    remove_insns(2);
+    emit_op1(jump, label);
+    return 1;
+}
+
+// Remove the last n instructions in the window.
+static void remove_insns(size_t n)
+{
+    count_window -= n;
+    emit_len = window[count_window];
+    window_end = emit_len;
+    count_insns -= n;
+}
+
+// Find the field of the k-th last instruction, 0 is the mnemonic and 1 and 2 are the operands.
+// The missing field is empty.
+static void find_field(size_t k, int n, size_t* head, size_t* len)
+{
+    size_t i = window[count_window - 1 - k] + 2;
+    for (int j = 0; j <= n; j++) {
+        *head = i;
+
+        // The mnemonic ends with the space, the operands end with the comma.
+        while (emit_data[i] != '\n' && !(j == 0 && emit_data[i] == ' ') && !(j != 0 && emit_data[i] == ',')) {
+            ++i;
+        }
+        *len = i - *head;
+
+        if (emit_data[i] == ',') {
+            ++i;
+        }
+        if (emit_data[i] == ' ') {
+            ++i;
+        }
+    }
+}
+
+// Return 1 if the mnemonic of the k-th last instruction is op.
+static int is_op(size_t k, char const* op)
+{
+    char const* p = emit_data + window[count_window - 1 - k] + 2;
+    size_t len = strlen(op);
+    return memcmp(p, op, len) == 0 && (p[len] == ' ' || p[len] == '\n');
+}
+
+static int is_field(size_t k, int n, char const* str)
+{
+    size_t head = 0;
+    size_t len = 0;
+    find_field(k, n, &head, &len);
+    return len == strlen(str) && memcmp(emit_data + head, str, len) == 0;
+}
+
+static int is_same_field(size_t k1, int n1, size_t k2, int n2)
+{
+    size_t head1 = 0;
+    size_t len1 = 0;
+    size_t head2 = 0;
+    size_t len2 = 0;
+    find_field(k1, n1, &head1, &len1);
+    find_field(k2, n2, &head2, &len2);
+    return len1 == len2 && memcmp(emit_data + head1, emit_data + head2, len1) == 0;
+}
+
+// Copy the field as the NUL-terminated string, the long one is truncated.
+static void copy_field(size_t k, int n, char* buf, size_t size)
+{
+    size_t head = 0;
+    size_t len = 0;
+    find_field(k, n, &head, &len);
+    if (size <= len) {
+        len = size - 1;
+    }
+    memcpy(buf, emit_data + head, len);
+    buf[len] = '\0';
+}
+
+// Return 1 if the field is the 64-bit general register.
+static int is_reg64(size_t k, int n)
+{
+    size_t head = 0;
+    size_t len = 0;
+    find_field(k, n, &head, &len);
+    if (len < 2 || emit_data[head] != 'r') {
+        return 0;
+    }
+    char last = emit_data[head + len - 1];
+    return last != 'd' && last != 'w' && last != 'b';
+}
+
+// Count the immediate which is used as the operand instead of being moved into the register.
+void print_peephole_stats(void)
+{
+    fprintf(stderr, "# peephole: %zd self-moves, %zd reloads\n", count_self_moves, count_reloads);
+    fprintf(stderr, "# peephole: %zd branches\n", count_branches);
+}
+
+// Append the whole assembly to the buffer.
+void emit_flush(Buffer* out)
+{
+    buf_append(out, emit_data, emit_len);
+
+    free(emit_data);
+    emit_data = NULL;
+    emit_len = 0;
+}
+
+size_t count_emitted_insns(void)
+{
+    return count_insns;
+}
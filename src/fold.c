@@ -0,0 +1,275 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static Node* fold(Node*);
+static Node* fold_binary(Node*);
+static Node* fold_if(Node*);
+static Node* fold_loop(Node*);
+static Node* to_num(Node*, size_t);
+static Node* new_block_node(void);
+static Node* new_num_node(size_t);
+static int is_num(Node const*, size_t);
+static int is_pure(Node const*);
+#endif
+
+// Statistics of the folding.
+static size_t count_folded_constants;
+static size_t count_folded_identities;
+static size_t count_folded_branches;
+
+// Collapse the constant subtrees of the global definition.
+// The nodes are rewritten in place or replaced by their operands.
+Node* fold_constants(Node* node)
+{
+    if (node->ty == ND_FUNCTION && node->lhs != NULL) {
+        node->lhs = fold(node->lhs);
+    }
+    return node;
+}
+
+void print_fold_stats(void)
+{
+    fprintf(stderr, "# fold: %zd constants, %zd identities, %zd branches\n", count_folded_constants, count_folded_identities, count_folded_branches);
+}
+
+static Node* fold(Node* node)
+{
+    if (node == NULL) {
+        return NULL;
+    }
+
+    int ty = node->ty;
+
+    if (ty == ND_BLOCK) {
+        for (size_t i = 0; i < node->stmts->len; i++) {
+            node->stmts->data[i] = fold(node->stmts->data[i]);
+        }
+        return node;
+    }
+
+    if (ty == ND_IF) {
+        return fold_if(node);
+    }
+
+    if (ty == ND_WHILE || ty == ND_FOR) {
+        return fold_loop(node);
+    }
+
+    if (ty == ND_CALL) {
+        Vector* args = node->call->arguments;
+        for (size_t i = 0; i < args->len; i++) {
+            args->data[i] = fold(args->data[i]);
+        }
+        return node;
+    }
+
+    node->lhs = fold(node->lhs);
+    node->rhs = fold(node->rhs);
+
+    Node* lhs = node->lhs;
+    if (ty == '!' && lhs->ty == ND_NUM) {
+        return to_num(node, lhs->val == 0);
+    }
+
+    if (ty == ND_AND || ty == ND_OR) {
+        Node* rhs = node->rhs;
+        if (ty == ND_AND && is_num(lhs, 0)) {
+            // 0 && x -> 0
+            return to_num(node, 0);
+        }
+        if (ty == ND_OR && lhs->ty == ND_NUM && lhs->val != 0) {
+            // 1 || x -> 1
+            return to_num(node, 1);
+        }
+        if (lhs->ty == ND_NUM && rhs->ty == ND_NUM) {
+            return to_num(node, rhs->val != 0);
+        }
+        return node;
+    }
+
+    if (ty == '+' || ty == '-' || ty == '*' || ty == '/' ||
+        ty == ND_EQ || ty == ND_NE || ty == '<' || ty == TK_LE) {
+        return fold_binary(node);
+    }
+
+    return node;
+}
+
+static Node* fold_binary(Node* node)
+{
+    int ty = node->ty;
+    Node* lhs = node->lhs;
+    Node* rhs = node->rhs;
+
+    if (lhs->ty == ND_NUM && rhs->ty == ND_NUM) {
+        size_t l = lhs->val;
+        size_t r = rhs->val;
+
+        // The operands are evaluated as the signed 64-bit integers like the generated code.
+        if (ty == '+') {
+            return to_num(node, l + r);
+        } else if (ty == '-') {
+            return to_num(node, l - r);
+        } else if (ty == '*') {
+            return to_num(node, l * r);
+        } else if (ty == ND_EQ) {
+            return to_num(node, l == r);
+        } else if (ty == ND_NE) {
+            return to_num(node, l != r);
+        }
+
+#ifndef SELFHOST_9MM
+        if (ty == '/' && r != 0 && (long)r != -1) {
+            return to_num(node, (long)l / (long)r);
+        } else if (ty == '<') {
+            return to_num(node, (long)l < (long)r);
+        } else if (ty == TK_LE) {
+            return to_num(node, (long)l <= (long)r);
+        }
+#else
+        if (ty == '/' && r != 0 && r != 0 - 1) {
+            return to_num(node, l / r);
+        } else if (ty == '<') {
+            return to_num(node, l < r);
+        } else if (ty == TK_LE) {
+            return to_num(node, l <= r);
+        }
+#endif
+
+        // Keep the division by zero to fail at runtime.
+        return node;
+    }
+
+    // x + 0, x - 0, x * 1, x / 1 -> x
+    if (((ty == '+' || ty == '-') && is_num(rhs, 0)) ||
+        ((ty == '*' || ty == '/') && is_num(rhs, 1))) {
+        ++count_folded_identities;
+        return lhs;
+    }
+
+    // 0 + x, 1 * x -> x
+    if ((ty == '+' && is_num(lhs, 0)) || (ty == '*' && is_num(lhs, 1))) {
+        ++count_folded_identities;
+        return rhs;
+    }
+
+    // x * 0, 0 * x -> 0 if x does not have side effects.
+    if (ty == '*' && ((is_num(rhs, 0) && is_pure(lhs)) || (is_num(lhs, 0) && is_pure(rhs)))) {
+        ++count_folded_identities;
+        return to_num(node, 0);
+    }
+
+    return node;
+}
+
+// Replace "if" which has the constant condition with the taken branch.
+static Node* fold_if(Node* node)
+{
+    NodeIfElse* if_else = node->if_else;
+    if_else->condition = fold(if_else->condition);
+    if_else->body = fold(if_else->body);
+    if_else->else_body = fold(if_else->else_body);
+
+    Node* condition = if_else->condition;
+    if (condition->ty != ND_NUM) {
+        return node;
+    }
+
+    ++count_folded_branches;
+    if (condition->val != 0) {
+        return if_else->body;
+    }
+    if (if_else->else_body != NULL) {
+        return if_else->else_body;
+    }
+
+    // The value of the empty block is 0 as well as "if" without "else".
+    return new_block_node();
+}
+
+// Remove the loop which never runs and the condition which is always true.
+static Node* fold_loop(Node* node)
+{
+    Node* condition = NULL;
+    if (node->ty == ND_WHILE) {
+        node->lhs = fold(node->lhs);
+        node->rhs = fold(node->rhs);
+        condition = node->lhs;
+    } else {
+        NodeFor* fors = node->fors;
+        fors->initializing = fold(fors->initializing);
+        fors->condition = fold(fors->condition);
+        fors->updating = fold(fors->updating);
+        fors->body = fold(fors->body);
+        condition = fors->condition;
+    }
+
+    if (condition == NULL || condition->ty != ND_NUM) {
+        return node;
+    }
+
+    ++count_folded_branches;
+
+    if (condition->val != 0) {
+        // NULL condition makes the infinite loop.
+        if (node->ty == ND_WHILE) {
+            node->lhs = NULL;
+        } else {
+            node->fors->condition = NULL;
+        }
+        return node;
+    }
+
+    // Only the initialization is left, the value of the loop is 0.
+    Node* block_node = new_block_node();
+    if (node->ty == ND_FOR && node->fors->initializing != NULL) {
+        vec_push(block_node->stmts, node->fors->initializing);
+        vec_push(block_node->stmts, new_num_node(0));
+    }
+    return block_node;
+}
+
+// Rewrite the node into the constant, its type is kept.
+static Node* to_num(Node* node, size_t val)
+{
+    ++count_folded_constants;
+    node->ty = ND_NUM;
+    node->val = val;
+    node->lhs = NULL;
+    node->rhs = NULL;
+    return node;
+}
+
+static Node* new_block_node(void)
+{
+    Node* node = arena_alloc(ast_arena, sizeof(Node));
+    node->ty = ND_BLOCK;
+    node->lhs = NULL;
+    node->rhs = NULL;
+    node->rtype = NULL;
+    node->stmts = new_vector();
+    return node;
+}
+
+static Node* new_num_node(size_t val)
+{
+    Node* node = arena_alloc(ast_arena, sizeof(Node));
+    node->ty = ND_NUM;
+    node->lhs = NULL;
+    node->rhs = NULL;
+    node->rtype = NULL;
+    node->val = val;
+    return node;
+}
+
+static int is_num(Node const* node, size_t val)
+{
+    return node->ty == ND_NUM && node->val == val;
+}
+
+// Return 1 if evaluating the node has no side effects.
+static int is_pure(Node const* node)
+{
+    int ty = node->ty;
+    return ty == ND_NUM || ty == ND_LVAR || ty == ND_GVAR;
+}
@@ -0,0 +1,263 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static int is_inlinable(IrFunction const*);
+static IrFunction const* find_callee(IrInsn const*);
+static void inline_function_calls(IrFunction*);
+static BasicBlock* inline_call(IrFunction*, IrInsn const*, IrFunction const*, BasicBlock*, Vector*);
+static IrInsn* copy_callee_insn(IrInsn const*, size_t);
+static char const* rename_callee_local(Map*, char const*);
+static BasicBlock* find_copied_block(IrFunction const*, Vector const*, BasicBlock const*);
+#endif
+
+enum {
+    DEFAULT_INLINE_LIMIT = 40
+};
+
+// Leaf functions which have at most this number of instructions are inlined, 0 disables inlining.
+static size_t inline_limit;
+static int is_inline_limit_set;
+
+// Function table of the translation unit.
+static Map* ast_function_map;    // Name -> "Node" of the function.
+static Map* inlinable_functions; // Name -> "IrFunction" which can be inlined.
+
+// Statistics of the inlining.
+static size_t count_inlinable_functions;
+static size_t count_inlined_calls;
+
+void set_inline_limit(size_t limit)
+{
+    inline_limit = limit;
+    is_inline_limit_set = 1;
+}
+
+// The limit which is used by inline_calls, it changes the assembly.
+size_t get_inline_limit(void)
+{
+    if (!is_inline_limit_set) {
+        return DEFAULT_INLINE_LIMIT;
+    }
+    return inline_limit;
+}
+
+// Replace the calls of the small leaf functions in the same translation unit with copies of their bodies.
+// The leaf functions never call the others, so the recursive functions are not inlined
+// and the bodies which are copied are never changed by the inlining.
+// It runs before build_cfg, the blocks are not linked yet.
+void inline_calls(Vector const* functions, Map* function_map)
+{
+    inline_limit = get_inline_limit();
+    if (inline_limit == 0) {
+        return;
+    }
+
+    ast_function_map = function_map;
+    inlinable_functions = new_map();
+    for (size_t i = 0; i < functions->len; i++) {
+        IrFunction* func = functions->data[i];
+        if (is_inlinable(func)) {
+            map_put(inlinable_functions, func->name, func);
+            ++count_inlinable_functions;
+        }
+    }
+
+    for (size_t i = 0; i < functions->len; i++) {
+        inline_function_calls(functions->data[i]);
+    }
+
+    ast_function_map = NULL;
+    inlinable_functions = NULL;
+}
+
+void print_inline_stats(void)
+{
+    fprintf(stderr, "# inline: %zd calls of %zd leaf functions\n", count_inlined_calls, count_inlinable_functions);
+}
+
+static int is_inlinable(IrFunction const* func)
+{
+    size_t count_insns = 0;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->op == IR_CALL) {
+                return 0;
+            }
+        }
+        count_insns += block->insns->len;
+    }
+    if (inline_limit < count_insns) {
+        return 0;
+    }
+    return 1;
+}
+
+// Return the function which is called by the instruction if it can be inlined, NULL otherwise.
+static IrFunction const* find_callee(IrInsn const* insn)
+{
+    if (insn->op != IR_CALL) {
+        return NULL;
+    }
+
+    IrFunction const* callee = map_get(inlinable_functions, insn->name);
+    if (callee == NULL) {
+        return NULL;
+    }
+
+    // The arguments have to match the parameters.
+    Node const* node = map_get(ast_function_map, insn->name);
+    NodeFunction const* definition = node->function;
+    if (definition->args->len != insn->args->len) {
+        return NULL;
+    }
+    return callee;
+}
+
+static void inline_function_calls(IrFunction* func)
+{
+    Vector* blocks = new_vector();
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock* block = func->blocks->data[i];
+        vec_push(blocks, block);
+
+        size_t j = 0;
+        while (j < block->insns->len) {
+            IrInsn const* insn = block->insns->data[j];
+            IrFunction const* callee = find_callee(insn);
+            if (callee != NULL) {
+                // The instructions after the call are moved into the new block, they may have more calls.
+                BasicBlock* rest = new_block();
+                for (size_t k = j + 1; k < block->insns->len; k++) {
+                    vec_push(rest->insns, block->insns->data[k]);
+                }
+                block->insns->len = j;
+
+                BasicBlock* entry = inline_call(func, insn, callee, rest, blocks);
+                IrInsn* jump = copy_callee_insn(NULL, 0);
+                jump->op = IR_JMP;
+                jump->then_block = entry;
+                vec_push(block->insns, jump);
+
+                vec_push(blocks, rest);
+                block = rest;
+                j = 0;
+            } else {
+                ++j;
+            }
+        }
+    }
+    func->blocks = blocks;
+}
+
+// Append the copy of the callee which returns to the given block, and return its entry block.
+static BasicBlock* inline_call(IrFunction* func, IrInsn const* call, IrFunction const* callee, BasicBlock* return_block, Vector* blocks)
+{
+    ++count_inlined_calls;
+
+    // The virtual registers of the callee are numbered after the ones of the caller.
+    size_t vreg_base = func->count_vregs;
+    func->count_vregs += callee->count_vregs;
+
+    // The locals of the callee are placed under the ones of the caller, and they are aligned as well as in its frame.
+    size_t frame_base = (func->frame_size + 15) / 16 * 16;
+    func->frame_size = frame_base + callee->frame_size;
+    Map* local_names = new_map();
+
+    Vector* copies = new_vector();
+    for (size_t i = 0; i < callee->blocks->len; i++) {
+        vec_push(copies, new_block());
+    }
+
+    for (size_t i = 0; i < callee->blocks->len; i++) {
+        BasicBlock const* block = callee->blocks->data[i];
+        BasicBlock* copy = copies->data[i];
+        vec_push(blocks, copy);
+
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn* insn = copy_callee_insn(block->insns->data[j], vreg_base);
+            int op = insn->op;
+
+            if (op == IR_ARG) {
+                // The argument is truncated by the following store into the parameter.
+                insn->op = IR_MOV;
+                insn->lhs = (size_t)call->args->data[insn->imm];
+                insn->imm = 0;
+            } else if (op == IR_LOCAL) {
+                insn->name = rename_callee_local(local_names, insn->name);
+                insn->imm += frame_base;
+            } else if (op == IR_RET) {
+                // The returned value is written into the result of the call.
+                if (insn->lhs == 0) {
+                    insn->op = IR_IMM;
+                    insn->imm = 0;
+                } else {
+                    insn->op = IR_MOV;
+                }
+                insn->dst = call->dst;
+                vec_push(copy->insns, insn);
+
+                insn = copy_callee_insn(NULL, 0);
+                insn->op = IR_JMP;
+                insn->then_block = return_block;
+            } else if (op == IR_JMP || op == IR_BR) {
+                insn->then_block = find_copied_block(callee, copies, insn->then_block);
+                if (op == IR_BR) {
+                    insn->else_block = find_copied_block(callee, copies, insn->else_block);
+                }
+            }
+
+            vec_push(copy->insns, insn);
+        }
+    }
+
+    return copies->data[0];
+}
+
+// Copy the instruction whose virtual registers are shifted by vreg_base, or make the empty one if it is NULL.
+static IrInsn* copy_callee_insn(IrInsn const* insn, size_t vreg_base)
+{
+    IrInsn* copy = arena_alloc(ir_arena, sizeof(IrInsn));
+    if (insn == NULL) {
+        memset(copy, 0, sizeof(IrInsn));
+        return copy;
+    }
+
+    memcpy(copy, insn, sizeof(IrInsn));
+    if (copy->dst != 0) {
+        copy->dst += vreg_base;
+    }
+    if (copy->lhs != 0) {
+        copy->lhs += vreg_base;
+    }
+    if (copy->rhs != 0) {
+        copy->rhs += vreg_base;
+    }
+    return copy;
+}
+
+// The locals of each inlined call are distinguished from the ones of the caller by their names.
+static char const* rename_callee_local(Map* local_names, char const* name)
+{
+    char const* renamed = map_get(local_names, name);
+    if (renamed != NULL) {
+        return renamed;
+    }
+
+    char* buf = arena_alloc(ir_arena, strlen(name) + 24);
+    sprintf(buf, "%s.%zd", name, count_inlined_calls);
+    map_put(local_names, name, buf);
+    return buf;
+}
+
+static BasicBlock* find_copied_block(IrFunction const* callee, Vector const* copies, BasicBlock const* block)
+{
+    for (size_t i = 0; i < callee->blocks->len; i++) {
+        if (callee->blocks->data[i] == block) {
+            return copies->data[i];
+        }
+    }
+    error("the jump target is not in %s", callee->name);
+    return NULL;
+}
@@ -0,0 +1,724 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static IrFunction* lower_function(Node const*);
+static size_t lower_stmt(Node const*, int);
+static size_t lower_expr(Node const*);
+static size_t lower_addr(Node const*);
+static size_t lower_and_or(Node const*);
+static void lower_cond(Node const*, BasicBlock*, BasicBlock*);
+static size_t new_vreg(void);
+static IrInsn* add_insn(int, size_t, size_t, size_t);
+static size_t add_imm(size_t);
+static size_t add_offset(size_t, size_t);
+static void add_jump(BasicBlock*);
+static void add_branch(size_t, BasicBlock*, BasicBlock*);
+static void start_block(BasicBlock*);
+static void mark_reachable(Vector*, BasicBlock*);
+static void build_cfg(IrFunction*);
+static void link_blocks(BasicBlock*, BasicBlock*);
+static void dump_vreg(size_t);
+static void dump_insn(IrInsn const*);
+static char const* ir_op_name(int);
+#endif
+
+// Function which is being lowered.
+static IrFunction* lowering_function;
+
+// Block which the instructions are appended to.
+static BasicBlock* lowering_block;
+
+// Block which "break" jumps to, NULL outside of the loops.
+static BasicBlock* break_block;
+
+// The number of the created blocks to give them unique ids.
+static size_t count_blocks;
+
+// Lower the functions into the basic blocks of three-address instructions.
+Vector const* lower_ir(Code const* code)
+{
+    Vector* functions = new_vector();
+    count_blocks = 0;
+
+    for (size_t i = 0; i < code->count_ast; ++i) {
+        Node const* node = code->asts[i];
+        // Skip prototypes.
+        if (node->ty == ND_FUNCTION && node->lhs != NULL) {
+            vec_push(functions, lower_function(node));
+        }
+    }
+
+    // The copies of the callees are optimized together with the callers.
+    inline_calls(functions, code->function_map);
+
+    for (size_t i = 0; i < functions->len; i++) {
+        IrFunction* func = functions->data[i];
+        build_cfg(func);
+        optimize_ir(func);
+    }
+
+    return functions;
+}
+
+static IrFunction* lower_function(Node const* node)
+{
+    IrFunction* func = arena_alloc(ir_arena, sizeof(IrFunction));
+    func->name = node->function->name;
+    func->args = node->function->args;
+    func->context = node->function->context;
+    func->frame_size = func->context->current_offset;
+    func->blocks = new_vector();
+    func->count_vregs = 0;
+
+    lowering_function = func;
+    break_block = NULL;
+    start_block(new_block());
+
+    // Store the arguments into the local variables after all of them are read,
+    // because the stores may use the argument registers as the scratch registers.
+    Vector* arg_vregs = new_vector();
+    for (size_t i = 0; i < func->args->len; i++) {
+        IrInsn* insn = add_insn(IR_ARG, new_vreg(), 0, 0);
+        insn->imm = i;
+        vec_push(arg_vregs, (void*)insn->dst);
+    }
+    for (size_t i = 0; i < func->args->len; i++) {
+        Node const* arg = func->args->data[i];
+        IrInsn* local = add_insn(IR_LOCAL, new_vreg(), 0, 0);
+        local->name = arg->name;
+        local->imm = (size_t)map_get(func->context->var_offset_map, arg->name);
+
+        IrInsn* insn = add_insn(IR_STORE, 0, local->dst, (size_t)arg_vregs->data[i]);
+        insn->imm = arg->rtype->size;
+    }
+
+    // The value of the last statement is returned if "return" is missing.
+    size_t value = lower_stmt(node->lhs, 1);
+    add_insn(IR_RET, 0, value, 0);
+
+    lowering_function = NULL;
+    lowering_block = NULL;
+
+    return func;
+}
+
+// Lower the statement and return the virtual register of its value if needs_value is 1.
+// Otherwise it returns 0 or the value which can be ignored.
+static size_t lower_stmt(Node const* node, int needs_value)
+{
+    int ty = node->ty;
+
+    if (ty == ND_BLOCK) {
+        size_t value = 0;
+        for (size_t i = 0; i < node->stmts->len; i++) {
+            // The last one is used as the value of the block.
+            value = lower_stmt(node->stmts->data[i], needs_value && i + 1 == node->stmts->len);
+        }
+        if (needs_value && node->stmts->len == 0) {
+            value = add_imm(0);
+        }
+        return value;
+    }
+
+    if (ty == ND_IF) {
+        BasicBlock* then_block = new_block();
+        BasicBlock* else_block = new_block();
+        BasicBlock* end_block = new_block();
+
+        size_t value = 0;
+        if (needs_value) {
+            value = new_vreg();
+        }
+
+        lower_cond(node->if_else->condition, then_block, else_block);
+
+        start_block(then_block);
+        size_t then_value = lower_stmt(node->if_else->body, needs_value);
+        if (needs_value) {
+            add_insn(IR_MOV, value, then_value, 0);
+        }
+        add_jump(end_block);
+
+        start_block(else_block);
+        if (node->if_else->else_body != NULL) {
+            size_t else_value = lower_stmt(node->if_else->else_body, needs_value);
+            if (needs_value) {
+                add_insn(IR_MOV, value, else_value, 0);
+            }
+        } else if (needs_value) {
+            IrInsn* insn = add_insn(IR_IMM, value, 0, 0);
+            insn->imm = 0;
+        }
+        add_jump(end_block);
+
+        start_block(end_block);
+        return value;
+    }
+
+    if (ty == ND_WHILE || ty == ND_FOR) {
+        BasicBlock* cond_block = new_block();
+        BasicBlock* body_block = new_block();
+        BasicBlock* end_block = new_block();
+
+        Node const* condition = node->lhs;
+        Node const* body = node->rhs;
+        Node const* updating = NULL;
+        if (ty == ND_FOR) {
+            if (node->fors->initializing != NULL) {
+                lower_stmt(node->fors->initializing, 0);
+            }
+            condition = node->fors->condition;
+            body = node->fors->body;
+            updating = node->fors->updating;
+        }
+
+        add_jump(cond_block);
+        start_block(cond_block);
+        if (condition != NULL) {
+            lower_cond(condition, body_block, end_block);
+        } else {
+            add_jump(body_block);
+        }
+
+        start_block(body_block);
+        BasicBlock* prev_break_block = break_block;
+        break_block = end_block;
+        lower_stmt(body, 0);
+        break_block = prev_break_block;
+        if (updating != NULL) {
+            lower_stmt(updating, 0);
+        }
+        add_jump(cond_block);
+
+        start_block(end_block);
+        if (needs_value) {
+            return add_imm(0);
+        }
+        return 0;
+    }
+
+    if (ty == ND_BREAK || ty == ND_RETURN) {
+        if (ty == ND_BREAK) {
+            if (break_block == NULL) {
+                error("break is not in loop");
+            }
+            add_jump(break_block);
+        } else {
+            add_insn(IR_RET, 0, lower_expr(node->lhs), 0);
+        }
+
+        // The following statements are unreachable, they are removed by build_cfg.
+        start_block(new_block());
+        if (needs_value) {
+            return add_imm(0);
+        }
+        return 0;
+    }
+
+    if (ty == ND_LVAR_NEW) {
+        if (needs_value) {
+            return add_imm(0);
+        }
+        return 0;
+    }
+
+    if (ty == ND_INIT) {
+        return lower_stmt(node->rhs, needs_value);
+    }
+
+    return lower_expr(node);
+}
+
+// Lower the expression and return the virtual register of its value.
+static size_t lower_expr(Node const* node)
+{
+    int ty = node->ty;
+
+    if (ty == ND_NUM) {
+        return add_imm(node->val);
+    }
+
+    if (ty == ND_STR) {
+        IrInsn* insn = add_insn(IR_GLOBAL, new_vreg(), 0, 0);
+        insn->name = node->label;
+        return insn->dst;
+    }
+
+    if (ty == ND_REF) {
+        return lower_addr(node->lhs);
+    }
+
+    if (ty == ND_LVAR || ty == ND_GVAR || ty == ND_DOT_REF || ty == ND_ARROW_REF || ty == ND_DEREF) {
+        size_t addr = 0;
+        if (ty == ND_DEREF) {
+            addr = lower_expr(node->lhs);
+        } else {
+            addr = lower_addr(node);
+        }
+
+        // Array is not loaded, it is used as the address.
+        error_if_null(node->rtype);
+        if (node->rtype->ty == ARRAY && ty != ND_DEREF) {
+            return addr;
+        }
+
+        IrInsn* insn = add_insn(IR_LOAD, new_vreg(), addr, 0);
+        insn->imm = node->rtype->size;
+        return insn->dst;
+    }
+
+    if (ty == '!') {
+        size_t value = lower_expr(node->lhs);
+        IrInsn* insn = add_insn(IR_NOT, new_vreg(), value, 0);
+        return insn->dst;
+    }
+
+    if (ty == '=') {
+        // Assignment.
+        size_t addr = lower_addr(node->lhs);
+        size_t value = lower_expr(node->rhs);
+        IrInsn* insn = add_insn(IR_STORE, 0, addr, value);
+        error_if_null(node->rtype);
+        insn->imm = node->rtype->size;
+        return value;
+    }
+
+    if (ty == ND_AND || ty == ND_OR) {
+        return lower_and_or(node);
+    }
+
+    if (ty == ND_INCL_POST || ty == ND_DECL_POST) {
+        // Load value from variable.
+        size_t value = lower_expr(node->lhs);
+        // Update the variable and discard the result.
+        lower_expr(node->rhs);
+        return value;
+    }
+
+    if (ty == ND_CALL) {
+        Vector* args = node->call->arguments;
+        if (6 < args->len) {
+            error("The number of arguments has to be less than 6");
+        }
+
+        Vector* arg_vregs = new_vector();
+        for (size_t i = 0; i < args->len; i++) {
+            vec_push(arg_vregs, (void*)lower_expr(args->data[i]));
+        }
+
+        IrInsn* insn = add_insn(IR_CALL, new_vreg(), 0, 0);
+        insn->name = node->call->name;
+        insn->args = arg_vregs;
+        return insn->dst;
+    }
+
+    // The constant offset is folded into the address of the local variable.
+    Node const* rhs_node = node->rhs;
+    if (ty == '+' && rhs_node->ty == ND_NUM) {
+        return add_offset(lower_expr(node->lhs), rhs_node->val);
+    }
+
+    int op = 0;
+    if (ty == '+') {
+        op = IR_ADD;
+    } else if (ty == '-') {
+        op = IR_SUB;
+    } else if (ty == '*') {
+        op = IR_MUL;
+    } else if (ty == '/') {
+        op = IR_DIV;
+    } else if (ty == ND_EQ) {
+        op = IR_EQ;
+    } else if (ty == ND_NE) {
+        op = IR_NE;
+    } else if (ty == '<') {
+        op = IR_LT;
+    } else if (ty == TK_LE) {
+        op = IR_LE;
+    } else if (ty == TK_GE || ty == '>') {
+        error("parser has a bug");
+    } else {
+        error("Not supported node: %d", ty);
+    }
+
+    size_t lhs = lower_expr(node->lhs);
+    size_t rhs = lower_expr(node->rhs);
+    IrInsn* insn = add_insn(op, new_vreg(), lhs, rhs);
+    return insn->dst;
+}
+
+// Lower the address of the variable.
+static size_t lower_addr(Node const* node)
+{
+    int ty = node->ty;
+
+    if (ty == ND_LVAR) {
+        IrInsn* insn = add_insn(IR_LOCAL, new_vreg(), 0, 0);
+        insn->name = node->name;
+        insn->imm = (size_t)map_get(lowering_function->context->var_offset_map, node->name);
+        return insn->dst;
+    }
+
+    if (ty == ND_GVAR) {
+        IrInsn* insn = add_insn(IR_GLOBAL, new_vreg(), 0, 0);
+        insn->name = node->name;
+        return insn->dst;
+    }
+
+    if (ty == ND_DEREF) {
+        return lower_expr(node->lhs);
+    }
+
+    if (ty == ND_STR) {
+        return lower_expr(node);
+    }
+
+    if (ty == ND_DOT_REF || ty == ND_ARROW_REF) {
+        return add_offset(lower_addr(node->lhs), node->member_offset);
+    }
+
+    error("You can only get address of variable");
+    return 0;
+}
+
+// Lower "&&" and "||" into the branches, the value is 0 or 1.
+static size_t lower_and_or(Node const* node)
+{
+    BasicBlock* true_block = new_block();
+    BasicBlock* false_block = new_block();
+    BasicBlock* end_block = new_block();
+
+    size_t value = new_vreg();
+
+    lower_cond(node, true_block, false_block);
+
+    start_block(true_block);
+    IrInsn* insn = add_insn(IR_IMM, value, 0, 0);
+    insn->imm = 1;
+    add_jump(end_block);
+
+    start_block(false_block);
+    insn = add_insn(IR_IMM, value, 0, 0);
+    insn->imm = 0;
+    add_jump(end_block);
+
+    start_block(end_block);
+    return value;
+}
+
+// Lower the condition into the branches to then_block and else_block without its 0 or 1 value.
+// The comparison just before the branch is fused into the conditional jump by codegen.
+static void lower_cond(Node const* node, BasicBlock* then_block, BasicBlock* else_block)
+{
+    int ty = node->ty;
+
+    if (ty == ND_AND || ty == ND_OR) {
+        BasicBlock* rhs_block = new_block();
+        if (ty == ND_AND) {
+            lower_cond(node->lhs, rhs_block, else_block);
+        } else {
+            lower_cond(node->lhs, then_block, rhs_block);
+        }
+        start_block(rhs_block);
+        lower_cond(node->rhs, then_block, else_block);
+        return;
+    }
+
+    if (ty == '!') {
+        lower_cond(node->lhs, else_block, then_block);
+        return;
+    }
+
+    if (ty == ND_NUM) {
+        if (node->val != 0) {
+            add_jump(then_block);
+        } else {
+            add_jump(else_block);
+        }
+        return;
+    }
+
+    add_branch(lower_expr(node), then_block, else_block);
+}
+
+static size_t new_vreg(void)
+{
+    return ++lowering_function->count_vregs;
+}
+
+static IrInsn* add_insn(int op, size_t dst, size_t lhs, size_t rhs)
+{
+    IrInsn* insn = arena_alloc(ir_arena, sizeof(IrInsn));
+    insn->op = op;
+    insn->dst = dst;
+    insn->lhs = lhs;
+    insn->rhs = rhs;
+    insn->imm = 0;
+    insn->name = NULL;
+    insn->args = NULL;
+    insn->then_block = NULL;
+    insn->else_block = NULL;
+
+    vec_push(lowering_block->insns, insn);
+
+    return insn;
+}
+
+static size_t add_imm(size_t imm)
+{
+    IrInsn* insn = add_insn(IR_IMM, new_vreg(), 0, 0);
+    insn->imm = imm;
+    return insn->dst;
+}
+
+// Return the virtual register of "addr + offset".
+static size_t add_offset(size_t addr, size_t offset)
+{
+    if (offset == 0) {
+        return addr;
+    }
+
+    // The local variable whose address has just been taken is shifted in place.
+    Vector* insns = lowering_block->insns;
+    IrInsn* last = insns->data[insns->len - 1];
+#ifndef SELFHOST_9MM
+    int is_inside_frame = (long)offset < (long)last->imm;
+#else
+    int is_inside_frame = offset < last->imm;
+#endif
+    if (last->op == IR_LOCAL && last->dst == addr && is_inside_frame) {
+        last->imm -= offset;
+        return addr;
+    }
+
+    size_t imm = add_imm(offset);
+    IrInsn* insn = add_insn(IR_ADD, new_vreg(), addr, imm);
+    return insn->dst;
+}
+
+static void add_jump(BasicBlock* block)
+{
+    IrInsn* insn = add_insn(IR_JMP, 0, 0, 0);
+    insn->then_block = block;
+}
+
+static void add_branch(size_t cond, BasicBlock* then_block, BasicBlock* else_block)
+{
+    IrInsn* insn = add_insn(IR_BR, 0, cond, 0);
+    insn->then_block = then_block;
+    insn->else_block = else_block;
+}
+
+BasicBlock* new_block(void)
+{
+    BasicBlock* block = arena_alloc(ir_arena, sizeof(BasicBlock));
+    block->id = count_blocks++;
+    block->index = 0;
+    block->insns = new_vector();
+    block->preds = new_vector();
+    block->succs = new_vector();
+    block->is_reachable = 0;
+    return block;
+}
+
+// Append the block to the layout, the previous block has to be terminated.
+static void start_block(BasicBlock* block)
+{
+    vec_push(lowering_function->blocks, block);
+    lowering_block = block;
+}
+
+static void mark_reachable(Vector* worklist, BasicBlock* block)
+{
+    if (block != NULL && !block->is_reachable) {
+        block->is_reachable = 1;
+        vec_push(worklist, block);
+    }
+}
+
+// Remove the unreachable blocks and connect the rest by their terminators.
+static void build_cfg(IrFunction* func)
+{
+    Vector* worklist = new_vector();
+    BasicBlock* entry = func->blocks->data[0];
+    entry->is_reachable = 1;
+    vec_push(worklist, entry);
+
+    while (worklist->len != 0) {
+        BasicBlock* block = worklist->data[--worklist->len];
+        IrInsn* last = block->insns->data[block->insns->len - 1];
+
+        mark_reachable(worklist, last->then_block);
+        mark_reachable(worklist, last->else_block);
+    }
+
+    Vector* blocks = new_vector();
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock* block = func->blocks->data[i];
+        if (block->is_reachable) {
+            block->index = blocks->len;
+            vec_push(blocks, block);
+        }
+    }
+    func->blocks = blocks;
+
+    for (size_t i = 0; i < blocks->len; i++) {
+        BasicBlock* block = blocks->data[i];
+        IrInsn* last = block->insns->data[block->insns->len - 1];
+        if (last->then_block != NULL) {
+            link_blocks(block, last->then_block);
+        }
+        if (last->else_block != NULL && last->else_block != last->then_block) {
+            link_blocks(block, last->else_block);
+        }
+    }
+}
+
+static void link_blocks(BasicBlock* from, BasicBlock* to)
+{
+    vec_push(from->succs, to);
+    vec_push(to->preds, from);
+}
+
+void dump_ir(Vector const* functions)
+{
+    for (size_t i = 0; i < functions->len; i++) {
+        IrFunction const* func = functions->data[i];
+        emit("function ");
+        emit(func->name);
+        emit(" (");
+        emit_num(func->count_vregs);
+        emit(" vregs)\n");
+
+        for (size_t j = 0; j < func->blocks->len; j++) {
+            BasicBlock const* block = func->blocks->data[j];
+            emit("bb");
+            emit_num(block->id);
+            emit(":");
+            if (block->preds->len != 0) {
+                emit(" ; preds");
+                for (size_t k = 0; k < block->preds->len; k++) {
+                    BasicBlock const* pred = block->preds->data[k];
+                    emit(" bb");
+                    emit_num(pred->id);
+                }
+            }
+            emit("\n");
+
+            for (size_t k = 0; k < block->insns->len; k++) {
+                dump_insn(block->insns->data[k]);
+            }
+        }
+        emit("\n");
+    }
+}
+
+// Emit " v<n>".
+static void dump_vreg(size_t v)
+{
+    emit(" v");
+    emit_num(v);
+}
+
+static void dump_insn(IrInsn const* insn)
+{
+    int op = insn->op;
+
+    emit("  ");
+    if (insn->dst != 0) {
+        emit("v");
+        emit_num(insn->dst);
+        emit(" = ");
+    }
+    emit(ir_op_name(op));
+
+    if (op == IR_IMM || op == IR_ARG) {
+        emit(" ");
+        emit_num(insn->imm);
+    } else if ((op == IR_MOV && insn->imm != 0) || op == IR_LOAD) {
+        emit_num(insn->imm);
+        dump_vreg(insn->lhs);
+    } else if (op == IR_LOCAL) {
+        emit(" ");
+        emit(insn->name);
+        emit(" [rbp-");
+        emit_num(insn->imm);
+        emit("]");
+    } else if (op == IR_GLOBAL) {
+        emit(" ");
+        emit(insn->name);
+    } else if (op == IR_STORE) {
+        emit_num(insn->imm);
+        dump_vreg(insn->lhs);
+        emit(",");
+        dump_vreg(insn->rhs);
+    } else if (op == IR_PHI) {
+        for (size_t i = 0; i < insn->args->len; i++) {
+            if (i != 0) {
+                emit(",");
+            }
+            dump_vreg((size_t)insn->args->data[i]);
+        }
+    } else if (op == IR_CALL) {
+        emit(" ");
+        emit(insn->name);
+        emit("(");
+        for (size_t i = 0; i < insn->args->len; i++) {
+            if (i != 0) {
+                emit(", ");
+            }
+            emit("v");
+            emit_num((size_t)insn->args->data[i]);
+        }
+        emit(")");
+    } else if (op == IR_JMP) {
+        BasicBlock* target = insn->then_block;
+        emit(" bb");
+        emit_num(target->id);
+    } else if (op == IR_BR) {
+        BasicBlock* then_block = insn->then_block;
+        BasicBlock* else_block = insn->else_block;
+        dump_vreg(insn->lhs);
+        emit(", bb");
+        emit_num(then_block->id);
+        emit(", bb");
+        emit_num(else_block->id);
+    } else if (insn->rhs != 0) {
+        dump_vreg(insn->lhs);
+        emit(",");
+        dump_vreg(insn->rhs);
+    } else if (insn->lhs != 0) {
+        dump_vreg(insn->lhs);
+    }
+
+    emit("\n");
+}
+
+static char const* ir_op_name(int op)
+{
+    char* names[22];
+    names[0] = "?";
+    names[IR_IMM] = "imm";
+    names[IR_MOV] = "mov";
+    names[IR_ADD] = "add";
+    names[IR_SUB] = "sub";
+    names[IR_MUL] = "mul";
+    names[IR_DIV] = "div";
+    names[IR_EQ] = "eq";
+    names[IR_NE] = "ne";
+    names[IR_LT] = "lt";
+    names[IR_LE] = "le";
+    names[IR_NOT] = "not";
+    names[IR_LOCAL] = "local";
+    names[IR_GLOBAL] = "global";
+    names[IR_LOAD] = "load";
+    names[IR_STORE] = "store";
+    names[IR_CALL] = "call";
+    names[IR_ARG] = "arg";
+    names[IR_PHI] = "phi";
+    names[IR_RET] = "ret";
+    names[IR_JMP] = "jmp";
+    names[IR_BR] = "br";
+
+    return names[op];
+}
@@ -0,0 +1,365 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static void compile_input(MmContext*, Buffer*);
+static void print_stats(MmContext const*);
+static void print_arena_stats(Arena const*);
+static char const* read_stream(void*);
+#endif
+
+// The compilation which is running, the errors jump back into it.
+// The compiler keeps its state in the globals, so only one compilation runs at a time.
+static MmContext* active_context;
+#ifndef SELFHOST_9MM
+static jmp_buf escape;
+#else
+// FIXME: use jmp_buf, it is 200 bytes.
+static char escape[200];
+#endif
+
+// Compile the source of the given length, and append the assembly to the output.
+// The compilation allocates from its own arenas which are released or kept for the next one when it returns,
+// and an error returns its code instead of exiting, so it can be driven many times in a process.
+// It is neither reentrant nor thread-safe, the compilations have to run one at a time.
+// The output is left as it was if the compilation failed.
+// The source is read until src[len], which is '\0' if the source is a C string.
+int mm_compile(MmContext* ctx, char const* src, size_t len, Buffer* out)
+{
+    ArenaSet caller_arenas;
+    enter_arenas(&caller_arenas, ctx->arenas);
+    active_context = ctx;
+    ctx->status = MM_OK;
+    ctx->input = NULL;
+
+    // The source has to be terminated by "\n\0", it is copied only if it is not.
+    char const* input = src;
+    Buffer* source = NULL;
+    if (len == 0 || src[len - 1] != '\n' || src[len] != '\0') {
+        source = new_buffer(len + 1);
+        buf_append(source, src, len);
+        if (len == 0 || src[len - 1] != '\n') {
+            buf_append_str(source, "\n");
+        }
+        input = source->data;
+    }
+
+    // The buffers which are freed after the error are allocated before the jump point.
+    Buffer* object = NULL;
+    if (ctx->is_object && !ctx->is_dump_ir) {
+        object = new_buffer(len + 4096);
+    }
+
+    size_t out_start = out->len;
+    if (setjmp(escape) == 0) {
+        if (ctx->filename != NULL) {
+            ctx->input = preprocess(input, ctx->filename);
+        } else {
+            ctx->input = input;
+        }
+
+        // The assembly which is found in the cache skips the compilation.
+        char key[33];
+        int is_cached = 0;
+        if (ctx->cache_dir != NULL && !ctx->is_dump_ir) {
+            cache_key(key, ctx->input, get_inline_limit());
+            is_cached = load_cache(ctx->cache_dir, key, out);
+        }
+
+        if (is_cached) {
+            if (ctx->is_stats && ctx->filename != NULL) {
+                print_preprocess_stats();
+            }
+            if (ctx->is_stats) {
+                print_cache_stats();
+            }
+        } else {
+            compile_input(ctx, out);
+            if (ctx->cache_dir != NULL && !ctx->is_dump_ir) {
+                store_cache(ctx->cache_dir, key, out->data + out_start, out->len - out_start, ctx->cache_limit);
+            }
+            if (ctx->is_stats && !ctx->is_dump_ir) {
+                print_stats(ctx);
+            }
+        }
+
+        // The object is assembled from the assembly, which is cached.
+        if (object != NULL) {
+            assemble_elf(out->data + out_start, out->len - out_start, object);
+            out->len = out_start;
+            buf_append(out, object->data, object->len);
+            if (ctx->is_stats) {
+                print_elf_stats();
+            }
+        }
+    } else {
+        // The partial assembly and the preprocessed source are dropped.
+        out->len = out_start;
+        out->data[out_start] = '\0';
+        discard_preprocess();
+    }
+
+    if (object != NULL) {
+        free(object->data);
+    }
+
+    // The preprocessed source is allocated by malloc like the source.
+    if (ctx->input != NULL && ctx->input != input) {
+        free((void*)ctx->input);
+    }
+    if (source != NULL) {
+        free(source->data);
+    }
+    ctx->input = NULL;
+
+    active_context = NULL;
+    leave_arenas(&caller_arenas, ctx->arenas);
+    return ctx->status;
+}
+
+// Tokenize, parse and generate the input of the context.
+static void compile_input(MmContext* ctx, Buffer* out)
+{
+    Vector const* tokens = tokenize(ctx->input);
+    Code const* code = program(tokens);
+
+    // FIXME: use CLOCKS_PER_SEC, it is 1000000 on POSIX.
+    size_t begin = clock();
+    Vector const* functions = lower_ir(code);
+
+    init_emitter();
+    if (ctx->is_dump_ir) {
+        dump_ir(functions);
+    } else {
+        generate(code, functions);
+    }
+    emit_flush(out);
+    ctx->codegen_elapsed = clock() - begin + 1;
+}
+
+// Release the arenas which are kept in the context.
+void mm_release_arenas(MmContext* ctx)
+{
+    ArenaSet* kept = ctx->arenas;
+    if (kept == NULL || kept->token_arena == NULL) {
+        return;
+    }
+    free_arena(kept->token_arena);
+    free_arena(kept->ast_arena);
+    free_arena(kept->type_arena);
+    free_arena(kept->container_arena);
+    free_arena(kept->ir_arena);
+    memset(kept, 0, sizeof(ArenaSet));
+}
+
+// Abort the running compilation with the error, or exit if no compilation is running.
+void mm_fail(int status)
+{
+    if (active_context == NULL) {
+        exit(1);
+    }
+    active_context->status = status;
+    longjmp(escape, 1);
+}
+
+static void print_arena_stats(Arena const* arena)
+{
+    fprintf(stderr, "  %-10s %10zd %10zd %12zd\n", arena->name, arena->count_allocs, arena->count_chunks, arena->used_size);
+}
+
+static void print_stats(MmContext const* ctx)
+{
+    fprintf(stderr, "# arena        allocs     chunks        bytes\n");
+    print_arena_stats(token_arena);
+    print_arena_stats(ast_arena);
+    print_arena_stats(type_arena);
+    print_arena_stats(container_arena);
+    print_arena_stats(ir_arena);
+
+    if (ctx->filename != NULL) {
+        print_preprocess_stats();
+    }
+    print_fold_stats();
+    print_inline_stats();
+    print_ssa_stats();
+    print_loop_stats();
+    print_codegen_stats();
+    print_peephole_stats();
+    if (ctx->cache_dir != NULL) {
+        print_cache_stats();
+    }
+
+    size_t count_insns = count_emitted_insns();
+    fprintf(stderr, "# codegen: %zd instructions, %zd us, %zd insns/s\n", count_insns, ctx->codegen_elapsed, count_insns * 1000000 / ctx->codegen_elapsed);
+
+#ifndef SELFHOST_9MM
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t max_rss = usage.ru_maxrss;
+#else
+    // FIXME: use struct rusage, "ru_maxrss" is at offset 32.
+    char usage[144];
+    getrusage(0, usage);
+    size_t* max_rss_ptr = usage + 32;
+    size_t max_rss = *max_rss_ptr;
+#endif
+    fprintf(stderr, "# peak RSS: %zd KB\n", max_rss);
+}
+
+// Output an error for user and abort the compilation.
+void error_at(char const* loc, char const* msg)
+{
+    // The location is in the source of the running compilation.
+    char const* input = loc;
+    char const* filename = NULL;
+    if (active_context != NULL) {
+        input = active_context->input;
+        filename = active_context->filename;
+    }
+
+    // Find head and tail of line which includes loc.
+    char const* line = loc;
+    while (input < line && line[-1] != '\n') {
+        line--;
+    }
+
+    char const* end = loc;
+    while (*end != '\n' && *end != '\0') {
+        end++;
+    }
+
+    // Find where the found line is.
+    size_t line_num = 1;
+    for (char const* p = input; p < line; p++) {
+        if (*p == '\n') {
+            line_num++;
+        }
+    }
+
+    // Print the line with filename and line number.
+    size_t indent = fprintf(stderr, "%s:%zd: ", filename, line_num);
+    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+
+    // Output the error and emphases the error location via "^".
+    int pos = loc - line + indent;
+    fprintf(stderr, "%*s", pos, ""); // print pos spaces.
+    fprintf(stderr, "^ %s\n", msg);
+    mm_fail(MM_ERROR_SOURCE);
+}
+
+#ifndef SELFHOST_9MM
+// Output log for me and exit.
+void log_internal(char const* level, const char* file, const char* func, size_t line, char const* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%s [%s:%s:%zd] ", level, file, func, line);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+#else
+void error_if_null(void* var)
+{
+    if (var == NULL) {
+        error("NULL is given");
+    }
+}
+#endif
+
+// Read the whole content of the file which is terminated by '\0'.
+// A regular file is mapped into the memory, so it is paged in lazily without copy.
+// The content must not be modified.
+char const* read_file(char const* path)
+{
+    if (strcmp(path, "-") == 0) {
+        return read_stream(stdin);
+    }
+
+    void* fp = fopen(path, "r");
+    if (fp == NULL) {
+        error("cannot open %s", path);
+    }
+    int fd = fileno(fp);
+
+    // It fails for pipes.
+#ifndef SELFHOST_9MM
+    size_t size = lseek(fd, 0, SEEK_END);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+#else
+    // FIXME: use SEEK_END and _SC_PAGESIZE.
+    size_t size = lseek(fd, 0, 2);
+    size_t page_size = sysconf(30);
+#endif
+
+    // The rest of the last page is filled with '\0', it terminates the content.
+    if (size != -1 && size != 0 && size - size / page_size * page_size != 0) {
+#ifndef SELFHOST_9MM
+        char const* content = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+#else
+        // FIXME: use PROT_READ and MAP_PRIVATE.
+        char const* content = mmap(NULL, size, 1, 2, fd, 0);
+#endif
+        if ((size_t)content != -1) {
+            fclose(fp);
+            return content;
+        }
+    }
+
+#ifndef SELFHOST_9MM
+    lseek(fd, 0, SEEK_SET);
+#else
+    // FIXME: use SEEK_SET.
+    lseek(fd, 0, 0);
+#endif
+
+    char const* content = read_stream(fp);
+    fclose(fp);
+
+    return content;
+}
+
+// The modification time and the size are 0 if the file cannot be stat.
+void stat_file(char const* path, size_t* mtime, size_t* size)
+{
+#ifndef SELFHOST_9MM
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return;
+    }
+    *mtime = st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+#else
+    // FIXME: use struct stat, "st_size" is at offset 48 and "st_mtim" is at offset 88.
+    char st[144];
+    if (stat(path, st) != 0) {
+        return;
+    }
+    size_t* sec = st + 88;
+    size_t* nsec = st + 96;
+    size_t* st_size = st + 48;
+    *mtime = *sec * 1000000000 + *nsec;
+    *size = *st_size;
+#endif
+}
+
+// Read the stream into a buffer until EOF.
+static char const* read_stream(void* fp)
+{
+    Buffer* buf = new_buffer(4096);
+
+    char chunk[4096];
+    while (1) {
+        size_t size = fread(chunk, 1, 4096, fp);
+        if (size == 0) {
+            break;
+        }
+        buf_append(buf, chunk, size);
+    }
+
+    // Enforce the content is terminated by "\n\0".
+    if (buf->len == 0 || buf->data[buf->len - 1] != '\n') {
+        buf_append_str(buf, "\n");
+    }
+
+    return buf->data;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "container.h"
+
+// Result of mm_compile.
+enum {
+    MM_OK,            // The assembly is written.
+    MM_ERROR_SOURCE,  // The source has an error, it is reported with its location.
+    MM_ERROR_COMPILE  // The compilation failed for the other reasons.
+};
+
+// Context of the compilations, the caller zero-fills it and sets the options.
+// Only one compilation runs at a time in a process: mm_compile is not thread-safe,
+// and it must not be called from the code which runs in it.
+struct mm_context {
+    char const* filename; // Path of the source, the source is preprocessed if it is not NULL.
+    int is_dump_ir;       // Write the intermediate representation instead of the assembly.
+    int is_stats;         // Print statistics of the compilation into stderr.
+    int is_object;        // Write the ELF relocatable object instead of the assembly.
+    ArenaSet* arenas;     // The arenas are kept into it and reused by the next compilation if it is not NULL.
+    char const* cache_dir; // The assembly is cached in the directory by the preprocessed source if it is not NULL.
+    size_t cache_limit;    // Bytes of the cache, the least recently used entries are evicted over it.
+
+    // They are set by mm_compile.
+    int status;             // MM_OK or the error of the last compilation.
+    char const* input;      // Source which is being tokenized, the errors point into it.
+    size_t codegen_elapsed; // Microseconds of the lowering and the code generation.
+};
+typedef struct mm_context MmContext;
+
+#ifndef SELFHOST_9MM
+int mm_compile(MmContext*, char const*, size_t, Buffer*);
+void mm_release_arenas(MmContext*);
+_Noreturn void mm_fail(int);
+#endif
@@ -0,0 +1,546 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static void find_defs(IrFunction const*);
+static void find_loops(IrFunction const*, BasicBlock* const*, Vector*, Vector*);
+static int dominates(BasicBlock const*, BasicBlock const*, BasicBlock* const*);
+static void add_loop_blocks(char*, BasicBlock const*, BasicBlock*);
+static BasicBlock* find_preheader(BasicBlock const*);
+static void hoist_invariants(IrFunction const*, BasicBlock const*, BasicBlock*);
+static int is_hoistable(IrInsn const*, BasicBlock const*, BasicBlock const*);
+static int is_invariant(size_t);
+static size_t hoist_operand(BasicBlock*, size_t);
+static int is_address(size_t);
+static void reduce_multiplies(IrFunction const*, BasicBlock*, BasicBlock*);
+static IrInsn* find_increment(IrInsn const*, size_t);
+static void reduce_multiply(IrFunction const*, BasicBlock*, BasicBlock*, IrInsn const*, IrInsn const*);
+static void insert_before_last(BasicBlock*, IrInsn*);
+static void record_loop_def(BasicBlock*, IrInsn*);
+static void insert_after(BasicBlock*, IrInsn const*, IrInsn*);
+static size_t add_loop_imm(BasicBlock*, size_t);
+static void replace_vreg(IrFunction const*, size_t, size_t);
+static IrInsn* new_loop_insn(int, size_t, size_t, size_t);
+#endif
+
+// Function which is being optimized.
+static IrFunction* loop_function;
+
+// The only instruction which writes each virtual register and its block, NULL if there are several of them.
+static IrInsn** loop_defs;
+static BasicBlock** loop_def_blocks;
+static size_t capacity_loop_defs;
+
+// 1 if the block is in the current loop, indexed by "BasicBlock.index".
+static char* in_loop;
+
+// 1 if the current loop may write the memory by IR_STORE or IR_CALL.
+static int has_memory_write;
+
+// Statistics of the loop optimizations.
+static size_t count_loops;
+static size_t count_hoisted_insns;
+static size_t count_reduced_muls;
+
+// Move the loop invariants into the preheaders and replace the multiplications of the induction variables
+// with the additions. The function has to be in the SSA form and idoms is its dominator tree.
+// It returns 1 if it leaves the dead instructions.
+int optimize_loops(IrFunction* func, BasicBlock* const* idoms)
+{
+    loop_function = func;
+
+    // The inner loops are processed first, the invariants hoisted from them may be hoisted again.
+    Vector* headers = new_vector();
+    Vector* bodies = new_vector();
+    find_loops(func, idoms, headers, bodies);
+
+    size_t prev_count_reduced = count_reduced_muls;
+    for (size_t i = 0; i < headers->len; i++) {
+        BasicBlock* header = headers->data[i];
+        in_loop = bodies->data[i];
+        BasicBlock* preheader = find_preheader(header);
+        ++count_loops;
+
+        if (preheader != NULL) {
+            // The definitions are moved by the previous loops.
+            find_defs(func);
+            hoist_invariants(func, header, preheader);
+            reduce_multiplies(func, header, preheader);
+            free(loop_defs);
+            free(loop_def_blocks);
+        }
+        free(in_loop);
+    }
+
+    in_loop = NULL;
+    loop_function = NULL;
+    return prev_count_reduced != count_reduced_muls;
+}
+
+void print_loop_stats(void)
+{
+    fprintf(stderr, "# loop: %zd loops, %zd hoisted, %zd reduced multiplications\n", count_loops, count_hoisted_insns, count_reduced_muls);
+}
+
+static void find_defs(IrFunction const* func)
+{
+    size_t count_vregs = func->count_vregs + 1;
+    loop_defs = calloc(count_vregs, sizeof(IrInsn*));
+    loop_def_blocks = calloc(count_vregs, sizeof(BasicBlock*));
+    capacity_loop_defs = count_vregs;
+    char* has_def = calloc(count_vregs, 1);
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn* insn = block->insns->data[j];
+            size_t v = insn->dst;
+            if (v != 0) {
+                if (has_def[v]) {
+                    loop_defs[v] = NULL;
+                    loop_def_blocks[v] = NULL;
+                } else {
+                    has_def[v] = 1;
+                    loop_defs[v] = insn;
+                    loop_def_blocks[v] = block;
+                }
+            }
+        }
+    }
+    free(has_def);
+}
+
+// Find the natural loops of the back edges, the edges to the dominators.
+// The loops which share the header are merged, and they are sorted by the number of their blocks.
+static void find_loops(IrFunction const* func, BasicBlock* const* idoms, Vector* headers, Vector* bodies)
+{
+    size_t count_blocks = func->blocks->len;
+    Vector* sizes = new_vector();
+
+    for (size_t i = 0; i < count_blocks; i++) {
+        BasicBlock* header = func->blocks->data[i];
+        char* body = NULL;
+        for (size_t j = 0; j < header->preds->len; j++) {
+            BasicBlock* latch = header->preds->data[j];
+            if (dominates(header, latch, idoms)) {
+                if (body == NULL) {
+                    body = calloc(count_blocks, 1);
+                    body[header->index] = 1;
+                }
+                add_loop_blocks(body, header, latch);
+            }
+        }
+
+        if (body != NULL) {
+            size_t size = 0;
+            for (size_t k = 0; k < count_blocks; k++) {
+                size += body[k];
+            }
+
+            // Insertion sort, the functions have a few loops.
+            size_t pos = headers->len;
+            vec_push(headers, NULL);
+            vec_push(bodies, NULL);
+            vec_push(sizes, NULL);
+            while (0 < pos) {
+                size_t prev_size = (size_t)sizes->data[pos - 1];
+                if (prev_size <= size) {
+                    break;
+                }
+                headers->data[pos] = headers->data[pos - 1];
+                bodies->data[pos] = bodies->data[pos - 1];
+                sizes->data[pos] = sizes->data[pos - 1];
+                --pos;
+            }
+            headers->data[pos] = header;
+            bodies->data[pos] = body;
+            sizes->data[pos] = (void*)size;
+        }
+    }
+}
+
+static int dominates(BasicBlock const* dom, BasicBlock const* block, BasicBlock* const* idoms)
+{
+    while (block != dom) {
+        BasicBlock const* idom = idoms[block->index];
+        if (idom == block) {
+            return 0;
+        }
+        block = idom;
+    }
+    return 1;
+}
+
+// Add the blocks which reach the latch without passing the header.
+static void add_loop_blocks(char* body, BasicBlock const* header, BasicBlock* latch)
+{
+    Vector* worklist = new_vector();
+    if (!body[latch->index]) {
+        body[latch->index] = 1;
+        vec_push(worklist, latch);
+    }
+
+    while (worklist->len != 0) {
+        BasicBlock const* block = worklist->data[--worklist->len];
+        for (size_t i = 0; i < block->preds->len; i++) {
+            BasicBlock* pred = block->preds->data[i];
+            if (!body[pred->index]) {
+                body[pred->index] = 1;
+                vec_push(worklist, pred);
+            }
+        }
+    }
+}
+
+// Return the only block which enters the loop if it jumps only to the header, NULL otherwise.
+// It has to be placed before the header, the first reference of each virtual register in the layout is its definition.
+static BasicBlock* find_preheader(BasicBlock const* header)
+{
+    BasicBlock* preheader = NULL;
+    for (size_t i = 0; i < header->preds->len; i++) {
+        BasicBlock* pred = header->preds->data[i];
+        if (!in_loop[pred->index]) {
+            if (preheader != NULL) {
+                return NULL;
+            }
+            preheader = pred;
+        }
+    }
+
+    if (preheader == NULL || preheader->succs->len != 1 || header->index < preheader->index) {
+        return NULL;
+    }
+    return preheader;
+}
+
+// Move the instructions whose operands are not changed in the loop into the preheader.
+// The loads and the divisions may fault, so only the ones in the header are moved, it runs whenever the loop is entered.
+static void hoist_invariants(IrFunction const* func, BasicBlock const* header, BasicBlock* preheader)
+{
+    has_memory_write = 0;
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        if (in_loop[i]) {
+            for (size_t j = 0; j < block->insns->len; j++) {
+                IrInsn const* insn = block->insns->data[j];
+                if (insn->op == IR_STORE || insn->op == IR_CALL) {
+                    has_memory_write = 1;
+                }
+            }
+        }
+    }
+
+    // The blocks are visited in the layout order, so the hoisted definitions usually precede their uses.
+    int is_changed = 1;
+    while (is_changed) {
+        is_changed = 0;
+        for (size_t i = 0; i < func->blocks->len; i++) {
+            BasicBlock const* block = func->blocks->data[i];
+            if (in_loop[i]) {
+                Vector* insns = block->insns;
+                size_t len = 0;
+                for (size_t j = 0; j < insns->len; j++) {
+                    IrInsn* insn = insns->data[j];
+                    if (is_hoistable(insn, block, header)) {
+                        insn->lhs = hoist_operand(preheader, insn->lhs);
+                        insn->rhs = hoist_operand(preheader, insn->rhs);
+                        insert_before_last(preheader, insn);
+                        ++count_hoisted_insns;
+                        is_changed = 1;
+                    } else {
+                        insns->data[len++] = insn;
+                    }
+                }
+                insns->len = len;
+            }
+        }
+    }
+}
+
+// The comparisons are kept in the loop to be fused into the branches.
+static int is_hoistable(IrInsn const* insn, BasicBlock const* block, BasicBlock const* header)
+{
+    int op = insn->op;
+    if (loop_defs[insn->dst] != insn) {
+        return 0;
+    }
+
+    if (op == IR_LOAD) {
+        if (has_memory_write || block != header) {
+            return 0;
+        }
+    } else if (op == IR_DIV) {
+        if (block != header) {
+            return 0;
+        }
+    } else if (op != IR_ADD && op != IR_SUB && op != IR_MUL && op != IR_MOV) {
+        return 0;
+    }
+
+    if (!is_invariant(insn->lhs) || !is_invariant(insn->rhs)) {
+        return 0;
+    }
+
+    // The addresses of the variables are folded into the memory operands by codegen.
+    return !is_address(insn->lhs) && !is_address(insn->rhs);
+}
+
+// The constants are invariant wherever they are written.
+static int is_invariant(size_t v)
+{
+    if (v == 0) {
+        return 1;
+    }
+
+    IrInsn const* def = loop_defs[v];
+    if (def == NULL) {
+        return 0;
+    }
+    if (def->op == IR_IMM) {
+        return 1;
+    }
+    BasicBlock const* block = loop_def_blocks[v];
+    return !in_loop[block->index];
+}
+
+// Return the operand which is defined before the preheader.
+// The constant in the loop is copied because the other instructions in the loop may refer it.
+static size_t hoist_operand(BasicBlock* preheader, size_t v)
+{
+    if (v == 0) {
+        return 0;
+    }
+
+    IrInsn const* def = loop_defs[v];
+    BasicBlock const* block = loop_def_blocks[v];
+    if (def->op != IR_IMM || !in_loop[block->index]) {
+        return v;
+    }
+    return add_loop_imm(preheader, def->imm);
+}
+
+static int is_address(size_t v)
+{
+    IrInsn const* def = loop_defs[v];
+    return v != 0 && (def->op == IR_LOCAL || def->op == IR_GLOBAL);
+}
+
+// Find the induction variables "i = phi(init, i + step)" of the header,
+// and replace "i * n" by the new induction variable "j = phi(init * n, j + step * n)".
+// The multiplications by 2, 4 and 8 are kept, they are folded into the addresses by codegen.
+static void reduce_multiplies(IrFunction const* func, BasicBlock* header, BasicBlock* preheader)
+{
+    if (header->preds->len != 2) {
+        return;
+    }
+
+    size_t latch_index = 0;
+    if (header->preds->data[0] == preheader) {
+        latch_index = 1;
+    }
+
+    // The phis are collected first because the new ones are inserted at the head.
+    Vector* phis = new_vector();
+    for (size_t i = 0; i < header->insns->len; i++) {
+        IrInsn const* phi = header->insns->data[i];
+        if (phi->op != IR_PHI) {
+            break;
+        }
+        size_t next = (size_t)phi->args->data[latch_index];
+        if (find_increment(loop_defs[next], phi->dst) != NULL) {
+            vec_push(phis, header->insns->data[i]);
+        }
+    }
+
+    for (size_t i = 0; i < phis->len; i++) {
+        IrInsn const* phi = phis->data[i];
+        Vector* muls = new_vector();
+        for (size_t j = 0; j < func->blocks->len; j++) {
+            BasicBlock const* block = func->blocks->data[j];
+            if (in_loop[j]) {
+                for (size_t k = 0; k < block->insns->len; k++) {
+                    IrInsn const* insn = block->insns->data[k];
+                    if (insn->op == IR_MUL && (insn->lhs == phi->dst || insn->rhs == phi->dst)) {
+                        size_t n = insn->rhs;
+                        if (insn->lhs != phi->dst) {
+                            n = insn->lhs;
+                        }
+                        IrInsn const* n_def = loop_defs[n];
+                        if (n_def != NULL && n_def->op == IR_IMM && n_def->imm != 1 && n_def->imm != 2 && n_def->imm != 4 && n_def->imm != 8) {
+                            vec_push(muls, block->insns->data[k]);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (size_t j = 0; j < muls->len; j++) {
+            reduce_multiply(func, header, preheader, phi, muls->data[j]);
+        }
+    }
+}
+
+// Return "i + step" if next is it or its truncation into 4 or 8 bytes, NULL otherwise.
+// The int counter is assumed not to overflow as well as in C.
+static IrInsn* find_increment(IrInsn const* next, size_t v)
+{
+    if (next == NULL) {
+        return NULL;
+    }
+    if (next->op == IR_MOV && next->imm != 1) {
+        next = loop_defs[next->lhs];
+        if (next == NULL) {
+            return NULL;
+        }
+    }
+    if (next->op != IR_ADD || next->lhs != v) {
+        return NULL;
+    }
+
+    IrInsn const* step = loop_defs[next->rhs];
+    if (step == NULL || step->op != IR_IMM) {
+        return NULL;
+    }
+    return loop_defs[next->dst];
+}
+
+static void reduce_multiply(IrFunction const* func, BasicBlock* header, BasicBlock* preheader, IrInsn const* phi, IrInsn const* mul)
+{
+    size_t init_index = 0;
+    if (header->preds->data[0] != preheader) {
+        init_index = 1;
+    }
+    size_t init = (size_t)phi->args->data[init_index];
+    size_t next = (size_t)phi->args->data[1 - init_index];
+    IrInsn const* increment = find_increment(loop_defs[next], phi->dst);
+    IrInsn const* step = loop_defs[increment->rhs];
+
+    size_t n = mul->rhs;
+    if (mul->lhs != phi->dst) {
+        n = mul->lhs;
+    }
+    IrInsn const* factor = loop_defs[n];
+
+    // "init * n" and "step * n" are computed in the preheader.
+    size_t reduced_init = 0;
+    IrInsn const* init_def = loop_defs[init];
+    if (init_def != NULL && init_def->op == IR_IMM) {
+        reduced_init = add_loop_imm(preheader, init_def->imm * factor->imm);
+    } else {
+        IrInsn* init_mul = new_loop_insn(IR_MUL, ++loop_function->count_vregs, init, add_loop_imm(preheader, factor->imm));
+        insert_before_last(preheader, init_mul);
+        reduced_init = init_mul->dst;
+    }
+    size_t reduced_step = add_loop_imm(preheader, step->imm * factor->imm);
+
+    // "j + step * n" is computed where "i + step" is.
+    size_t reduced = ++loop_function->count_vregs;
+    IrInsn* add = new_loop_insn(IR_ADD, ++loop_function->count_vregs, reduced, reduced_step);
+    insert_after(loop_def_blocks[increment->dst], increment, add);
+
+    IrInsn* reduced_phi = new_loop_insn(IR_PHI, reduced, 0, 0);
+    reduced_phi->args = new_vector();
+    vec_push(reduced_phi->args, NULL);
+    vec_push(reduced_phi->args, NULL);
+    reduced_phi->args->data[init_index] = (void*)reduced_init;
+    reduced_phi->args->data[1 - init_index] = (void*)add->dst;
+    vec_push(header->insns, NULL);
+    for (size_t i = header->insns->len - 1; 0 < i; i--) {
+        header->insns->data[i] = header->insns->data[i - 1];
+    }
+    header->insns->data[0] = reduced_phi;
+    record_loop_def(header, reduced_phi);
+
+    // The multiplication is left dead.
+    replace_vreg(func, mul->dst, reduced);
+    ++count_reduced_muls;
+}
+
+static void insert_before_last(BasicBlock* block, IrInsn* insn)
+{
+    Vector* insns = block->insns;
+    vec_push(insns, insns->data[insns->len - 1]);
+    insns->data[insns->len - 2] = insn;
+    record_loop_def(block, insn);
+}
+
+static void insert_after(BasicBlock* block, IrInsn const* pos, IrInsn* insn)
+{
+    Vector* insns = block->insns;
+    vec_push(insns, NULL);
+    size_t i = insns->len - 1;
+    while (insns->data[i - 1] != pos) {
+        insns->data[i] = insns->data[i - 1];
+        --i;
+    }
+    insns->data[i] = insn;
+    record_loop_def(block, insn);
+}
+
+// Record the block of the inserted instruction. The new virtual registers grow the arrays.
+static void record_loop_def(BasicBlock* block, IrInsn* insn)
+{
+    if (capacity_loop_defs <= insn->dst) {
+        size_t capacity = capacity_loop_defs * 2 + 16;
+        if (capacity <= insn->dst) {
+            capacity = insn->dst + 1;
+        }
+        loop_defs = realloc(loop_defs, sizeof(IrInsn*) * capacity);
+        loop_def_blocks = realloc(loop_def_blocks, sizeof(BasicBlock*) * capacity);
+        for (size_t i = capacity_loop_defs; i < capacity; i++) {
+            loop_defs[i] = NULL;
+            loop_def_blocks[i] = NULL;
+        }
+        capacity_loop_defs = capacity;
+    }
+    loop_defs[insn->dst] = insn;
+    loop_def_blocks[insn->dst] = block;
+}
+
+// Append the constant to the block and return its virtual register.
+static size_t add_loop_imm(BasicBlock* block, size_t imm)
+{
+    IrInsn* insn = new_loop_insn(IR_IMM, ++loop_function->count_vregs, 0, 0);
+    insn->imm = imm;
+    insert_before_last(block, insn);
+    return insn->dst;
+}
+
+// Replace the uses of the virtual register from with to.
+static void replace_vreg(IrFunction const* func, size_t from, size_t to)
+{
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn* insn = block->insns->data[j];
+            if (insn->lhs == from) {
+                insn->lhs = to;
+            }
+            if (insn->rhs == from) {
+                insn->rhs = to;
+            }
+            if (insn->args != NULL) {
+                for (size_t k = 0; k < insn->args->len; k++) {
+                    size_t v = (size_t)insn->args->data[k];
+                    if (v == from) {
+                        insn->args->data[k] = (void*)to;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static IrInsn* new_loop_insn(int op, size_t dst, size_t lhs, size_t rhs)
+{
+    IrInsn* insn = arena_alloc(ir_arena, sizeof(IrInsn));
+    insn->op = op;
+    insn->dst = dst;
+    insn->lhs = lhs;
+    insn->rhs = rhs;
+    insn->imm = 0;
+    insn->name = NULL;
+    insn->args = NULL;
+    insn->then_block = NULL;
+    insn->else_block = NULL;
+    return insn;
+}
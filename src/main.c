@@ -1,126 +1,483 @@
 #include "9mm.h"
 
-#ifdef SELFHOST_9MM
-extern void* stderr;
-#endif
-
 static char const* input;
 static char const* filename;
 
+// Paths of the input files.
+static Vector* filenames;
+
+// The number of the files which are compiled at once.
+static size_t count_jobs;
+
+// Path of the output assembly, NULL means stdout.
+static char const* output_path;
+
+// Print statistics of the compilation into stderr if it is 1.
+static int is_stats;
+
+// Measure the throughput of the tokenizer instead of compiling if it is 1.
+static int is_bench_lex;
+
+// Measure the throughput of the preprocessor instead of compiling if it is 1.
+static int is_bench_pp;
+
+// Print the intermediate representation instead of the assembly if it is 1.
+static int is_dump_ir;
+
+// Write the ELF relocatable object instead of the assembly if it is 1.
+static int is_object;
+
+// Path of the Unix domain socket which the server listens on.
+static char const* server_path;
+
+// Path of the socket of the server which compiles instead of this process.
+static char const* connect_path;
+
+// Measure the latency of the server instead of compiling if it is 1.
+static int is_bench_server;
+
+// Directory of the cache of the assembly, NULL disables it.
+static char const* cache_dir;
+
+// Kilobytes of the cache.
+static size_t cache_limit_kb;
+
+enum {
+    DEFAULT_CACHE_LIMIT_KB = 65536
+};
+
+#ifndef SELFHOST_9MM
+static void init_context(MmContext*);
+static char const* default_cache_dir(void);
+static void compile(char const*, char const*);
+static int compile_files(void);
+static int wait_worker(void);
+static char const* output_file_path(char const*);
+static void bench_lex(void);
+static void bench_pp(char const*);
+static void bench_server(char const*);
+static size_t now_us(void);
+static void write_output(char const*, Buffer const*);
+#endif
+
 int main(int argc, char const* const* argv)
 {
     if (argc < 2) {
         printf("Usage:\n");
-        printf("  %s [--test] [--str 'your program'] [FILEPATH]\n\n", argv[0]);
-        printf("  --test run test\n");
-        printf("  --str  input c codes as a string\n");
+        printf("  %s [--test] [--stats] [--bench-lex] [--bench-pp] [--dump-ir] [--inline-limit N] [-j N] [--server SOCKET] [--connect SOCKET] [--bench-server] [--cache] [--cache-dir DIR] [--cache-limit KB] [--str 'your program'] [-c] [-o FILE] [FILEPATH...]\n\n", argv[0]);
+        printf("  --test      run test\n");
+        printf("  --stats     print statistics of the compilation into stderr\n");
+        printf("  --bench-lex measure the throughput of the tokenizer\n");
+        printf("  --bench-pp  measure the throughput of the preprocessor\n");
+        printf("  --dump-ir   print the intermediate representation instead of the assembly\n");
+        printf("  --inline-limit N\n");
+        printf("              inline the leaf functions of at most N IR instructions, 0 disables it\n");
+        printf("  -j N        compile at most N files at once, it is the number of the cores by default\n");
+        printf("  --server SOCKET\n");
+        printf("              compile the requests from the unix domain socket on N workers\n");
+        printf("  --connect SOCKET\n");
+        printf("              let the server compile the input\n");
+        printf("  --bench-server\n");
+        printf("              measure the latency of the server, each line of the file is a request\n");
+        printf("  --cache     cache the assembly in ~/.cache/9mm by the preprocessed source\n");
+        printf("  --cache-dir DIR\n");
+        printf("              cache the assembly in the directory\n");
+        printf("  --cache-limit KB\n");
+        printf("              evict the least recently used assembly over the size, it is 64 MB by default\n");
+        printf("  --str       input c codes as a string\n");
+        printf("  -c          write the ELF relocatable object instead of the assembly\n");
+        printf("  -o          write the output into the file instead of stdout\n");
+        printf("  FILEPATH    input c codes from the file, '-' means stdin\n");
+        printf("              each of the multiple files is compiled into the assembly next to it, foo.c into foo.s or foo.o\n");
         return 1;
     }
 
-    if (strncmp("--test", argv[1], 5) == 0) {
-        runtest();
+    init_arenas();
+
+    filenames = new_vector();
+#ifndef SELFHOST_9MM
+    count_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    // FIXME: use _SC_NPROCESSORS_ONLN
+    count_jobs = sysconf(84);
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp("--test", argv[i], 6) == 0) {
+            runtest();
+            return 0;
+        } else if (strncmp("--stats", argv[i], 7) == 0) {
+            is_stats = 1;
+        } else if (strncmp("--bench-lex", argv[i], 11) == 0) {
+            is_bench_lex = 1;
+        } else if (strncmp("--bench-pp", argv[i], 10) == 0) {
+            is_bench_pp = 1;
+        } else if (strcmp("--bench-server", argv[i]) == 0) {
+            is_bench_server = 1;
+        } else if (strcmp("--server", argv[i]) == 0) {
+            server_path = argv[++i];
+        } else if (strcmp("--connect", argv[i]) == 0) {
+            connect_path = argv[++i];
+        } else if (strcmp("--cache", argv[i]) == 0) {
+            cache_dir = default_cache_dir();
+        } else if (strcmp("--cache-dir", argv[i]) == 0) {
+            cache_dir = argv[++i];
+        } else if (strcmp("--cache-limit", argv[i]) == 0) {
+            cache_limit_kb = atoi(argv[++i]);
+        } else if (strncmp("--dump-ir", argv[i], 9) == 0) {
+            is_dump_ir = 1;
+        } else if (strcmp("--inline-limit", argv[i]) == 0) {
+            set_inline_limit(atoi(argv[++i]));
+        } else if (strncmp("--str", argv[i], 5) == 0) {
+            // The given string is source code.
+            input = argv[++i];
+        } else if (strcmp("-j", argv[i]) == 0) {
+            count_jobs = atoi(argv[++i]);
+        } else if (strcmp("-c", argv[i]) == 0) {
+            is_object = 1;
+        } else if (strcmp("-o", argv[i]) == 0) {
+            output_path = argv[++i];
+        } else {
+            // The given file contains source code.
+            vec_push(filenames, (void*)argv[i]);
+        }
+    }
+
+    if (server_path != NULL) {
+        MmContext* options = calloc(1, sizeof(MmContext));
+        init_context(options);
+        // The server always responds the assembly, the client assembles it with -c.
+        options->is_object = 0;
+        run_server(server_path, count_jobs, options);
+        free_arenas();
         return 0;
     }
 
-    if (strncmp("--str", argv[1], 4) == 0) {
-        // The given string is source code.
-        input = argv[2];
-    } else {
-        // The given file contains source code.
-        filename = argv[1];
+    if (1 < filenames->len) {
+        if (output_path != NULL) {
+            error("-o cannot be used with multiple files");
+        }
+        int is_ok = compile_files();
+        free_arenas();
+        if (!is_ok) {
+            return 1;
+        }
+        return 0;
+    }
 
-        char* content = read_file(filename);
-        input = preprocess(content, filename);
+    if (filenames->len == 1) {
+        filename = filenames->data[0];
     }
 
-    Vector const* tokens = tokenize(input);
-    Code const* code = program(tokens);
-    generate(code);
+    char const* content = input;
+    if (filename != NULL) {
+        content = read_file(filename);
+
+        if (is_bench_pp) {
+            bench_pp(content);
+            free_arenas();
+            return 0;
+        }
+
+        if (is_bench_server) {
+            bench_server(content);
+            free_arenas();
+            return 0;
+        }
+    }
+
+    if (content == NULL) {
+        error("no input is given");
+    }
+
+    if (is_bench_lex) {
+        if (filename != NULL) {
+            input = preprocess(content, filename);
+        }
+        bench_lex();
+        free_arenas();
+        return 0;
+    }
+
+    compile(content, output_path);
+    free_arenas();
 
     return 0;
 }
 
-// Output an error for user and exit.
-void error_at(char const* loc, char const* msg)
+// Compile the source into the assembly file, or into stdout if the path is NULL.
+// The source is preprocessed if it is read from a file.
+static void compile(char const* source, char const* path)
 {
-    // Find head and tail of line which includes loc.
-    char const* line = loc;
-    while (input < line && line[-1] != '\n') {
-        line--;
+    MmContext* ctx = calloc(1, sizeof(MmContext));
+    init_context(ctx);
+    ctx->filename = filename;
+
+    Buffer* out = new_buffer(1024 * 1024);
+    int status = MM_OK;
+    if (connect_path != NULL) {
+        // The server finds the included files by the absolute path.
+        char* path_on_server = NULL;
+        if (filename != NULL) {
+            path_on_server = realpath(filename, NULL);
+        }
+        status = request_server(connect_path, path_on_server, source, out);
+        free(path_on_server);
+
+        if (status == MM_OK && is_object) {
+            Buffer* object = new_buffer(out->len + 4096);
+            assemble_elf(out->data, out->len, object);
+            free(out->data);
+            out = object;
+        }
+    } else {
+        status = mm_compile(ctx, source, strlen(source), out);
+    }
+    if (status != MM_OK) {
+        exit(1);
+    }
+
+    write_output(path, out);
+    free(out->data);
+    free(ctx);
+}
+
+// Set the options of the command line into the context.
+static void init_context(MmContext* ctx)
+{
+    ctx->is_dump_ir = is_dump_ir;
+    ctx->is_stats = is_stats;
+    ctx->is_object = is_object;
+    ctx->cache_dir = cache_dir;
+    if (cache_limit_kb == 0) {
+        cache_limit_kb = DEFAULT_CACHE_LIMIT_KB;
     }
+    ctx->cache_limit = cache_limit_kb * 1024;
+}
 
-    char const* end = loc;
-    while (*end != '\n') {
-        end++;
+static char const* default_cache_dir(void)
+{
+    char const* home = getenv("HOME");
+    if (home == NULL) {
+        error("HOME is not set");
     }
+    char* dir = arena_alloc(container_arena, strlen(home) + 12);
+    strcpy(dir, home);
+    strcat(dir, "/.cache/9mm");
+    return dir;
+}
 
-    // Find where the found line is.
-    size_t line_num = 1;
-    for (char const* p = input; p < line; p++) {
-        if (*p == '\n') {
-            line_num++;
+static void write_output(char const* path, Buffer const* out)
+{
+    int fd = 1;
+    if (path != NULL) {
+#ifndef SELFHOST_9MM
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#else
+        // FIXME: use O_WRONLY | O_CREAT | O_TRUNC and 0644.
+        fd = open(path, 577, 420);
+#endif
+        if (fd < 0) {
+            error("cannot open %s", path);
         }
     }
 
-    // Print the line with filename and line number.
-    size_t indent = fprintf(stderr, "%s:%zd: ", filename, line_num);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+    if (!write_all(fd, out->data, out->len)) {
+        error("cannot write the output");
+    }
 
-    // Output the error and emphases the error location via "^".
-    int pos = loc - line + indent;
-    fprintf(stderr, "%*s", pos, ""); // print pos spaces.
-    fprintf(stderr, "^ %s\n", msg);
-    exit(1);
+    if (path != NULL) {
+        close(fd);
+    }
 }
 
-#ifndef SELFHOST_9MM
-// Output log for me and exit.
-void log_internal(char const* level, const char* file, const char* func, size_t line, char const* fmt, ...)
+// Compile each file on a worker process, at most "count_jobs" workers run at once.
+// A worker has its own copy of the state of the compiler, so the files never share the tables and the arenas.
+// Return 1 if all the files are compiled.
+static int compile_files(void)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    fprintf(stderr, "%s [%s:%s:%zd] ", level, file, func, line);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    va_end(ap);
+    if (count_jobs == 0) {
+        count_jobs = 1;
+    }
+
+    int is_ok = 1;
+    size_t count_workers = 0;
+    for (size_t i = 0; i < filenames->len; i++) {
+        if (count_workers == count_jobs) {
+            if (!wait_worker()) {
+                is_ok = 0;
+            }
+            --count_workers;
+        }
+
+        int pid = fork();
+        if (pid < 0) {
+            error("cannot fork");
+        }
+        if (pid == 0) {
+            filename = filenames->data[i];
+            compile(read_file(filename), output_file_path(filename));
+            exit(0);
+        }
+        ++count_workers;
+    }
+
+    while (0 < count_workers) {
+        if (!wait_worker()) {
+            is_ok = 0;
+        }
+        --count_workers;
+    }
+    return is_ok;
 }
-#else
-void error_if_null(void* var)
+
+// Wait for one of the workers, return 1 if it succeeded.
+static int wait_worker(void)
 {
-    if (var == NULL) {
-        error("NULL is given");
+    int status = 0;
+    if (wait(&status) < 0) {
+        error("no worker is running");
     }
+    if (status != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+// "foo.c" is compiled into "foo.s" or "foo.o", the other names are followed by the suffix.
+static char const* output_file_path(char const* path)
+{
+    size_t len = strlen(path);
+    char* buf = arena_alloc(container_arena, len + 3);
+    strcpy(buf, path);
+    if (2 <= len && strcmp(buf + len - 2, ".c") == 0) {
+        len -= 2;
+    }
+    if (is_object) {
+        strcpy(buf + len, ".o");
+    } else {
+        strcpy(buf + len, ".s");
+    }
+    return buf;
 }
-#endif
 
-char* read_file(char const* path)
+static void bench_lex(void)
 {
-    void* fp = fopen(path, "r");
-    if (fp == NULL) {
-        error("cannot open %s", path);
+    char* level_names[3];
+    level_names[SCAN_SCALAR] = "scalar";
+    level_names[SCAN_SSE2] = "sse2";
+    level_names[SCAN_AVX2] = "avx2";
+
+    size_t size = strlen(input);
+    size_t count_loops = 50;
+
+    // Compare the implementations of skipping spaces and comments.
+    for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+        if (set_scan_level(level) != level) {
+            break;
+        }
+
+        size_t count_tokens = 0;
+
+        // FIXME: use CLOCKS_PER_SEC, it is 1000000 on POSIX.
+        size_t begin = clock();
+        for (size_t i = 0; i < count_loops; i++) {
+            Vector const* tokens = tokenize(input);
+            count_tokens = tokens->len;
+        }
+        size_t elapsed = clock() - begin + 1;
+
+        fprintf(stderr, "# lex (%s): %zd bytes, %zd tokens\n", level_names[level], size, count_tokens);
+        fprintf(stderr, "# lex (%s): %zd loops in %zd us, %zd MB/s\n", level_names[level], count_loops, elapsed, size * count_loops / elapsed);
     }
+}
 
-    // FIXME: use SEEK_END
-    if (fseek(fp, 0, 2) == -1) {
-        error("%s: fseek", path);
+static void bench_pp(char const* content)
+{
+    size_t size = strlen(content);
+
+    // FIXME: use CLOCKS_PER_SEC, it is 1000000 on POSIX.
+    size_t begin = clock();
+    char const* preprocessed = preprocess(content, filename);
+    size_t elapsed = clock() - begin + 1;
+
+    fprintf(stderr, "# pp: %zd bytes -> %zd bytes\n", size, strlen(preprocessed));
+    fprintf(stderr, "# pp: %zd us, %zd MB/s\n", elapsed, size / elapsed);
+}
+
+// Send each line of the content to the server as a request, and print the latencies.
+static void bench_server(char const* content)
+{
+    if (connect_path == NULL) {
+        error("--connect is required to measure the server");
     }
 
-    // FIXME: use SEEK_SET
-    size_t size = ftell(fp);
-    if (fseek(fp, 0, 0) == -1) {
-        error("%s: fseek", path);
+    size_t count_lines = 0;
+    for (char const* p = content; *p; p++) {
+        if (*p == '\n') {
+            ++count_lines;
+        }
     }
+    size_t* latencies = calloc(count_lines + 1, sizeof(size_t));
+
+    Buffer* out = new_buffer(1024 * 1024);
+    size_t count_requests = 0;
+    size_t count_failed = 0;
+    size_t total = 0;
+    char const* head = content;
+    while (*head) {
+        char const* tail = strchr(head, '\n');
+        if (tail == NULL) {
+            tail = head + strlen(head);
+        }
+        char* source = strndup(head, tail - head);
 
-    char* buf = calloc(1, size + 2);
-    fread(buf, size, 1, fp);
+        out->len = 0;
+        size_t begin = now_us();
+        if (request_server(connect_path, NULL, source, out) != MM_OK) {
+            ++count_failed;
+        }
+        size_t latency = now_us() - begin;
+        free(source);
 
-    // Enforce the content is terminated by "\n\0".
-    if (size == 0 || buf[size - 1] != '\n') {
-        buf[size++] = '\n';
+        // Insertion sort to find the median.
+        size_t i = count_requests;
+        while (0 < i && latency < latencies[i - 1]) {
+            latencies[i] = latencies[i - 1];
+            --i;
+        }
+        latencies[i] = latency;
+        ++count_requests;
+        total += latency;
+
+        if (*tail == '\0') {
+            break;
+        }
+        head = tail + 1;
     }
-    buf[size] = '\0';
 
-    fclose(fp);
+    if (count_requests == 0) {
+        error("no request is given");
+    }
+    fprintf(stderr, "# server: %zd requests, %zd failed\n", count_requests, count_failed);
+    fprintf(stderr, "# server: %zd us average, %zd us median, %zd us max\n", total / count_requests, latencies[count_requests / 2], latencies[count_requests - 1]);
+    free(latencies);
+    free(out->data);
+}
 
-    return buf;
+// Wall clock time in microseconds.
+static size_t now_us(void)
+{
+#ifndef SELFHOST_9MM
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    // FIXME: use struct timespec and CLOCK_MONOTONIC.
+    char ts[16];
+    clock_gettime(1, ts);
+    size_t* sec = ts;
+    size_t* nsec = ts + 8;
+    return *sec * 1000000 + *nsec / 1000;
+#endif
 }
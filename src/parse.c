@@ -44,33 +44,59 @@ static Map* gvar_type_map;
 // String literal to label map.
 static Map* str_label_map;
 
+// Function name to the "Node" of its definition, or of its prototype until it is defined.
+static Map* function_map;
+
+// Names of the static functions and global variables.
+static Map* static_names;
+
 // Name to user defined type map.
 static Map* user_types;
 
 // Enum member to number.
 static Map* enum_map;
 
+// Interned names which are compared by their address.
+static char const* name_char;
+static char const* name_int;
+static char const* name_void;
+static char const* name_size_t;
+static char const* name_static;
+static char const* name_const;
+
 Code const* program(Vector const* tv)
 {
     token_vector = tv;
+    pos = 0;
+    context = NULL;
 
     Token** tokens = (Token**)token_vector->data;
 
     gvar_type_map = new_map();
     str_label_map = new_map();
+    function_map = new_map();
+    static_names = new_map();
     user_types = new_map();
     enum_map = new_map();
 
-    size_t count = 0;
-    Node const** asts = malloc(sizeof(Node*) * 64);
+    name_char = intern("char");
+    name_int = intern("int");
+    name_void = intern("void");
+    name_size_t = intern("size_t");
+    name_static = intern("static");
+    name_const = intern("const");
+
+    Vector* asts = new_vector();
     while (tokens[pos]->ty != TK_EOF) {
-        asts[count++] = global();
+        vec_push(asts, fold_constants(global()));
     }
 
-    Code* code = malloc(sizeof(Code));
-    code->asts = asts;
-    code->count_ast = count;
+    Code* code = arena_alloc(ast_arena, sizeof(Code));
+    code->asts = (Node const* const*)asts->data;
+    code->count_ast = asts->len;
     code->str_label_map = str_label_map;
+    code->function_map = function_map;
+    code->static_names = static_names;
 
     return code;
 }
@@ -126,17 +152,29 @@ static Node* global()
         return global();
     }
 
+    int is_static = 0;
+    if (tokens[pos]->ty == TK_IDENT && tokens[pos]->name == name_static) {
+        is_static = 1;
+    }
+
     Type* type = parse_type();
 
     if (tokens[pos]->ty == TK_IDENT && tokens[pos + 1]->ty == '(') {
         // Define function.
-        return function(type);
+        Node* node = function(type);
+        if (is_static) {
+            map_put(static_names, node->function->name, node);
+        }
+        return node;
     } else {
         // FIXME: Investigate why I need this cleanup...
         context = NULL;
 
         // Declare global variable.
         Node* node = decl_var(type);
+        if (is_static) {
+            map_put(static_names, node->name, node);
+        }
 
         if (!consume(';')) {
             error_at(tokens[pos]->input, "';' is missing");
@@ -165,7 +203,7 @@ static Node* function(Type* type)
     while (!consume(')')) {
         if (consume(TK_EOF)) {
             error_at(tokens[pos]->input, "missing ')' of the function");
-        } else if (strcmp(tokens[pos]->name, "void") == 0 && tokens[pos + 1]->ty == ')') {
+        } else if (tokens[pos]->name == name_void && tokens[pos + 1]->ty == ')') {
             pos += 2;
             break;
         } else {
@@ -178,14 +216,16 @@ static Node* function(Type* type)
 
     if (consume(';')) {
         // Function prototype.
-        // FIXME: store function table.
         node->lhs = NULL;
+        if (map_get(function_map, name) == NULL) {
+            map_put(function_map, name, node);
+        }
     } else {
         // Parse the function body.
         node->lhs = block();
+        map_put(function_map, name, node);
     }
 
-
     // Finish the current context;
     context = prev_context;
 
@@ -240,7 +280,7 @@ static void strut(void)
         error_at(tokens[pos]->input, "struct name has to be identifier");
     }
 
-    UserType* user_type = malloc(sizeof(UserType));
+    UserType* user_type = arena_alloc(type_arena, sizeof(UserType));
     user_type->name = tokens[pos++]->name;
     user_type->size = 0;
     user_type->member_offset_map = new_map();
@@ -345,7 +385,7 @@ static Node* stmt(void)
             error_at(tokens[pos]->input, "The condition of while must be terminated by ')'");
         }
 
-        char* break_label = malloc(sizeof(char) * 128);
+        char* break_label = arena_alloc(ast_arena, sizeof(char) * 128);
         sprintf(break_label, ".L_while_end_%p", lhs);
 
         char const* prev = context->break_label;
@@ -391,7 +431,7 @@ static Node* stmt(void)
             }
         }
 
-        char* break_label = malloc(sizeof(char) * 128);
+        char* break_label = arena_alloc(ast_arena, sizeof(char) * 128);
         sprintf(break_label, ".L_for_end_%p", node);
 
         char const* prev = context->break_label;
@@ -649,7 +689,7 @@ static Node* term(void)
     } else if (tokens[pos]->ty == TK_STR) {
         Node* node = new_node(ND_STR, NULL, NULL);
 
-        char* buf = malloc(64);
+        char* buf = arena_alloc(ast_arena, 64);
         sprintf(buf, "str_%zd", str_label_map->keys->len);
         map_put(str_label_map, tokens[pos]->name, buf);
 
@@ -846,7 +886,7 @@ static Type* parse_type(void)
     size_t prev_pos = pos;
 
     // Ignore static.
-    if (tokens[pos]->ty == TK_IDENT && strcmp(tokens[pos]->name, "static") == 0) {
+    if (tokens[pos]->ty == TK_IDENT && tokens[pos]->name == name_static) {
         // FIXME: handle static identifier.
         ++pos;
     }
@@ -859,13 +899,13 @@ static Type* parse_type(void)
         char const* name = tokens[pos - 1]->name;
         error_if_null(name);
 
-        if (strcmp(name, "char") == 0) {
+        if (name == name_char) {
             type = new_type(CHAR, NULL);
-        } else if (strcmp(name, "int") == 0) {
+        } else if (name == name_int) {
             type = new_type(INT, NULL);
-        } else if (strcmp(name, "void") == 0) {
+        } else if (name == name_void) {
             type = new_type(VOID, NULL);
-        } else if (strcmp(name, "size_t") == 0) {
+        } else if (name == name_size_t) {
             type = new_type(SIZE_T, NULL);
         } else {
             UserType* user_type = map_get(user_types, name);
@@ -882,7 +922,7 @@ static Type* parse_type(void)
 
     while (1) {
         // Ignore const.
-        if (tokens[pos]->ty == TK_IDENT && strcmp(tokens[pos]->name, "const") == 0) {
+        if (tokens[pos]->ty == TK_IDENT && tokens[pos]->name == name_const) {
             // FIXME: handle const type.
             ++pos;
         }
@@ -911,23 +951,23 @@ static int consume(int ty)
 
 static Node* new_node(int ty, Node* lhs, Node* rhs)
 {
-    Node* node = malloc(sizeof(Node));
+    Node* node = arena_alloc(ast_arena, sizeof(Node));
     node->ty = ty;
     node->lhs = lhs;
     node->rhs = rhs;
 
     // Allocate the type specific object.
     if (ty == ND_FUNCTION) {
-        node->function = malloc(sizeof(NodeFunction));
+        node->function = arena_alloc(ast_arena, sizeof(NodeFunction));
         node->function->args = new_vector();
     } else if (ty == ND_FUNCTION || ty == ND_BLOCK) {
         node->stmts = new_vector();
     } else if (ty == ND_IF) {
-        node->if_else = malloc(sizeof(NodeIfElse));
+        node->if_else = arena_alloc(ast_arena, sizeof(NodeIfElse));
     } else if (ty == ND_FOR) {
-        node->fors = malloc(sizeof(NodeFor));
+        node->fors = arena_alloc(ast_arena, sizeof(NodeFor));
     } else if (ty == ND_CALL) {
-        node->call = malloc(sizeof(NodeCall));
+        node->call = arena_alloc(ast_arena, sizeof(NodeCall));
     } else {
         node->tv = NULL;
     }
@@ -984,7 +1024,7 @@ static Node* new_node_num(size_t val)
 
 static Type* new_type(int ty, Type const* ptr_to)
 {
-    Type* type = malloc(sizeof(Type));
+    Type* type = arena_alloc(type_arena, sizeof(Type));
     type->ty = ty;
     type->ptr_to = ptr_to;
     type->size = get_type_size(type);
@@ -1023,7 +1063,7 @@ static size_t get_type_size(Type const* type)
 
 static Context* new_context(void)
 {
-    Context* context = malloc(sizeof(Context));
+    Context* context = arena_alloc(ast_arena, sizeof(Context));
 
     context->count_vars = 0;
     context->current_offset = 0;
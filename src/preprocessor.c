@@ -1,190 +1,427 @@
 #include "9mm.h"
 
 #ifndef SELFHOST_9MM
-static char* load_headers(char*, char const*);
-static void expand_macros(char*);
-static void truncate(char*, char const*);
+static void preprocess_file(char const*, char const*);
+static void process_directive(char const*, char const*, char const*);
+static void include_file(char const*, char const*, char const*);
+static Header* load_header(char const*);
+static Header* find_kept_header(char const*, size_t, size_t);
+static char const* find_include_guard(char const*);
+static char const* skip_blank_lines(char const*);
+static char const* read_macro_name(char const*, char const*);
+static void push_condition(int);
+static int is_active(void);
+static void append_line(char const*, char const*);
+static int is_ident_char(char);
 #endif
 
-char const* preprocess(char* content, char const* filepath)
+// Preprocessed code.
+static Buffer* output;
+
+// Defined macro name -> itself.
+static Map* macros;
+
+// Stack of the nested conditions.
+// Each element is "parent_is_active * 2 + condition".
+static Vector* conditions;
+
+// Canonical path -> "Header" which is used in the current compilation.
+static Map* header_cache;
+
+// Headers which are kept over the compilations, they are allocated by malloc.
+static Header** kept_headers;
+static size_t count_kept_headers;
+static size_t capacity_kept_headers;
+
+// Header which is being preprocessed, NULL for the given source file.
+static Header* current_header;
+
+// Statistics of header_cache.
+static size_t count_header_hits;
+static size_t count_header_misses;
+static size_t count_header_skips;
+static size_t count_header_reuses;
+
+// The input is never modified, the kept lines are appended to the output.
+char const* preprocess(char const* content, char const* filepath)
+{
+    output = new_buffer(strlen(content) + 1);
+    macros = new_map();
+    conditions = new_vector();
+    header_cache = new_map();
+    current_header = NULL;
+
+    map_put(macros, "SELFHOST_9MM", "SELFHOST_9MM");
+
+    preprocess_file(content, filepath);
+
+    if (conditions->len != 0) {
+        error("%s: #endif is missing", filepath);
+    }
+
+    // The caller owns the output, it is not discarded any more.
+    char const* preprocessed = output->data;
+    output = NULL;
+    return preprocessed;
+}
+
+// Free the output of the preprocessing which is aborted by an error.
+void discard_preprocess(void)
+{
+    if (output != NULL) {
+        free(output->data);
+        output = NULL;
+    }
+}
+
+static void preprocess_file(char const* head, char const* filepath)
 {
     char* dir_path = NULL;
-    char* p = strrchr(filepath, '/');
+    char const* p = strrchr(filepath, '/');
     if (p == NULL) {
-        dir_path = "./";
+        dir_path = ".";
     } else {
         dir_path = strndup(filepath, p - filepath);
     }
 
-    content = load_headers(content, dir_path);
+    while (*head) {
+        char const* tail = strchr(head, '\n');
+        if (tail == NULL) {
+            tail = head + strlen(head);
+        }
+
+        if (*head == '#') {
+            process_directive(head, tail, dir_path);
+        } else if (is_active()) {
+            append_line(head, tail);
+        }
+
+        if (*tail == '\0') {
+            break;
+        }
+        head = tail + 1;
+    }
 
     if (p != NULL) {
         free(dir_path);
     }
+}
 
-    expand_macros(content);
+// Process the directive in [head, tail).
+static void process_directive(char const* head, char const* tail, char const* dir_path)
+{
+    if (strncmp("#ifndef ", head, 8) == 0) {
+        char const* name = read_macro_name(head + 8, tail);
+        push_condition(map_get(macros, name) == NULL);
+    } else if (strncmp("#ifdef ", head, 7) == 0) {
+        char const* name = read_macro_name(head + 7, tail);
+        push_condition(map_get(macros, name) != NULL);
+    } else if (strncmp("#else", head, 5) == 0) {
+        if (conditions->len == 0) {
+            error("#else without #ifdef or #ifndef");
+        }
 
-    return content;
+        // Flip the condition.
+        size_t top = (size_t)conditions->data[conditions->len - 1];
+        size_t parent_is_active = top / 2;
+        size_t condition = top - parent_is_active * 2;
+        conditions->data[conditions->len - 1] = (void*)(parent_is_active * 2 + 1 - condition);
+    } else if (strncmp("#endif", head, 6) == 0) {
+        if (conditions->len == 0) {
+            error("#endif without #ifdef or #ifndef");
+        }
+        conditions->len--;
+    } else if (!is_active()) {
+        // Ignore the other directives in the skipped lines.
+        return;
+    } else if (strncmp("#define ", head, 8) == 0) {
+        // FIXME: read the value of the macro.
+        char const* name = read_macro_name(head + 8, tail);
+        map_put(macros, name, (void*)name);
+    } else if (strncmp("#pragma once", head, 12) == 0) {
+        if (current_header != NULL) {
+            current_header->is_pragma_once = 1;
+        }
+    } else if (strncmp("#pragma ", head, 8) == 0) {
+        // Ignore the other pragmas.
+        return;
+    } else if (strncmp("#include <", head, 10) == 0) {
+        // FIXME: Load system header.
+        return;
+    } else if (strncmp("#include ", head, 9) == 0 && head[9] == '"') {
+        include_file(head + 10, tail, dir_path);
+    } else {
+        // Keep the unknown directive as it was.
+        append_line(head, tail);
+    }
 }
 
-static char* load_headers(char* head, char const* dir_path)
+static void include_file(char const* filename_head, char const* tail, char const* dir_path)
 {
-    char* code_head = head;
+    char const* filename_tail = strchr(filename_head, '"');
+    if (filename_tail == NULL || tail < filename_tail) {
+        error("closing quote is missing in #include");
+    }
+    size_t filename_size = filename_tail - filename_head;
 
-    while (*head) {
-        if (strncmp("#include <", head, 10) == 0) {
-            // FIXME: Load system header.
-            truncate(head, strchr(head, '\n'));
-        } else if (strncmp("#include", head, 8) == 0) {
-            // Extract target filename.
-            char const* filename_head = head + 10;
-            char const* filename_tail = strchr(filename_head, '"');
-            size_t filename_size = filename_tail - filename_head;
-
-            // Concat directory and filename.
-            char* filepath = malloc(sizeof(char) * (strlen(dir_path) + filename_size + 1 + 1));
-            *filepath = 0;
-            strncat(filepath, dir_path, strlen(dir_path));
-            strncat(filepath, "/", 2);
-            strncat(filepath, filename_head, filename_size);
-
-            char const* content = read_file(filepath);
-            free(filepath);
-
-            // Allocate space to store them enough.
-            char* prog = malloc(sizeof(char) * (strlen(code_head) + strlen(content)));
-            *prog = 0;
-
-            // Load lines before current header.
-            strncat(prog, code_head, head - code_head);
-            // Load the header file.
-            strncat(prog, content, strlen(content));
-            // Load lines after the header.
-            ++filename_tail;
-            strncat(prog, filename_tail, strlen(filename_tail));
-
-            free((void*)content);
-            free((void*)code_head);
-
-            code_head = prog;
-            head = code_head;
-        } else {
-            head = strchr(head, '\n') + 1;
+    // Concat directory and filename.
+    Buffer* filepath = new_buffer(strlen(dir_path) + filename_size + 1);
+    buf_append_str(filepath, dir_path);
+    buf_append_str(filepath, "/");
+    buf_append(filepath, filename_head, filename_size);
+
+    Header* header = load_header(filepath->data);
+    free(filepath->data);
+
+    // Skip the header which is guarded without reading its content again.
+    if ((header->is_pragma_once && header->is_included) ||
+        (header->guard_name != NULL && map_get(macros, header->guard_name) != NULL)) {
+        ++count_header_skips;
+        return;
+    }
+
+    Header* prev_header = current_header;
+    current_header = header;
+
+    header->is_included = 1;
+    preprocess_file(header->content, header->path);
+
+    current_header = prev_header;
+}
+
+// Return the header from the cache or read it.
+static Header* load_header(char const* filepath)
+{
+    char* path = realpath(filepath, NULL);
+    if (path == NULL) {
+        error("cannot open %s", filepath);
+    }
+
+    Header* header = map_get(header_cache, path);
+    if (header != NULL) {
+        free(path);
+        ++count_header_hits;
+        return header;
+    }
+    ++count_header_misses;
+
+    // The header which is read by the previous compilation is used if the file is not changed.
+    size_t mtime = 0;
+    size_t size = 0;
+    stat_file(path, &mtime, &size);
+    header = find_kept_header(path, mtime, size);
+    if (header != NULL) {
+        free(path);
+        ++count_header_reuses;
+    } else {
+        header = calloc(1, sizeof(Header));
+        header->path = path;
+        header->content = read_file(path);
+        header->mtime = mtime;
+        header->size = size;
+
+        char const* guard_name = find_include_guard(header->content);
+        if (guard_name != NULL) {
+            header->guard_name = strdup(guard_name);
         }
+
+        // The changed file replaces the old one, and its content is left.
+        if (count_kept_headers == capacity_kept_headers) {
+            capacity_kept_headers = capacity_kept_headers * 2 + 16;
+            kept_headers = realloc(kept_headers, sizeof(Header*) * capacity_kept_headers);
+        }
+        kept_headers[count_kept_headers++] = header;
     }
 
-    return code_head;
+    header->is_included = 0;
+    map_put(header_cache, header->path, header);
+
+    return header;
 }
 
-// FIXME: Support nested macro and multiline macro.
-static void expand_macros(char* head)
+// Return the kept header of the path if the file has the same modification time and size, otherwise NULL.
+static Header* find_kept_header(char const* path, size_t mtime, size_t size)
 {
-    char* stored_head = head;
-    Map* macros = new_map();
-    map_put(macros, "SELFHOST_9MM", "SELFHOST_9MM");
+    for (size_t i = count_kept_headers; 0 < i; i--) {
+        Header* header = kept_headers[i - 1];
+        if (strcmp(header->path, path) == 0) {
+            if (header->mtime == mtime && header->size == size) {
+                return header;
+            }
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Return the macro name if the content is wrapped by the idiom below, otherwise return NULL.
+//   #ifndef X
+//   #define X
+//   ...
+//   #endif
+// The content which has "#else" of the "#ifndef" is not skipped, since its other branch is used by the next inclusion.
+static char const* find_include_guard(char const* content)
+{
+    char const* head = skip_blank_lines(content);
+    if (strncmp("#ifndef ", head, 8) != 0) {
+        return NULL;
+    }
+    char const* name = read_macro_name(head + 8, strchr(head, '\n'));
+
+    head = skip_blank_lines(strchr(head, '\n') + 1);
+    if (strncmp("#define ", head, 8) != 0 || read_macro_name(head + 8, strchr(head, '\n')) != name) {
+        return NULL;
+    }
+
+    // Find #endif which closes the #ifndef.
+    size_t depth = 1;
+    while (0 < depth) {
+        head = strchr(head, '\n');
+        if (head == NULL) {
+            return NULL;
+        }
+        head = skip_blank_lines(head + 1);
+
+        if (strncmp("#ifdef ", head, 7) == 0 || strncmp("#ifndef ", head, 8) == 0) {
+            ++depth;
+        } else if (strncmp("#endif", head, 6) == 0) {
+            --depth;
+        } else if (depth == 1 && (strncmp("#else", head, 5) == 0 || strncmp("#elif", head, 5) == 0)) {
+            return NULL;
+        } else if (*head == '\0') {
+            return NULL;
+        }
+    }
+
+    // Nothing is allowed after the #endif.
+    head = strchr(head, '\n');
+    if (head != NULL) {
+        char const* rest = skip_blank_lines(head + 1);
+        if (*rest != '\0') {
+            return NULL;
+        }
+    }
 
+    return name;
+}
+
+// Return the head of the first line which is neither empty nor comment.
+static char const* skip_blank_lines(char const* head)
+{
     while (*head) {
-        if (strncmp("#define ", head, 8) == 0) {
-            char const* define_head = head + 8;
-            char const* define_tail = strchr(define_head, '\n');
-
-            char* define_ident = strndup(define_head, define_tail - define_head);
-            map_put(macros, define_ident, define_ident);
-            free(define_ident);
-
-            // Remove the macro line.
-            truncate(head, define_tail + 1);
-        } else if (strncmp("#ifndef ", head, 8) == 0) {
-            char const* ifndef_head = head + 8;
-            char const* ifndef_tail = strchr(ifndef_head, '\n');
-
-            char* ifndef_ident = strndup(ifndef_head, ifndef_tail - ifndef_head);
-            int is_defined = map_get(macros, ifndef_ident) != NULL;
-            free(ifndef_ident);
-
-            // Remove #ifndef line.
-            truncate(head, ifndef_tail + 1);
-
-            char* else_head = strstr(head, "#else\n");
-            char* else_tail = else_head + 5;
-            char* endif_head = strstr(head, "#endif\n");
-            char* endif_tail = endif_head + 7;
-            int has_else = else_head != NULL && else_head < endif_head;
-
-            if (is_defined) {
-                // Keep the lines between #ifndef/#else and #endif.
-                if (has_else) {
-                    truncate(endif_head, endif_tail);
-                    truncate(head, else_tail);
-                } else {
-                    truncate(head, endif_tail);
-                }
-            } else {
-                // Keep the lines between #ifndef and #else.
-                if (has_else) {
-                    truncate(else_head, endif_tail);
-                } else {
-                    truncate(head, endif_tail);
-                }
+        char const* p = head;
+        // 9 == '\t'
+        while (*p == ' ' || *p == 9) {
+            ++p;
+        }
+
+        if (*p == '\n') {
+            head = p + 1;
+        } else if (p[0] == '/' && p[1] == '/') {
+            char const* tail = strchr(p, '\n');
+            if (tail == NULL) {
+                return p + strlen(p);
             }
-        } else if (strncmp("#ifdef ", head, 7) == 0) {
-            char const* ifdef_head = head + 7;
-            char const* ifdef_tail = strchr(ifdef_head, '\n');
-
-            char* ifdef_ident = strndup(ifdef_head, ifdef_tail - ifdef_head);
-            int is_defined = map_get(macros, ifdef_ident) != NULL;
-            free(ifdef_ident);
-
-            // Remove #ifdef line.
-            truncate(head, ifdef_tail + 1);
-
-            char* else_head = strstr(head, "#else\n");
-            char* else_tail = else_head + 5;
-            char* endif_head = strstr(head, "#endif\n");
-            char* endif_tail = endif_head + 7;
-            int has_else = else_head != NULL && else_head < endif_head;
-
-            if (is_defined) {
-                // Keep the lines between #ifdef and #else.
-                if (has_else) {
-                    truncate(else_head, endif_tail);
-                } else {
-                    truncate(endif_head, endif_tail);
-                }
-            } else {
-                // Keep the lines between #ifdef/#else and #endif.
-                if (has_else) {
-                    truncate(endif_head, endif_tail);
-                    truncate(head, else_tail);
-                } else {
-                    truncate(head, endif_tail);
-                }
+            head = tail + 1;
+        } else if (p[0] == '/' && p[1] == '*') {
+            char const* tail = strstr(p + 2, "*/");
+            if (tail == NULL) {
+                return p + strlen(p);
             }
+            head = tail + 2;
         } else {
-            head = strchr(head, '\n') + 1;
+            return p;
         }
     }
 
-    head = stored_head;
+    return head;
+}
 
-    // FIXME: read argument of "#define" and replace them here.
-    while (*head) {
-        char* null_head = strstr(head, "NULL");
-        if (null_head != NULL && *(null_head - 1) != '"') {
-            *null_head = '0';
-            truncate(null_head + 1, null_head + 4);
+void print_preprocess_stats(void)
+{
+    fprintf(stderr, "# header cache: %zd hits, %zd misses, %zd skipped by guard\n", count_header_hits, count_header_misses, count_header_skips);
+    fprintf(stderr, "# header cache: %zd reused from the previous compilations\n", count_header_reuses);
+}
+
+// Return the interned macro name which starts at head.
+static char const* read_macro_name(char const* head, char const* tail)
+{
+    char const* p = head;
+    while (p < tail && is_ident_char(*p)) {
+        ++p;
+    }
+
+    if (p == head) {
+        error("macro name is missing");
+    }
+
+    return intern_n(head, p - head);
+}
+
+static void push_condition(int condition)
+{
+    size_t top = is_active() * 2 + condition;
+    vec_push(conditions, (void*)top);
+}
+
+// Return 1 if the current line is not skipped by the conditions.
+static int is_active(void)
+{
+    if (conditions->len == 0) {
+        return 1;
+    }
+
+    size_t top = (size_t)conditions->data[conditions->len - 1];
+    return top == 3;
+}
+
+// Append the line [head, tail) and its newline to the output.
+// FIXME: read argument of "#define" and replace them here.
+static void append_line(char const* head, char const* tail)
+{
+    char const* p = head;
+    while (p < tail) {
+        if (*p == '"') {
+            // Skip string literal.
+            ++p;
+            while (p < tail && *p != '"') {
+                ++p;
+            }
+            ++p;
+        } else if (*p == 39) {
+            // Skip character literal, 39 == '\''.
+            if (p[1] == 92) {
+                // 92 == '\'
+                p += 4;
+            } else {
+                p += 3;
+            }
+        } else if (*p == 'N' && strncmp(p, "NULL", 4) == 0 && (p == head || !is_ident_char(p[-1])) && !is_ident_char(p[4])) {
+            // Replace NULL with 0.
+            buf_append(output, head, p - head);
+            buf_append_str(output, "0");
+            p += 4;
+            head = p;
+        } else if (is_ident_char(*p)) {
+            // Skip the rest of the identifier.
+            while (p < tail && is_ident_char(*p)) {
+                ++p;
+            }
         } else {
-            head = strchr(head, '\n') + 1;
+            ++p;
         }
     }
+
+    if (head < tail) {
+        buf_append(output, head, tail - head);
+    }
+    buf_append_str(output, "\n");
 }
 
-static void truncate(char* p, char const* tail)
+static int is_ident_char(char c)
 {
-    while (*tail) {
-        *p = *tail;
-        ++p;
-        ++tail;
-    }
-    *p = '\0';
+    return ('a' <= c && c <= 'z') ||
+           ('A' <= c && c <= 'Z') ||
+           ('0' <= c && c <= '9') ||
+           (c == '_');
 }
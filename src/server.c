@@ -0,0 +1,312 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static void spawn_worker(int, MmContext const*);
+static void serve(int, MmContext const*);
+static void handle_request(int, MmContext*, Buffer*, Buffer*, int);
+static int connect_server(char const*);
+static void* socket_address(char const*, size_t*);
+static void ignore_sigpipe(void);
+static void read_all(int, Buffer*);
+static void sleep_ms(size_t);
+#endif
+
+#ifdef SELFHOST_9MM
+// FIXME: use the constants of the system headers.
+enum {
+    AF_UNIX = 1,
+    SOCK_STREAM = 1,
+    SHUT_WR = 1,
+    SEEK_SET = 0,
+    PR_SET_PDEATHSIG = 1,
+    SIGTERM = 15
+};
+#endif
+
+// Compile the requests from the Unix domain socket at the path on the worker processes.
+// A request is a line of the path of the source, which is empty if it is not preprocessed, and the source until EOF.
+// A response is a line of the status of mm_compile, and the assembly if it succeeded or the diagnostics if it failed.
+// The options of the compilations are copied from the given context.
+// It runs until it is killed, and the workers are killed with it. The worker which has exited is replaced.
+void run_server(char const* path, size_t count_workers, MmContext const* options)
+{
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("cannot create a socket");
+    }
+    size_t addr_len = 0;
+    void* addr = socket_address(path, &addr_len);
+    if (bind(fd, addr, addr_len) != 0) {
+        error("cannot bind %s", path);
+    }
+    free(addr);
+    if (listen(fd, 128) != 0) {
+        error("cannot listen %s", path);
+    }
+
+    // The client which has gone must not kill the worker.
+    ignore_sigpipe();
+
+    if (count_workers == 0) {
+        count_workers = 1;
+    }
+    for (size_t i = 0; i < count_workers; i++) {
+        spawn_worker(fd, options);
+    }
+
+    // The worker which crashed or exited by the error which is not caught by mm_compile is replaced.
+    while (1) {
+        if (wait(NULL) < 0) {
+            error("no worker is running");
+        }
+        spawn_worker(fd, options);
+    }
+}
+
+static void spawn_worker(int fd, MmContext const* options)
+{
+    int pid = fork();
+    if (pid < 0) {
+        error("cannot fork");
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        serve(fd, options);
+        exit(0);
+    }
+}
+
+// Each worker handles the requests one by one.
+// Its context, arenas, headers and buffers are kept warm over the requests.
+static void serve(int server_fd, MmContext const* options)
+{
+    MmContext* ctx = calloc(1, sizeof(MmContext));
+    memcpy(ctx, options, sizeof(MmContext));
+    ctx->arenas = calloc(1, sizeof(ArenaSet));
+
+    // The diagnostics of each compilation are written into the file instead of stderr.
+    void* diagnostics = tmpfile();
+    if (diagnostics == NULL) {
+        error("cannot create a file of the diagnostics");
+    }
+    int diagnostics_fd = fileno(diagnostics);
+
+    Buffer* request = new_buffer(64 * 1024);
+    Buffer* out = new_buffer(1024 * 1024);
+    while (1) {
+        int conn = accept(server_fd, NULL, NULL);
+        if (0 <= conn) {
+            handle_request(conn, ctx, request, out, diagnostics_fd);
+            close(conn);
+        }
+    }
+}
+
+static void handle_request(int conn, MmContext* ctx, Buffer* request, Buffer* out, int diagnostics_fd)
+{
+    request->len = 0;
+    read_all(conn, request);
+
+    ftruncate(diagnostics_fd, 0);
+    lseek(diagnostics_fd, 0, SEEK_SET);
+    fflush(stderr);
+    int stderr_fd = dup(2);
+    dup2(diagnostics_fd, 2);
+
+    out->len = 0;
+    int status = MM_ERROR_COMPILE;
+    char* source = strchr(request->data, '\n');
+    if (source != NULL) {
+        *source = '\0';
+        ++source;
+
+        ctx->filename = NULL;
+        if (request->data[0] != '\0') {
+            ctx->filename = request->data;
+        }
+        char const* end = request->data + request->len;
+        status = mm_compile(ctx, source, end - source, out);
+    } else {
+        fprintf(stderr, "the request has no path line\n");
+    }
+
+    fflush(stderr);
+    dup2(stderr_fd, 2);
+    close(stderr_fd);
+
+    // The failed compilation responds its diagnostics instead of the assembly, which is dropped by mm_compile.
+    // The statistics of the succeeded one are left on the server, they are read into the request which is done.
+    lseek(diagnostics_fd, 0, SEEK_SET);
+    if (status == MM_OK) {
+        request->len = 0;
+        read_all(diagnostics_fd, request);
+        write_all(2, request->data, request->len);
+    } else {
+        read_all(diagnostics_fd, out);
+    }
+
+    char status_line[2];
+    status_line[0] = '0' + status;
+    status_line[1] = '\n';
+    if (write_all(conn, status_line, 2)) {
+        write_all(conn, out->data, out->len);
+    }
+}
+
+// Send the source to the server at the path and append the assembly to the output.
+// The filename is used to find the included files, the source is not preprocessed if it is NULL.
+// Return the status of the compilation, the diagnostics of the failed one are printed into stderr.
+int request_server(char const* path, char const* filename, char const* source, Buffer* out)
+{
+    // The server which has gone is reported by the error of the write.
+    ignore_sigpipe();
+
+    int fd = connect_server(path);
+    int is_sent = 1;
+    if (filename != NULL) {
+        is_sent = write_all(fd, filename, strlen(filename));
+    }
+    if (is_sent) {
+        is_sent = write_all(fd, "\n", 1);
+    }
+    if (is_sent) {
+        is_sent = write_all(fd, source, strlen(source));
+    }
+    if (!is_sent) {
+        error("cannot send the request to %s", path);
+    }
+
+    shutdown(fd, SHUT_WR);
+
+    size_t start = out->len;
+    read_all(fd, out);
+    close(fd);
+
+    // The status line is removed from the response.
+    if (out->len < start + 2) {
+        error("the connection to %s is closed without the response", path);
+    }
+    int status = out->data[start] - '0';
+    memmove(out->data + start, out->data + start + 2, out->len - start - 2);
+    out->len -= 2;
+    out->data[out->len] = '\0';
+
+    if (status != MM_OK) {
+        fprintf(stderr, "%s", out->data + start);
+        out->len = start;
+        out->data[start] = '\0';
+    }
+    return status;
+}
+
+// Connect to the server, it waits for the server which is starting for a second.
+static int connect_server(char const* path)
+{
+    size_t addr_len = 0;
+    void* addr = socket_address(path, &addr_len);
+
+    for (int i = 0; i < 100; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error("cannot create a socket");
+        }
+        if (connect(fd, addr, addr_len) == 0) {
+            free(addr);
+            return fd;
+        }
+        close(fd);
+        sleep_ms(10);
+    }
+
+    error("cannot connect to %s", path);
+    return -1;
+}
+
+// Return "struct sockaddr_un" of the path which is allocated by malloc, and set its bytes.
+static void* socket_address(char const* path, size_t* addr_len)
+{
+    size_t len = strlen(path);
+#ifndef SELFHOST_9MM
+    struct sockaddr_un* addr = calloc(1, sizeof(struct sockaddr_un));
+    if (sizeof(addr->sun_path) <= len) {
+        error("too long socket path %s", path);
+    }
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    *addr_len = sizeof(struct sockaddr_un);
+    return addr;
+#else
+    // FIXME: use struct sockaddr_un, it is 110 bytes and "sun_path" is at offset 2.
+    if (107 < len) {
+        error("too long socket path %s", path);
+    }
+    char* addr = calloc(1, 110);
+    addr[0] = AF_UNIX;
+    memcpy(addr + 2, path, len);
+    *addr_len = 110;
+    return addr;
+#endif
+}
+
+static void ignore_sigpipe(void)
+{
+#ifndef SELFHOST_9MM
+    signal(SIGPIPE, SIG_IGN);
+#else
+    // FIXME: use SIGPIPE and SIG_IGN.
+    signal(13, (void*)1);
+#endif
+}
+
+// Append the data from the descriptor until EOF.
+static void read_all(int fd, Buffer* buf)
+{
+    char chunk[4096];
+    while (1) {
+        size_t size = read(fd, chunk, 4096);
+#ifndef SELFHOST_9MM
+        if ((long)size <= 0) {
+#else
+        if (size <= 0) {
+#endif
+            break;
+        }
+        buf_append(buf, chunk, size);
+    }
+}
+
+// Write the whole data into the descriptor, return 1 if it succeeded.
+int write_all(int fd, char const* data, size_t size)
+{
+    while (0 < size) {
+        size_t written = write(fd, data, size);
+#ifndef SELFHOST_9MM
+        if ((long)written <= 0) {
+#else
+        if (written <= 0) {
+#endif
+            return 0;
+        }
+        data += written;
+        size -= written;
+    }
+    return 1;
+}
+
+static void sleep_ms(size_t ms)
+{
+#ifndef SELFHOST_9MM
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = ms * 1000000;
+    nanosleep(&ts, NULL);
+#else
+    // FIXME: use struct timespec.
+    size_t ts[2];
+    ts[0] = 0;
+    ts[1] = ms * 1000000;
+    nanosleep(ts, NULL);
+#endif
+}
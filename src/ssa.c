@@ -0,0 +1,894 @@
+#include "9mm.h"
+
+#ifndef SELFHOST_9MM
+static void find_promotable_locals(IrFunction const*);
+static void check_address_use(size_t, size_t);
+static void disqualify_local(size_t);
+static void compute_dominators(IrFunction const*);
+static void visit_postorder(BasicBlock*, Vector*);
+static BasicBlock* intersect_doms(BasicBlock*, BasicBlock*);
+static void place_phis(IrFunction const*);
+static void rename_block(BasicBlock*);
+static size_t resolve_vreg(size_t);
+static int is_narrow(size_t, size_t);
+static void eliminate_dead_stores(IrFunction const*);
+static void eliminate_dead_code(IrFunction const*);
+static void mark_live(char*, size_t, int*);
+static int has_side_effect(IrInsn const*);
+static void leave_ssa(IrFunction*);
+static void insert_copies(BasicBlock*, Vector*, Vector*);
+static int has_src(Vector const*, size_t);
+static BasicBlock* split_edge(BasicBlock*, size_t);
+static void coalesce_copies(IrFunction const*);
+static int refers_vreg(IrInsn const*, size_t);
+static IrInsn* new_ssa_insn(int, size_t, size_t, size_t);
+#endif
+
+// Function which is being optimized.
+static IrFunction* ssa_function;
+
+// Local variables which are referred by IR_LOCAL.
+// They are promoted into the virtual registers if they are accessed only by IR_LOAD and IR_STORE of the same size.
+static Map* local_indexes;      // Name -> "index + 1".
+static Vector* local_offsets;   // Offset of the first IR_LOCAL, the others have to refer the same address.
+static Vector* local_sizes;     // Size of the accesses, 0 if it is not accessed yet.
+static Vector* local_promotes;  // 1 if it is promoted.
+static IrInsn const** local_of; // IR_LOCAL which writes the virtual register, NULL otherwise.
+static size_t* addr_local;      // "index + 1" of the promoted local whose address is in the virtual register.
+
+// Dominator tree indexed by "BasicBlock.index".
+static BasicBlock** idoms;
+static size_t* postorder_numbers;
+static char* is_visited;
+static Vector** dom_children;
+static Vector** frontiers;
+
+// Phis which are placed at the head of each block.
+static Vector** block_phis;
+
+// Initial values of the promoted locals which are read before written.
+static Vector* local_inits;
+
+// Virtual registers of the current values of each promoted local while renaming.
+static Vector** local_stacks;
+
+// Virtual register which replaces the result of the removed IR_LOAD, 0 otherwise.
+static size_t* replacements;
+
+// The only instruction which writes the virtual register, NULL otherwise.
+static IrInsn const** single_defs;
+
+// Statistics of the optimizations.
+static size_t count_promoted_locals;
+static size_t count_phis;
+static size_t count_dead_insns;
+static size_t count_dead_stores;
+static size_t count_phi_copies;
+static size_t count_coalesced_copies;
+
+// Promote the scalar locals into the SSA form, remove the dead code and stores,
+// and then replace the phis with the copies in their predecessors.
+void optimize_ir(IrFunction* func)
+{
+    ssa_function = func;
+
+    find_promotable_locals(func);
+    if (local_inits->len != 0) {
+        compute_dominators(func);
+        place_phis(func);
+
+        BasicBlock* entry = func->blocks->data[0];
+        rename_block(entry);
+
+        // Rewrite the uses of the removed loads.
+        for (size_t i = 0; i < func->blocks->len; i++) {
+            BasicBlock* block = func->blocks->data[i];
+            for (size_t j = 0; j < block->insns->len; j++) {
+                IrInsn* insn = block->insns->data[j];
+                insn->lhs = resolve_vreg(insn->lhs);
+                insn->rhs = resolve_vreg(insn->rhs);
+                if (insn->args != NULL && insn->op == IR_CALL) {
+                    for (size_t k = 0; k < insn->args->len; k++) {
+                        insn->args->data[k] = (void*)resolve_vreg((size_t)insn->args->data[k]);
+                    }
+                }
+            }
+        }
+    }
+
+    eliminate_dead_stores(func);
+    eliminate_dead_code(func);
+
+    if (local_inits->len != 0) {
+        // The loops are found only in the functions which have the promoted locals, their counters are the locals.
+        if (optimize_loops(func, idoms)) {
+            eliminate_dead_code(func);
+        }
+
+        leave_ssa(func);
+        coalesce_copies(func);
+
+        free(idoms);
+        free(postorder_numbers);
+        free(dom_children);
+        free(frontiers);
+        free(block_phis);
+        free(local_stacks);
+        free(replacements);
+        free(single_defs);
+    }
+
+    free(local_of);
+    free(addr_local);
+    ssa_function = NULL;
+}
+
+void print_ssa_stats(void)
+{
+    fprintf(stderr, "# ssa: %zd promoted locals, %zd phis, %zd copies, %zd coalesced\n", count_promoted_locals, count_phis, count_phi_copies, count_coalesced_copies);
+    fprintf(stderr, "# ssa: %zd dead instructions, %zd dead stores\n", count_dead_insns, count_dead_stores);
+}
+
+// Find the locals whose addresses are used only by IR_LOAD and IR_STORE of the same size.
+// The local which is accessed at the different offsets like the members of a struct is never promoted.
+static void find_promotable_locals(IrFunction const* func)
+{
+    size_t count_vregs = func->count_vregs + 1;
+    local_indexes = new_map();
+    local_offsets = new_vector();
+    local_sizes = new_vector();
+    local_promotes = new_vector();
+    local_of = calloc(count_vregs, sizeof(IrInsn*));
+    addr_local = calloc(count_vregs, sizeof(size_t));
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->op == IR_LOCAL) {
+                local_of[insn->dst] = insn;
+                size_t index = (size_t)map_get(local_indexes, insn->name);
+                if (index == 0) {
+                    vec_push(local_offsets, (void*)insn->imm);
+                    vec_push(local_sizes, (void*)0);
+                    vec_push(local_promotes, (void*)1);
+                    index = local_sizes->len;
+                    map_put(local_indexes, insn->name, (void*)index);
+                }
+                size_t offset = (size_t)local_offsets->data[index - 1];
+                if (insn->imm != offset) {
+                    disqualify_local(insn->dst);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->op == IR_LOAD || insn->op == IR_STORE) {
+                check_address_use(insn->lhs, insn->imm);
+            } else {
+                disqualify_local(insn->lhs);
+            }
+            disqualify_local(insn->rhs);
+            if (insn->args != NULL) {
+                for (size_t k = 0; k < insn->args->len; k++) {
+                    disqualify_local((size_t)insn->args->data[k]);
+                }
+            }
+        }
+    }
+
+    local_inits = new_vector();
+    for (size_t v = 1; v < count_vregs; v++) {
+        IrInsn const* local = local_of[v];
+        if (local != NULL) {
+            size_t index = (size_t)map_get(local_indexes, local->name);
+            if (local_promotes->data[index - 1] != NULL) {
+                addr_local[v] = index;
+            }
+        }
+    }
+
+    // The promoted locals are numbered again from 0 by the order of local_inits.
+    for (size_t i = 0; i < local_promotes->len; i++) {
+        if (local_promotes->data[i] != NULL) {
+            IrInsn* init = new_ssa_insn(IR_IMM, ++ssa_function->count_vregs, 0, 0);
+            init->imm = 0;
+            local_promotes->data[i] = (void*)(local_inits->len + 1);
+            vec_push(local_inits, init);
+        }
+    }
+    for (size_t v = 1; v < count_vregs; v++) {
+        if (addr_local[v] != 0) {
+            addr_local[v] = (size_t)local_promotes->data[addr_local[v] - 1];
+        }
+    }
+    count_promoted_locals += local_inits->len;
+}
+
+// The address of the local is accessed by "size" bytes.
+static void check_address_use(size_t v, size_t size)
+{
+    if (v == 0 || local_of[v] == NULL) {
+        return;
+    }
+
+    IrInsn const* local = local_of[v];
+    size_t index = (size_t)map_get(local_indexes, local->name);
+    size_t prev_size = (size_t)local_sizes->data[index - 1];
+    if (prev_size == 0) {
+        local_sizes->data[index - 1] = (void*)size;
+    } else if (prev_size != size) {
+        disqualify_local(v);
+    }
+}
+
+// The address of the local escapes if it is used as the value.
+static void disqualify_local(size_t v)
+{
+    if (v == 0 || local_of[v] == NULL) {
+        return;
+    }
+
+    IrInsn const* local = local_of[v];
+    size_t index = (size_t)map_get(local_indexes, local->name);
+    local_promotes->data[index - 1] = NULL;
+}
+
+// Find the immediate dominators by "A Simple, Fast Dominance Algorithm" of Cooper, Harvey and Kennedy,
+// and then the dominance frontiers.
+static void compute_dominators(IrFunction const* func)
+{
+    size_t count_blocks = func->blocks->len;
+    idoms = calloc(count_blocks, sizeof(BasicBlock*));
+    postorder_numbers = calloc(count_blocks, sizeof(size_t));
+    dom_children = calloc(count_blocks, sizeof(Vector*));
+    frontiers = calloc(count_blocks, sizeof(Vector*));
+    for (size_t i = 0; i < count_blocks; i++) {
+        dom_children[i] = new_vector();
+        frontiers[i] = new_vector();
+    }
+
+    Vector* postorder = new_vector();
+    BasicBlock* entry = func->blocks->data[0];
+    is_visited = calloc(count_blocks, 1);
+    visit_postorder(entry, postorder);
+    free(is_visited);
+    for (size_t i = 0; i < postorder->len; i++) {
+        BasicBlock const* block = postorder->data[i];
+        postorder_numbers[block->index] = i;
+    }
+
+    idoms[0] = entry;
+    int is_changed = 1;
+    while (is_changed) {
+        is_changed = 0;
+
+        // Reverse postorder without the entry.
+        for (size_t i = postorder->len - 1; 0 < i; i--) {
+            BasicBlock* block = postorder->data[i - 1];
+            BasicBlock* new_idom = NULL;
+            for (size_t j = 0; j < block->preds->len; j++) {
+                BasicBlock* pred = block->preds->data[j];
+                if (idoms[pred->index] != NULL) {
+                    if (new_idom == NULL) {
+                        new_idom = pred;
+                    } else {
+                        new_idom = intersect_doms(pred, new_idom);
+                    }
+                }
+            }
+            if (idoms[block->index] != new_idom) {
+                idoms[block->index] = new_idom;
+                is_changed = 1;
+            }
+        }
+    }
+
+    for (size_t i = 1; i < count_blocks; i++) {
+        BasicBlock* block = func->blocks->data[i];
+        BasicBlock const* idom = idoms[i];
+        vec_push(dom_children[idom->index], block);
+
+        if (2 <= block->preds->len) {
+            for (size_t j = 0; j < block->preds->len; j++) {
+                BasicBlock const* runner = block->preds->data[j];
+                while (runner != idom) {
+                    Vector* frontier = frontiers[runner->index];
+                    if (frontier->len == 0 || frontier->data[frontier->len - 1] != block) {
+                        vec_push(frontier, block);
+                    }
+                    runner = idoms[runner->index];
+                }
+            }
+        }
+    }
+}
+
+static void visit_postorder(BasicBlock* block, Vector* postorder)
+{
+    is_visited[block->index] = 1;
+    for (size_t i = 0; i < block->succs->len; i++) {
+        BasicBlock* succ = block->succs->data[i];
+        if (!is_visited[succ->index]) {
+            visit_postorder(succ, postorder);
+        }
+    }
+    vec_push(postorder, block);
+}
+
+static BasicBlock* intersect_doms(BasicBlock* b1, BasicBlock* b2)
+{
+    while (b1 != b2) {
+        while (postorder_numbers[b1->index] < postorder_numbers[b2->index]) {
+            b1 = idoms[b1->index];
+        }
+        while (postorder_numbers[b2->index] < postorder_numbers[b1->index]) {
+            b2 = idoms[b2->index];
+        }
+    }
+    return b1;
+}
+
+// Place the phis of each promoted local at the iterated dominance frontier of its stores.
+static void place_phis(IrFunction const* func)
+{
+    size_t count_blocks = func->blocks->len;
+    block_phis = calloc(count_blocks, sizeof(Vector*));
+    for (size_t i = 0; i < count_blocks; i++) {
+        block_phis[i] = new_vector();
+    }
+
+    // The local index + 1 which has been processed for each block.
+    size_t* has_phi = calloc(count_blocks, sizeof(size_t));
+    size_t* is_queued = calloc(count_blocks, sizeof(size_t));
+
+    for (size_t local = 1; local <= local_inits->len; local++) {
+        Vector* worklist = new_vector();
+        for (size_t i = 0; i < count_blocks; i++) {
+            BasicBlock* block = func->blocks->data[i];
+            for (size_t j = 0; j < block->insns->len; j++) {
+                IrInsn const* insn = block->insns->data[j];
+                if (insn->op == IR_STORE && addr_local[insn->lhs] == local && is_queued[i] != local) {
+                    is_queued[i] = local;
+                    vec_push(worklist, block);
+                }
+            }
+        }
+
+        while (worklist->len != 0) {
+            BasicBlock const* block = worklist->data[--worklist->len];
+            Vector const* frontier = frontiers[block->index];
+            for (size_t i = 0; i < frontier->len; i++) {
+                BasicBlock* target = frontier->data[i];
+                if (has_phi[target->index] != local) {
+                    has_phi[target->index] = local;
+
+                    IrInsn* phi = new_ssa_insn(IR_PHI, ++ssa_function->count_vregs, 0, 0);
+                    phi->imm = local - 1;
+                    phi->args = new_vector();
+                    for (size_t j = 0; j < target->preds->len; j++) {
+                        vec_push(phi->args, (void*)0);
+                    }
+                    vec_push(block_phis[target->index], phi);
+                    ++count_phis;
+
+                    if (is_queued[target->index] != local) {
+                        is_queued[target->index] = local;
+                        vec_push(worklist, target);
+                    }
+                }
+            }
+        }
+    }
+
+    free(has_phi);
+    free(is_queued);
+
+    // Each store makes one new virtual register.
+    size_t count_vregs = ssa_function->count_vregs + 1;
+    for (size_t i = 0; i < count_blocks; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        count_vregs += block->insns->len;
+    }
+    replacements = calloc(count_vregs, sizeof(size_t));
+    single_defs = calloc(count_vregs, sizeof(IrInsn*));
+
+    size_t* count_defs = calloc(count_vregs, sizeof(size_t));
+    for (size_t i = 0; i < count_blocks; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->dst != 0) {
+                ++count_defs[insn->dst];
+                single_defs[insn->dst] = insn;
+            }
+        }
+    }
+    for (size_t v = 1; v < count_vregs; v++) {
+        if (count_defs[v] != 1) {
+            single_defs[v] = NULL;
+        }
+    }
+    free(count_defs);
+
+    local_stacks = calloc(local_inits->len, sizeof(Vector*));
+    for (size_t i = 0; i < local_inits->len; i++) {
+        IrInsn const* init = local_inits->data[i];
+        local_stacks[i] = new_vector();
+        vec_push(local_stacks[i], (void*)init->dst);
+        single_defs[init->dst] = init;
+    }
+}
+
+// Replace the loads and the stores of the promoted locals with their current values in the dominator tree order.
+static void rename_block(BasicBlock* block)
+{
+    Vector* insns = new_vector();
+    Vector* pushed = new_vector();
+
+    if (block->index == 0) {
+        for (size_t i = 0; i < local_inits->len; i++) {
+            vec_push(insns, local_inits->data[i]);
+        }
+    }
+
+    Vector const* phis = block_phis[block->index];
+    for (size_t i = 0; i < phis->len; i++) {
+        IrInsn const* phi = phis->data[i];
+        vec_push(insns, (void*)phi);
+        vec_push(local_stacks[phi->imm], (void*)phi->dst);
+        vec_push(pushed, (void*)phi->imm);
+    }
+
+    for (size_t i = 0; i < block->insns->len; i++) {
+        IrInsn* insn = block->insns->data[i];
+        int op = insn->op;
+        size_t local = 0;
+        if (op == IR_LOAD || op == IR_STORE) {
+            local = addr_local[insn->lhs];
+        }
+
+        if (op == IR_LOCAL && addr_local[insn->dst] != 0) {
+            // The address is not used anymore.
+        } else if (local != 0 && op == IR_LOAD) {
+            Vector const* stack = local_stacks[local - 1];
+            replacements[insn->dst] = (size_t)stack->data[stack->len - 1];
+        } else if (local != 0) {
+            // The value itself becomes the current value of the local if it does not have to be truncated.
+            // The narrow store truncates the value as well as the memory.
+            size_t value = resolve_vreg(insn->rhs);
+            if (single_defs[value] == NULL || !is_narrow(value, insn->imm)) {
+                IrInsn* mov = new_ssa_insn(IR_MOV, ++ssa_function->count_vregs, value, 0);
+                if (!is_narrow(value, insn->imm)) {
+                    mov->imm = insn->imm;
+                }
+                single_defs[mov->dst] = mov;
+                vec_push(insns, mov);
+                value = mov->dst;
+            }
+            vec_push(local_stacks[local - 1], (void*)value);
+            vec_push(pushed, (void*)(local - 1));
+        } else {
+            vec_push(insns, insn);
+        }
+    }
+    block->insns = insns;
+
+    for (size_t i = 0; i < block->succs->len; i++) {
+        BasicBlock const* succ = block->succs->data[i];
+        size_t k = 0;
+        while (succ->preds->data[k] != block) {
+            ++k;
+        }
+
+        Vector const* succ_phis = block_phis[succ->index];
+        for (size_t j = 0; j < succ_phis->len; j++) {
+            IrInsn* phi = succ_phis->data[j];
+            Vector const* stack = local_stacks[phi->imm];
+            phi->args->data[k] = stack->data[stack->len - 1];
+        }
+    }
+
+    Vector const* children = dom_children[block->index];
+    for (size_t i = 0; i < children->len; i++) {
+        rename_block(children->data[i]);
+    }
+
+    for (size_t i = 0; i < pushed->len; i++) {
+        size_t local = (size_t)pushed->data[i];
+        local_stacks[local]->len--;
+    }
+}
+
+static size_t resolve_vreg(size_t v)
+{
+    while (replacements[v] != 0) {
+        v = replacements[v];
+    }
+    return v;
+}
+
+// Return 1 if the value fits in "size" bytes without the sign extension, so it does not have to be truncated.
+static int is_narrow(size_t v, size_t size)
+{
+    if (size == 8) {
+        return 1;
+    }
+
+    IrInsn const* def = single_defs[v];
+    if (def == NULL) {
+        return 0;
+    }
+
+    int op = def->op;
+    if (op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE || op == IR_NOT) {
+        return 1;
+    }
+    if (op == IR_LOAD || op == IR_MOV) {
+        return def->imm != 0 && def->imm <= size;
+    }
+    if (op != IR_IMM) {
+        return 0;
+    }
+
+#ifndef SELFHOST_9MM
+    long n = (long)def->imm;
+#else
+    size_t n = def->imm;
+#endif
+    if (size == 1) {
+        return 0 <= n && n <= 255;
+    }
+    return 0 <= n && n <= 4294967295;
+}
+
+// Remove the stores to the locals which are overwritten in the same block before they are read.
+// Any load or call may read them through the pointers.
+static void eliminate_dead_stores(IrFunction const* func)
+{
+    IrInsn const** locals = calloc(func->count_vregs + 1, sizeof(IrInsn*));
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            if (insn->op == IR_LOCAL) {
+                locals[insn->dst] = insn;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock* block = func->blocks->data[i];
+        Vector* later_stores = new_vector();
+        Vector* insns = new_vector();
+        size_t count_dead = 0;
+
+        for (size_t j = block->insns->len; 0 < j; j--) {
+            IrInsn* insn = block->insns->data[j - 1];
+            int is_dead = 0;
+            if (insn->op == IR_STORE && locals[insn->lhs] != NULL) {
+                IrInsn const* local = locals[insn->lhs];
+                for (size_t k = 0; k < later_stores->len; k++) {
+                    IrInsn const* later = later_stores->data[k];
+                    IrInsn const* later_local = locals[later->lhs];
+                    if (later_local->imm == local->imm && insn->imm <= later->imm) {
+                        is_dead = 1;
+                    }
+                }
+                if (!is_dead) {
+                    vec_push(later_stores, insn);
+                }
+            } else if (insn->op == IR_LOAD || insn->op == IR_CALL) {
+                later_stores->len = 0;
+            }
+
+            if (is_dead) {
+                ++count_dead;
+            } else {
+                vec_push(insns, insn);
+            }
+        }
+
+        if (count_dead != 0) {
+            // The instructions were collected backward.
+            for (size_t j = 0; j < insns->len; j++) {
+                block->insns->data[j] = insns->data[insns->len - 1 - j];
+            }
+            block->insns->len = insns->len;
+            count_dead_stores += count_dead;
+        }
+    }
+
+    free(locals);
+}
+
+// Remove the instructions whose results are never used by the instructions which have side effects.
+// The unused phis which refer each other in the loops are removed as well.
+static void eliminate_dead_code(IrFunction const* func)
+{
+    char* is_live = calloc(func->count_vregs + 1, 1);
+
+    int is_changed = 1;
+    while (is_changed) {
+        is_changed = 0;
+        for (size_t i = func->blocks->len; 0 < i; i--) {
+            BasicBlock const* block = func->blocks->data[i - 1];
+            for (size_t j = block->insns->len; 0 < j; j--) {
+                IrInsn const* insn = block->insns->data[j - 1];
+                if (has_side_effect(insn) || is_live[insn->dst]) {
+                    mark_live(is_live, insn->lhs, &is_changed);
+                    mark_live(is_live, insn->rhs, &is_changed);
+                    if (insn->args != NULL) {
+                        for (size_t k = 0; k < insn->args->len; k++) {
+                            mark_live(is_live, (size_t)insn->args->data[k], &is_changed);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        Vector* insns = block->insns;
+        size_t len = 0;
+        for (size_t j = 0; j < insns->len; j++) {
+            IrInsn const* insn = insns->data[j];
+            if (has_side_effect(insn) || is_live[insn->dst]) {
+                insns->data[len++] = insns->data[j];
+            } else if (insn->op != IR_PHI) {
+                ++count_dead_insns;
+            }
+        }
+        insns->len = len;
+    }
+
+    free(is_live);
+}
+
+static void mark_live(char* is_live, size_t v, int* is_changed)
+{
+    if (v != 0 && !is_live[v]) {
+        is_live[v] = 1;
+        *is_changed = 1;
+    }
+}
+
+// The division is kept to fail at runtime by zero.
+static int has_side_effect(IrInsn const* insn)
+{
+    int op = insn->op;
+    return op == IR_STORE || op == IR_CALL || op == IR_RET || op == IR_JMP || op == IR_BR || op == IR_DIV;
+}
+
+// Replace each phi with the copies at the tails of its predecessors.
+// The critical edges are split, so the copies never run on the other paths.
+static void leave_ssa(IrFunction* func)
+{
+    Vector* blocks = new_vector();
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock* block = func->blocks->data[i];
+        size_t count_block_phis = 0;
+        while (count_block_phis < block->insns->len) {
+            IrInsn const* insn = block->insns->data[count_block_phis];
+            if (insn->op != IR_PHI) {
+                break;
+            }
+            ++count_block_phis;
+        }
+
+        if (count_block_phis != 0) {
+            for (size_t k = 0; k < block->preds->len; k++) {
+                BasicBlock* pred = block->preds->data[k];
+                if (1 < pred->succs->len) {
+                    pred = split_edge(block, k);
+                    // The split block falls through into the block.
+                    vec_push(blocks, pred);
+                }
+
+                Vector* dsts = new_vector();
+                Vector* srcs = new_vector();
+                for (size_t j = 0; j < count_block_phis; j++) {
+                    IrInsn const* phi = block->insns->data[j];
+                    size_t src = (size_t)phi->args->data[k];
+                    if (src != phi->dst) {
+                        vec_push(dsts, (void*)phi->dst);
+                        vec_push(srcs, (void*)src);
+                    }
+                }
+                insert_copies(pred, dsts, srcs);
+            }
+
+            Vector* insns = block->insns;
+            for (size_t j = count_block_phis; j < insns->len; j++) {
+                insns->data[j - count_block_phis] = insns->data[j];
+            }
+            insns->len -= count_block_phis;
+        }
+
+        vec_push(blocks, block);
+    }
+
+    for (size_t i = 0; i < blocks->len; i++) {
+        BasicBlock* block = blocks->data[i];
+        block->index = i;
+    }
+    func->blocks = blocks;
+}
+
+// Insert the parallel copies "dsts[i] = srcs[i]" before the terminator of the block.
+// A phi can be the argument of another phi in the same block, so the copy which overwrites
+// the source of the others waits for them, and the cycle like a swap is broken by a temporary.
+static void insert_copies(BasicBlock* block, Vector* dsts, Vector* srcs)
+{
+    Vector* insns = block->insns;
+    IrInsn* last = insns->data[--insns->len];
+
+    while (dsts->len != 0) {
+        size_t ready = dsts->len;
+        for (size_t i = 0; i < dsts->len; i++) {
+            if (ready == dsts->len && !has_src(srcs, (size_t)dsts->data[i])) {
+                ready = i;
+            }
+        }
+
+        if (ready == dsts->len) {
+            // Save the destination of the first copy and read the saved one instead.
+            size_t dst = (size_t)dsts->data[0];
+            size_t tmp = ++ssa_function->count_vregs;
+            vec_push(insns, new_ssa_insn(IR_MOV, tmp, dst, 0));
+            for (size_t i = 0; i < srcs->len; i++) {
+                if ((size_t)srcs->data[i] == dst) {
+                    srcs->data[i] = (void*)tmp;
+                }
+            }
+        } else {
+            size_t dst = (size_t)dsts->data[ready];
+            size_t src = (size_t)srcs->data[ready];
+            vec_push(insns, new_ssa_insn(IR_MOV, dst, src, 0));
+            ++count_phi_copies;
+
+            dsts->data[ready] = dsts->data[dsts->len - 1];
+            srcs->data[ready] = srcs->data[srcs->len - 1];
+            dsts->len--;
+            srcs->len--;
+        }
+    }
+
+    vec_push(insns, last);
+}
+
+static int has_src(Vector const* srcs, size_t v)
+{
+    for (size_t i = 0; i < srcs->len; i++) {
+        if ((size_t)srcs->data[i] == v) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Insert the new block on the edge from the k-th predecessor to the block.
+static BasicBlock* split_edge(BasicBlock* block, size_t k)
+{
+    BasicBlock* pred = block->preds->data[k];
+    BasicBlock* split = new_block();
+    split->is_reachable = 1;
+
+    IrInsn* jump = new_ssa_insn(IR_JMP, 0, 0, 0);
+    jump->then_block = block;
+    vec_push(split->insns, jump);
+
+    IrInsn* last = pred->insns->data[pred->insns->len - 1];
+    if (last->then_block == block) {
+        last->then_block = split;
+    }
+    if (last->else_block == block) {
+        last->else_block = split;
+    }
+
+    for (size_t i = 0; i < pred->succs->len; i++) {
+        if (pred->succs->data[i] == block) {
+            pred->succs->data[i] = split;
+        }
+    }
+    block->preds->data[k] = split;
+    vec_push(split->preds, pred);
+    vec_push(split->succs, block);
+
+    return split;
+}
+
+// "s = op ..." + "d = mov s" -> "d = op ..." if s is used only by the copy in the same block
+// and d is not referred between them.
+static void coalesce_copies(IrFunction const* func)
+{
+    size_t count_vregs = func->count_vregs + 1;
+    size_t* count_defs = calloc(count_vregs, sizeof(size_t));
+    size_t* count_uses = calloc(count_vregs, sizeof(size_t));
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        for (size_t j = 0; j < block->insns->len; j++) {
+            IrInsn const* insn = block->insns->data[j];
+            ++count_defs[insn->dst];
+            ++count_uses[insn->lhs];
+            ++count_uses[insn->rhs];
+            if (insn->args != NULL) {
+                for (size_t k = 0; k < insn->args->len; k++) {
+                    ++count_uses[(size_t)insn->args->data[k]];
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < func->blocks->len; i++) {
+        BasicBlock const* block = func->blocks->data[i];
+        Vector* insns = block->insns;
+        size_t len = 0;
+        for (size_t j = 0; j < insns->len; j++) {
+            IrInsn* insn = insns->data[j];
+            size_t src = insn->lhs;
+            int is_coalesced = 0;
+            if (insn->op == IR_MOV && insn->imm == 0 && count_defs[src] == 1 && count_uses[src] == 1) {
+                // Find the definition of src among the kept instructions.
+                size_t k = len;
+                int is_referred = 0;
+                while (0 < k && !is_coalesced && !is_referred) {
+                    IrInsn* def = insns->data[k - 1];
+                    if (def->dst == src) {
+                        def->dst = insn->dst;
+                        is_coalesced = 1;
+                    } else if (refers_vreg(def, insn->dst)) {
+                        is_referred = 1;
+                    }
+                    --k;
+                }
+            }
+
+            if (is_coalesced) {
+                ++count_coalesced_copies;
+            } else {
+                insns->data[len++] = insn;
+            }
+        }
+        insns->len = len;
+    }
+
+    free(count_defs);
+    free(count_uses);
+}
+
+static int refers_vreg(IrInsn const* insn, size_t v)
+{
+    if (insn->dst == v || insn->lhs == v || insn->rhs == v) {
+        return 1;
+    }
+    if (insn->args != NULL) {
+        for (size_t i = 0; i < insn->args->len; i++) {
+            if ((size_t)insn->args->data[i] == v) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static IrInsn* new_ssa_insn(int op, size_t dst, size_t lhs, size_t rhs)
+{
+    IrInsn* insn = arena_alloc(ir_arena, sizeof(IrInsn));
+    insn->op = op;
+    insn->dst = dst;
+    insn->lhs = lhs;
+    insn->rhs = rhs;
+    insn->imm = 0;
+    insn->name = NULL;
+    insn->args = NULL;
+    insn->then_block = NULL;
+    insn->else_block = NULL;
+    return insn;
+}
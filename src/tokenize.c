@@ -1,119 +1,100 @@
 #include "9mm.h"
 
+// Character classes to dispatch tokenizing by the first character.
+enum {
+    CC_OTHER,
+    CC_SPACE,
+    CC_IDENT,
+    CC_DIGIT,
+    CC_PUNCT,
+    CC_QUOTE,
+    CC_APOSTROPHE
+};
+
 #ifndef SELFHOST_9MM
-static int is_eq(char const*, char const*);
+static void init_lexer(void);
+static void put_keyword(char const*, int);
+static int char_class(char);
+static size_t find_keyword_slot(char const*, size_t);
+static int find_keyword(char const*, size_t);
+static int lex_punct(char const*);
 static Token* new_token(int, char const*);
 static char const* skip(char const*);
-static int is_alnum(char);
+static char const* skip_spaces(char const*);
+static char const* find_either(char const*, char, char);
 #endif
 
+// Character -> its class.
+// "char" is signed in gcc and unsigned in 9mm, so it is indexed by "c + 128" to cover the both.
+static char char_classes[384];
+
+// Keyword table indexed by perfect hash, see find_keyword.
+static char const* keyword_names[21];
+static int keyword_types[21];
+
+static int is_lexer_ready;
+
+// The fastest implementation of skip which the CPU supports.
+static int max_scan_level;
+
+// The implementation of skip in use.
+static int scan_level;
+
 Vector const* tokenize(char const* p)
 {
+    if (!is_lexer_ready) {
+        init_lexer();
+    }
+
     Vector* tokens = new_vector();
 
     while (*p) {
         p = skip(p);
 
         Token* token = NULL;
+        int cls = char_class(*p);
         if (*p == '\0') {
             break;
-        } else if (is_eq(p, "extern")) {
-            token = new_token(TK_EXTERN, p);
-            p += 6;
-        } else if (is_eq(p, "typedef")) {
-            token = new_token(TK_TYPEDEF, p);
-            p += 7;
-        } else if (is_eq(p, "enum ")) {
-            token = new_token(TK_ENUM, p);
-            p += 4;
-        } else if (is_eq(p, "break;")) {
-            token = new_token(TK_BREAK, p);
-            p += 5;
-        } else if (is_eq(p, "+=")) {
-            token = new_token(TK_ADD_ASIGN, p);
-            p += 2;
-        } else if (is_eq(p, "-=")) {
-            token = new_token(TK_SUB_ASIGN, p);
-            p += 2;
-        } else if (is_eq(p, "*=")) {
-            token = new_token(TK_MUL_ASIGN, p);
-            p += 2;
-        } else if (is_eq(p, "/=")) {
-            token = new_token(TK_DIV_ASIGN, p);
-            p += 2;
-        } else if (is_eq(p, "->")) {
-            token = new_token(TK_ARROW, p);
-            p += 2;
-        } else if (is_eq(p, "struct")) {
-            token = new_token(TK_STRUCT, p);
-            p += 6;
-        } else if (is_eq(p, "||")) {
-            token = new_token(TK_OR, p);
-            p += 2;
-        } else if (is_eq(p, "&&")) {
-            token = new_token(TK_AND, p);
-            p += 2;
-        } else if (is_eq(p, "++")) {
-            token = new_token(TK_INCL, p);
-            p += 2;
-        } else if (is_eq(p, "--")) {
-            token = new_token(TK_DECL, p);
-            p += 2;
-        } else if (*p == '"') {
+        } else if (cls == CC_IDENT) {
+            // Find the identifier and check it is keyword or not.
+            char const* name = p;
+            while (char_class(*p) == CC_IDENT || char_class(*p) == CC_DIGIT) {
+                ++p;
+            }
+
+            size_t n = p - name;
+            int ty = find_keyword(name, n);
+            if (ty != 0) {
+                token = new_token(ty, name);
+            } else {
+                token = new_token(TK_IDENT, name);
+                token->name = intern_n(name, n);
+            }
+        } else if (cls == CC_PUNCT) {
+            int ty = lex_punct(p);
+            if (ty != 0) {
+                token = new_token(ty, p);
+
+                // All the tokens which consist of two characters have TK_* type.
+                if (ty < 256) {
+                    ++p;
+                } else {
+                    p += 2;
+                }
+            }
+        } else if (cls == CC_QUOTE) {
             // Read string literal.
             char const* str_begin = p++;
             while (*p != '"') {
                 ++p;
             }
             token = new_token(TK_STR, str_begin);
-            token->name = strndup(str_begin, p - str_begin + 1);
-            ++p;
-        } else if (is_eq(p, "sizeof")) {
-            token = new_token(TK_SIZEOF, p);
-            p += 6;
-        } else if (is_eq(p, "return") && !is_alnum(p[6])) {
-            token = new_token(TK_RETURN, p);
-            p += 6;
-        } else if (is_eq(p, "if") && !is_alnum(p[2])) {
-            token = new_token(TK_IF, p);
-            p += 2;
-        } else if (is_eq(p, "else") && !is_alnum(p[4])) {
-            token = new_token(TK_ELSE, p);
-            p += 4;
-        } else if (is_eq(p, "while") && !is_alnum(p[5])) {
-            token = new_token(TK_WHILE, p);
-            p += 5;
-        } else if (is_eq(p, "for") && !is_alnum(p[3])) {
-            token = new_token(TK_FOR, p);
-            p += 3;
-        } else if (is_eq(p, "==")) {
-            token = new_token(TK_EQ, p);
-            p += 2;
-        } else if (is_eq(p, "!=")) {
-            token = new_token(TK_NE, p);
-            p += 2;
-        } else if (is_eq(p, "<=")) {
-            token = new_token(TK_LE, p);
-            p += 2;
-        } else if (is_eq(p, ">=")) {
-            token = new_token(TK_GE, p);
-            p += 2;
-        } else if (*p == '+' || *p == '-' ||
-                   *p == '*' || *p == '/' ||
-                   *p == '(' || *p == ')' ||
-                   *p == '<' || *p == '>' ||
-                   *p == ';' || *p == '=' ||
-                   *p == '{' || *p == '}' ||
-                   *p == ',' || *p == '&' ||
-                   *p == '[' || *p == ']' ||
-                   *p == '.' || *p == '!') {
-            token = new_token(*p, p);
+            token->name = intern_n(str_begin, p - str_begin + 1);
             ++p;
-        } else if (isdigit(*p)) {
+        } else if (cls == CC_DIGIT) {
             token = new_token(TK_NUM, p);
             token->val = strtol(p, (char**)&p, 10);
-        } else if (*p == 39) {
-            // 39 == '\''
+        } else if (cls == CC_APOSTROPHE) {
             token = new_token(TK_NUM, p);
             ++p;
             if (*p == 92) {
@@ -128,18 +109,6 @@ Vector const* tokenize(char const* p)
                 token->val = *p;
             }
             p += 2;
-        } else {
-            // Find the variable name.
-            char const* name = p;
-            while (is_alnum(*p)) {
-                ++p;
-            }
-
-            if (name != p) {
-                size_t n = p - name;
-                token = new_token(TK_IDENT, name);
-                token->name = strndup(name, n);
-            }
         }
 
         if (token == NULL) {
@@ -154,14 +123,156 @@ Vector const* tokenize(char const* p)
     return tokens;
 }
 
-static int is_eq(char const* p, char const* q)
+static void put_keyword(char const* name, int ty)
 {
-    return strncmp(p, q, strlen(q)) == 0;
+    size_t h = find_keyword_slot(name, strlen(name));
+    if (keyword_names[h] != NULL) {
+        error("keyword hash collision: %s", name);
+    }
+    keyword_names[h] = name;
+    keyword_types[h] = ty;
+}
+
+static void init_lexer(void)
+{
+    for (int c = 'a'; c <= 'z'; c++) {
+        char_classes[c + 128] = CC_IDENT;
+    }
+    for (int c = 'A'; c <= 'Z'; c++) {
+        char_classes[c + 128] = CC_IDENT;
+    }
+    char_classes['_' + 128] = CC_IDENT;
+
+    for (int c = '0'; c <= '9'; c++) {
+        char_classes[c + 128] = CC_DIGIT;
+    }
+
+    char const* puncts = "+-*/()<>;={},&[].!|";
+    for (size_t i = 0; puncts[i] != '\0'; i++) {
+        char_classes[puncts[i] + 128] = CC_PUNCT;
+    }
+
+    for (int c = 1; c < 128; c++) {
+        if (isspace(c)) {
+            char_classes[c + 128] = CC_SPACE;
+        }
+    }
+
+    char_classes['"' + 128] = CC_QUOTE;
+    char_classes[39 + 128] = CC_APOSTROPHE;
+
+    put_keyword("if", TK_IF);
+    put_keyword("else", TK_ELSE);
+    put_keyword("while", TK_WHILE);
+    put_keyword("for", TK_FOR);
+    put_keyword("return", TK_RETURN);
+    put_keyword("break", TK_BREAK);
+    put_keyword("sizeof", TK_SIZEOF);
+    put_keyword("struct", TK_STRUCT);
+    put_keyword("enum", TK_ENUM);
+    put_keyword("typedef", TK_TYPEDEF);
+    put_keyword("extern", TK_EXTERN);
+
+#ifndef SELFHOST_9MM
+    // SSE2 is always available on x86-64.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        max_scan_level = SCAN_AVX2;
+    } else {
+        max_scan_level = SCAN_SSE2;
+    }
+#endif
+    scan_level = max_scan_level;
+
+    is_lexer_ready = 1;
+}
+
+// Select the implementation of skip and return the selected one.
+// It falls back to the fastest one which is supported if the given one is not.
+int set_scan_level(int level)
+{
+    if (!is_lexer_ready) {
+        init_lexer();
+    }
+
+    if (max_scan_level < level) {
+        level = max_scan_level;
+    }
+    scan_level = level;
+
+    return level;
+}
+
+static int char_class(char c)
+{
+    return char_classes[c + 128];
+}
+
+// Perfect hash of the keywords.
+// It is collision-free for the keywords, put_keyword checks it.
+static size_t find_keyword_slot(char const* name, size_t len)
+{
+    size_t h = name[0] * 7 + name[len - 1] + len;
+    return h - h / 21 * 21;
+}
+
+// Return the token type if the given identifier is keyword, otherwise return 0.
+static int find_keyword(char const* name, size_t len)
+{
+    size_t h = find_keyword_slot(name, len);
+    char const* keyword = keyword_names[h];
+    if (keyword != NULL && strncmp(keyword, name, len) == 0 && keyword[len] == '\0') {
+        return keyword_types[h];
+    }
+    return 0;
+}
+
+// Return the token type of the punctuator at the given position, or 0 if it is invalid.
+static int lex_punct(char const* p)
+{
+    char c = p[0];
+    char next = p[1];
+
+    if (next == '=') {
+        if (c == '+') {
+            return TK_ADD_ASIGN;
+        } else if (c == '-') {
+            return TK_SUB_ASIGN;
+        } else if (c == '*') {
+            return TK_MUL_ASIGN;
+        } else if (c == '/') {
+            return TK_DIV_ASIGN;
+        } else if (c == '=') {
+            return TK_EQ;
+        } else if (c == '!') {
+            return TK_NE;
+        } else if (c == '<') {
+            return TK_LE;
+        } else if (c == '>') {
+            return TK_GE;
+        }
+    }
+
+    if (c == '-' && next == '>') {
+        return TK_ARROW;
+    } else if (c == '+' && next == '+') {
+        return TK_INCL;
+    } else if (c == '-' && next == '-') {
+        return TK_DECL;
+    } else if (c == '&' && next == '&') {
+        return TK_AND;
+    } else if (c == '|' && next == '|') {
+        return TK_OR;
+    } else if (c == '|') {
+        return 0;
+    }
+
+    return c;
 }
 
 static Token* new_token(int ty, char const* p)
 {
-    Token* token = malloc(sizeof(Token));
+    Token* token = arena_alloc(token_arena, sizeof(Token));
     token->ty = ty;
     token->input = p;
 
@@ -170,23 +281,26 @@ static Token* new_token(int ty, char const* p)
 
 static char const* skip(char const* p)
 {
-    while (*p) {
-        if (isspace(*p)) {
-            // Skip space.
-            ++p;
-        } else if (strncmp(p, "//", 2) == 0) {
+    while (1) {
+        p = skip_spaces(p);
+
+        if (p[0] == '/' && p[1] == '/') {
             // Skip line comment.
-            p += 2;
-            while (*p != '\n') {
-                ++p;
-            }
-        } else if (strncmp(p, "/*", 2) == 0) {
-            // Skip block comment.
-            char* q = strstr(p + 2, "*/");
-            if (!q) {
-                error_at(p, "The comment is NOT closed.");
+            p = find_either(p + 2, '\n', '\0');
+        } else if (p[0] == '/' && p[1] == '*') {
+            // Skip block comment by finding "/" after "*".
+            char const* q = p + 2;
+            while (1) {
+                if (*q == '\0') {
+                    error_at(p, "The comment is NOT closed.");
+                }
+
+                q = find_either(q + 1, '/', '\0');
+                if (*q == '/' && q[-1] == '*') {
+                    break;
+                }
             }
-            p = q + 2;
+            p = q + 1;
         } else {
             break;
         }
@@ -195,10 +309,151 @@ static char const* skip(char const* p)
     return p;
 }
 
-static int is_alnum(char c)
+#ifndef SELFHOST_9MM
+// The vectorized scanners below use only aligned loads.
+// An aligned load never crosses a page boundary, so it is safe to read beyond the terminator,
+// but AddressSanitizer reports the bytes past the allocation, so they are not instrumented.
+
+// Return the mask of bytes which are not space, see isspace.
+__attribute__((no_sanitize_address)) static unsigned non_space_mask_sse2(char const* block)
+{
+    __m128i v = _mm_load_si128((__m128i const*)block);
+    __m128i is_blank = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+
+    // '\t', '\n', '\v', '\f' and '\r' are in [9, 13].
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(9));
+    __m128i is_ctrl = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+
+    return ~_mm_movemask_epi8(_mm_or_si128(is_blank, is_ctrl)) & 0xffff;
+}
+
+__attribute__((no_sanitize_address)) static char const* skip_spaces_sse2(char const* p)
+{
+    size_t offset = (uintptr_t)p & 15;
+    char const* block = p - offset;
+
+    unsigned mask = non_space_mask_sse2(block) & (~0u << offset);
+    while (mask == 0) {
+        block += 16;
+        mask = non_space_mask_sse2(block);
+    }
+
+    return block + __builtin_ctz(mask);
+}
+
+__attribute__((no_sanitize_address)) static unsigned either_mask_sse2(char const* block, char a, char b)
+{
+    __m128i v = _mm_load_si128((__m128i const*)block);
+    __m128i is_a = _mm_cmpeq_epi8(v, _mm_set1_epi8(a));
+    __m128i is_b = _mm_cmpeq_epi8(v, _mm_set1_epi8(b));
+
+    return _mm_movemask_epi8(_mm_or_si128(is_a, is_b));
+}
+
+__attribute__((no_sanitize_address)) static char const* find_either_sse2(char const* p, char a, char b)
+{
+    size_t offset = (uintptr_t)p & 15;
+    char const* block = p - offset;
+
+    unsigned mask = either_mask_sse2(block, a, b) & (~0u << offset);
+    while (mask == 0) {
+        block += 16;
+        mask = either_mask_sse2(block, a, b);
+    }
+
+    return block + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) static unsigned non_space_mask_avx2(char const* block)
+{
+    __m256i v = _mm256_load_si256((__m256i const*)block);
+    __m256i is_blank = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+
+    // '\t', '\n', '\v', '\f' and '\r' are in [9, 13].
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+    __m256i is_ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+
+    return ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(is_blank, is_ctrl));
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) static char const* skip_spaces_avx2(char const* p)
+{
+    size_t offset = (uintptr_t)p & 31;
+    char const* block = p - offset;
+
+    unsigned mask = non_space_mask_avx2(block) & (~0u << offset);
+    while (mask == 0) {
+        block += 32;
+        mask = non_space_mask_avx2(block);
+    }
+
+    return block + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) static unsigned either_mask_avx2(char const* block, char a, char b)
+{
+    __m256i v = _mm256_load_si256((__m256i const*)block);
+    __m256i is_a = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(a));
+    __m256i is_b = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b));
+
+    return _mm256_movemask_epi8(_mm256_or_si256(is_a, is_b));
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) static char const* find_either_avx2(char const* p, char a, char b)
+{
+    size_t offset = (uintptr_t)p & 31;
+    char const* block = p - offset;
+
+    unsigned mask = either_mask_avx2(block, a, b) & (~0u << offset);
+    while (mask == 0) {
+        block += 32;
+        mask = either_mask_avx2(block, a, b);
+    }
+
+    return block + __builtin_ctz(mask);
+}
+#endif
+
+// Return the first character which is not space.
+static char const* skip_spaces(char const* p)
+{
+    // Most tokens are separated by a space at most.
+    if (char_class(*p) != CC_SPACE || char_class(p[1]) != CC_SPACE) {
+        if (char_class(*p) == CC_SPACE) {
+            ++p;
+        }
+        return p;
+    }
+
+#ifndef SELFHOST_9MM
+    if (scan_level == SCAN_AVX2) {
+        return skip_spaces_avx2(p);
+    } else if (scan_level == SCAN_SSE2) {
+        return skip_spaces_sse2(p);
+    }
+#endif
+
+    while (char_class(*p) == CC_SPACE) {
+        ++p;
+    }
+
+    return p;
+}
+
+// Return the first character which is a or b.
+static char const* find_either(char const* p, char a, char b)
 {
-    return ('a' <= c && c <= 'z') ||
-           ('A' <= c && c <= 'Z') ||
-           ('0' <= c && c <= '9') ||
-           (c == '_');
+#ifndef SELFHOST_9MM
+    if (scan_level == SCAN_AVX2) {
+        return find_either_avx2(p, a, b);
+    } else if (scan_level == SCAN_SSE2) {
+        return find_either_sse2(p, a, b);
+    }
+#endif
+
+    while (*p != a && *p != b) {
+        ++p;
+    }
+
+    return p;
 }
@@ -1,19 +1,21 @@
-##!/bin/bash
+#!/bin/bash
 
 TEST_TARGET=$1
 
-try() {
+# Run the compile command, link its outputs with the test library, and check the exit code of the program.
+try_command() {
     expected="$1"
-    input="$2"
+    command="$2"
+    outputs="$3"
 
-    echo "$TEST_TARGET --str '$input'"
-    $TEST_TARGET --str "$input" >tmp.s
-    if [[ "$?" != "0" ]]; then
+    echo "$command"
+    rm -f $outputs
+    if ! eval "$command"; then
         echo 'Compilation error'
         exit 1
     fi
 
-    gcc -no-pie -g -o tmp tmp.s ./test/lib.o
+    gcc -no-pie -g -o tmp $outputs ./test/lib.o
     ./tmp
     actual="$?"
 
@@ -25,6 +27,67 @@ try() {
     fi
 }
 
+try() {
+    try_command "$1" "$TEST_TARGET --str ${2@Q} >tmp.s" tmp.s
+}
+
+try_stdin() {
+    try_command "$1" "echo ${2@Q} | $TEST_TARGET - >tmp.s" tmp.s
+}
+
+try_output() {
+    try_command "$1" "$TEST_TARGET --str ${2@Q} -o tmp.s >/dev/null" tmp.s
+}
+
+try_files() {
+    echo "$2" >tmp_a.c
+    echo "$3" >tmp_b.c
+    try_command "$1" "$TEST_TARGET tmp_a.c tmp_b.c" "tmp_a.s tmp_b.s"
+}
+
+try_object() {
+    try_command "$1" "$TEST_TARGET -c --str ${2@Q} -o tmp.o" tmp.o
+
+    # The object has the same code and relocations as the one which GNU as assembles from the assembly.
+    $TEST_TARGET --str "$2" >tmp.s
+    gcc -c -o tmp_as.o tmp.s
+    if ! diff <(objdump -d -r tmp_as.o | tail -n +3) <(objdump -d -r tmp.o | tail -n +3); then
+        echo 'The object differs from the one which GNU as assembles'
+        exit 1
+    fi
+}
+
+# Compile with the flags and check that the output, including the diagnostics, matches the pattern.
+# The pattern which starts with "!" must not match.
+try_grep() {
+    expected="$1"
+    input="$2"
+    shift 2
+
+    echo "$TEST_TARGET $* --str ${input@Q}"
+    if ! actual=$($TEST_TARGET "$@" --str "$input" 2>&1); then
+        echo 'Compilation error'
+        exit 1
+    fi
+
+    is_found=0
+    if echo "$actual" | grep -q -- "${expected#!}"; then
+        is_found=1
+    fi
+    is_expected=1
+    if [ "${expected#!}" != "$expected" ]; then
+        is_expected=0
+    fi
+
+    if [ "$is_found" = "$is_expected" ]; then
+        echo " -> $expected"
+    else
+        echo "$expected expected, but got"
+        echo "$actual"
+        exit 1
+    fi
+}
+
 try 0   'int main() { 0; }'
 try 42  'int main() { 42; }'
 try 21  'int main() { 5+20-4; }'
@@ -112,7 +175,7 @@ try 80  'int main() { int* a[10]; return sizeof(a);}'
 try 8   'int main() { int* a[1]; return sizeof(a);}'
 try 0   'int main() { int* a[4]; return a-&a[0];}'
 try 2   'int x; int main() { x = 1; return x+1;}'
-try 4   'int* foo[10]; int main() { foo[0] = 1; foo[9] = 3; return foo[0]+foo[9];}'
+try 4   'int* gptrs[10]; int main() { gptrs[0] = 1; gptrs[9] = 3; return gptrs[0]+gptrs[9];}'
 try 1   'int main() { char x; x = 1; return x; }'
 try 3   'int main() { char x[3]; x[0] = -1; x[1] = 2; int y; y = 4; return x[0] + y; }'
 try 97  'int main() { char* x; x = "abc"; return *x; }'
@@ -156,7 +219,7 @@ try 5   'struct hoge { int x; int y; }; int main() { struct hoge obj; obj.x = 3;
 try 3   'struct hoge { int x; int y; }; int main() { struct hoge obj; obj.x = 3; int* a; a = &obj.x; *a = 3; return obj.x; }'
 try 5   'struct hoge { int x; int y; }; int main() { struct hoge obj; obj.x = 3; int* a; a = &obj.x; *a = 3; obj.x = 5; return *a; }'
 try 5   'struct hoge { int x; int y; }; int main() { struct hoge obj; struct hoge* ptr; ptr = &obj; ptr->x = 5; return obj.x; }'
-try 0   'struct hoge { int x; int y; }; int main() { return foo(); } struct hoge* foo() { return 0; }'
+try 0   'struct hoge { int x; int y; }; int main() { return make_hoge(); } struct hoge* make_hoge() { return 0; }'
 try 8   'struct hoge { int x; int y; }; int main() { return sizeof(struct hoge); }'
 try 128 'int main() { return sizeof(void*) * 16; }'
 try 0   'int main() { return; }'
@@ -210,10 +273,168 @@ try 0   "int main(void) { while (1) { int i = 0; break; } return 0;}"
 try 1   "int main(void) { int i = 1 != 0 && 1 < 10;  return i;}"
 try 1   "int main(void* a) { int i = 1 != 0 && 1 < 10;  return i;}"
 try 5   'struct hoge { int x; }; int main() { struct hoge** ar; struct hoge* ptr; struct hoge h; h.x = 5; ptr = &h; ar = &ptr; return ar[0]->x; }'
-try 0   "void* foo(void) { return 1229801703532086340; } int main(void) { return foo() - 1229801703532086340;}"
-try 0   "void* foo(void) { return 1229801703532086340; } int main(void) { size_t p; p = foo(); return p - 1229801703532086340;}"
-try 0   "void* foo(size_t n) { return n - 1229801703532086340; } int main(void) { return foo(1229801703532086340);}"
+try 0   "void* large(void) { return 1229801703532086340; } int main(void) { return large() - 1229801703532086340;}"
+try 0   "void* large(void) { return 1229801703532086340; } int main(void) { size_t p; p = large(); return p - 1229801703532086340;}"
+try 0   "void* large(size_t n) { return n - 1229801703532086340; } int main(void) { return large(1229801703532086340);}"
 try 0   "int main(void) { void** data = 0; return data + 0;}"
 try 8   "int main(void) { void** data = 0; size_t i = 1; return data + i++;}"
 try 1   "int main(void) { int i = 1 != 0 &&  1 < 10; return i; }"
 try 10  "int main(void) { char* q = 10576963; if (!q) {return 0;} return 10; }"
+try 3   'int main() { int structure = 1; int iffy = 2; return structure + iffy; }'
+try 7   'int main() { int sizeofx = 3; int enumerator = 4; while (1) { break ; } return sizeofx+enumerator; }'
+try 2   'int main() { int returned = 1; int typedefs = 1; int externs = 0; return returned + typedefs + externs; }'
+try 97  'int main() { char* p = "ab"; int n = 0; while (0) { n = 1; } char* q = p; add(1, 2); return *q; }'
+try 7   'int main() { int s = 0; for (int i = 0; i < 1000000; i++) { s = i; } return 7; }'
+try 3   'int main() { int x = 0; if (1) x = 1; if (0) x = 5; else x = x + 2; return x; }'
+try 4   'int main() { int a = 2; return (a * 3 + 1) / (1 + add(1, 0)) + add(a, a) - add(a, 1); }'
+try 2   'int main() { int a = 7; int b = 2; return (a + 1 - 1) / (b + b - b) - (b - 1 + 0); }'
+try 66  'int main() { char s[4]; s[1] = 65; char* p = s; *(p + 1) = *(p + 1) + 1; return s[1]; }'
+
+# The balanced tree of 128 leaves needs 8 registers, so some of them are spilled.
+spill_expr=1
+for i in 1 2 3 4 5 6 7; do
+    spill_expr="($spill_expr+$spill_expr)"
+done
+try 128 "int main() { return $spill_expr; }"
+try_stdin 5 '#ifdef SELFHOST_9MM
+int main() { return 5; }
+#endif'
+try_output 6 'int main() { int x = 2; return x * 3; }'
+try 9   'int main() { int i = 0; int n = 0; while (1) { i++; if (i == 3) break; for (int j = 0; j < 3; j++) n++; } return n + i; }'
+try 2   'int main() { int n = 0; if (n || add(n, 1)) n = n + 2; if (n && 0) n = 7; return n; }'
+try_grep 'v6 = add v2, v5' 'int main() { int a = 1; return a + 2; }' --dump-ir
+try_grep 'br v[0-9]*, bb1, bb2' 'int main(int a) { if (a) return 1; return 2; }' --dump-ir
+try 5   'int main() { if (2 - 2) return 1; else if (3 < 4 && !0) return 5; return 9; }'
+try 4   'int main() { int n = 0; while (1 == 1) { n++; if (n == 4) break; } for (n = n; 0; n++) n = 100; return n; }'
+try 3   'int main() { return (0 - 7) / (0 - 2) + 0 * 5 - 0; }'
+try 1   'int main() { return 0 - 1 < 0; }'
+try 8   'struct pair { int x; int y; }; int main() { int a[5]; struct pair s; a[3] = 3; s.y = 5; int* p = a; return *(p + 3) * 1 + s.y + a[1] * 0; }'
+try_grep 'v1 = imm 7' 'int main() { return 1 + 2 * 3; }' --dump-ir
+try_grep 'local a \[rbp-8\]' 'int main() { int a[5]; a[1] = 2; return a[3]; }' --dump-ir
+try 6   'int main() { int a = 3; int b = 3; int n = 0; if (a <= b) n++; if (a != b) n = 9; if (!(a < b)) n++; while (!(n == 4)) n++; char c[2]; c[0] = 2; return n + c[0]; }'
+try 5   'int main() { int x = 0 - 5; return 0 - x; }'
+try 0   'int main() { size_t x = 4294967296; size_t y = x + 4294967296; return y - 8589934592; }'
+try 7   'int f(int a, int b) { int lt = a < b; if (lt) return lt + 1; return lt + 5; } int main() { return f(1, 2) + f(2, 1); }'
+try_grep 'movzx r[0-9a-z]*, al' 'int f(int a, int b) { int lt = a < b; if (lt) return lt + 1; return lt + 5; }'
+try_grep 'jge ' 'int f(int a, int b) { int lt = a < b; if (lt) return lt + 1; return lt + 5; }'
+try_grep '!cmp r[0-9a-z]*, 0$' 'int f(int a, int b) { int lt = a < b; if (lt) return lt + 1; return lt + 5; }'
+try_grep '1 branches' 'int f(int a, int b) { int lt = a < b; if (lt) return lt + 1; return lt + 5; }' --stats
+try_grep '1 reloads' 'int main() { int x = 0 - 5; return 0 - x; }' --stats
+try_grep 'add r[0-9a-z]*, 5$' 'int f(int x) { return x + 5; }'
+try_grep '!mov r[0-9a-z]*, 5$' 'int f(int x) { return x + 5; }'
+try_grep 'immediates: 1 forwarded' 'int f(int x) { return x + 5; }' --stats
+try 3   'int main() { int a = 1; int b = 2; int n = 0; if (!(a < b) || b == 5) n = 9; else n = 1; if (a < b && (b < a || b == 2)) n = n + 2; return n; }'
+try 1   'int main() { int a = 2; int x = a == 2 && !(a < 1); return x; }'
+try_grep 'br v[0-9]*, bb2, bb1' 'int main(int a, int b) { if (!(a < b)) return 1; return 2; }' --dump-ir
+try 54  'int main() { int x = 3; return x * 4 + x * 3 + x * 5 + x * 6; }'
+try 1   'int main() { size_t x = 0 - 21; size_t y = 0 - 16; return 0 - x / 4 + y / 8 + x / 7 - x / 21; }'
+try 14  'int main() { int a[4]; for (int i = 0; i < 4; i++) a[i] = i * 2; return a[1] + a[2] + a[3] + 2; }'
+try_grep 'shl r[0-9a-z]*, 3' 'int f(int x) { return x * 8; } int main() { return f(3); }'
+try_grep 'lea r[0-9a-z]*, \[r[0-9a-z]*+r[0-9a-z]*\*8\]' 'int f(int x) { return x * 9; } int main() { return f(3); }'
+try_grep 'mov r[0-9a-z]*, \[rbp+r[0-9a-z]*\*4-[0-9]*\]' 'int f(int i) { int a[4]; a[2] = 7; return a[i]; } int main() { return f(2); }'
+try_grep 'imul r' 'int f(int x) { return x / 10; } int main() { return f(3); }'
+try 17  'struct S { int a; int b; }; struct S g; int ga[4]; int main() { int a[4]; int i = 2; a[i] = 3; g.b = 4; ga[i] = 5; char* p = "abc"; struct S* q = &g; q->b = q->b + 1; return a[i] + g.b + ga[i] + p[i] - 99 + q->b - 1; }'
+try 7   'int main() { char s[4]; int i = 1; s[0] = 3; s[i] = 4; return s[0] + s[i]; }'
+try_grep 'mov DWORD PTR \[rbp-[0-9]*\], 2' 'int main() { int i = 2; int* p = &i; return *p; }'
+try_grep 'mov DWORD PTR \[rip+g+4\], 4' 'struct S { int a; int b; }; struct S g; int main() { g.b = 4; return g.b; }'
+try_grep 'mov r[0-9a-z]*, \[r[0-9a-z]*+8\]' 'struct S { size_t a; size_t b; }; int main() { struct S s; struct S* p = &s; p->b = 1; return p->b; }'
+try 13  'int main() { size_t a = 0; size_t b = 1; for (int i = 0; i < 7; i++) { size_t t = a + b; a = b; b = t; } return a; }'
+try 21  'int f(int a, int b, int n) { while (n) { int t = a; a = b; b = t + b; n = n - 1; } return a; } int main() { return f(0, 1, 8); }'
+try 8   'int f(int x) { int y = 1; if (x) y = 2; else { y = 3; if (x == 0) y = y + 1; } int z = y; x = 5; return z + x - 1; } int main() { return f(1) + f(0) - 6; }'
+try 44  'int f(char c) { c = c + 256; return c; } int main() { return f(300) + 0; }'
+try_grep 'lt v[0-9]*, v[0-9]*' 'int f(int n) { int s = 0; for (int i = 0; i < n; i++) s = s + i; return s; }' --dump-ir
+try 42  'int f(int n) { int s = 0; int i = 0; int k = 0; while (i < n) { s = s + i * 3 * k; k = k + 1; i = i + 1; } return s; } int main() { return f(4); }'
+try_grep '1 reduced multiplications' 'int f(int n) { int s = 0; int i = 0; int k = 0; while (i < n) { s = s + i * 3 * k; k = k + 1; i = i + 1; } return s; }' --stats
+try_grep '1 hoisted' 'int f(int n, int a) { int s = 0; for (int i = 0; i < n; i++) s = s + a * 5; return s; }' --stats
+try_grep 'v[0-9]* = arg 0' 'int f(int n) { return n; }' --dump-ir
+try_grep 'mov rax, 5' 'int f(int x) { int y = x; y = 5; return y; } int main() { return f(2); }'
+try 12  'int sq(int x) { return x * x; } int main() { int s = 0; for (int i = 0; i < 3; i++) s = s + sq(i); return s + sq(sq(1) + 1) + 3; }'
+try 25  'int clamp(int x); int main() { return clamp(3) + clamp(50) + clamp(2); } int clamp(int x) { if (x < 10) return x; return 20; }'
+try 44  'char low(int c) { return c; } int next(size_t n) { size_t m = n + 1; return m; } int main() { return low(300) + next(4294967295); }'
+try 6   'int g; void set(int x) { g = x; } int fact(int n) { if (n == 0) return 1; return n * fact(n - 1); } int main() { set(2); return fact(3) * g - 6; }'
+try_grep 'local a\.1 ' 'int f(int i) { int a[2]; a[0] = i; a[1] = 1; return a[i]; } int main() { return f(1); }' --dump-ir
+try 44  'size_t count(size_t n, size_t acc) { if (n == 0) return acc; return count(n - 1, acc + 1); } int main() { return count(100000000, 0) - 99999956; }'
+try 1   'int is_odd(size_t n); int is_even(size_t n) { if (n == 0) return 1; return is_odd(n - 1); } int is_odd(size_t n) { if (n == 0) return 0; return is_even(n - 1); } int main() { return is_even(50000000); }'
+try 7   'int get(int* p) { return add(*p, 2); } int f() { int x = 5; return get(&x); } int main() { return f(); }'
+try_grep 'jmp .L_entry_' 'size_t count(size_t n, size_t acc) { if (n == 0) return acc; return count(n - 1, acc + 1); }'
+try_grep 'jmp is_odd' 'int is_odd(size_t n); int is_even(size_t n) { if (n == 0) return 1; return is_odd(n - 1); } int is_odd(size_t n) { if (n == 0) return 0; return is_even(n - 1); }'
+try_files 43 'int shared; static int helper() { return 1; } int get(); int main() { shared = 40; return helper() + get(); }' 'extern int shared; static int helper() { return 2; } int get() { return shared + helper(); }'
+
+# The server compiles the requests from the same target.
+$TEST_TARGET --server tmp.sock -j 2 &
+server_pid=$!
+LOCAL_TARGET=$TEST_TARGET
+TEST_TARGET="$LOCAL_TARGET --connect tmp.sock"
+try 42  'int main() { return 42; }'
+try 3   'int main() { return add(1, 2); }'
+try 21  'int f(int a, int b, int n) { while (n) { int t = a; a = b; b = t + b; n = n - 1; } return a; } int main() { return f(0, 1, 8); }'
+try_output 12 'int sq(int x) { return x * x; } int main() { int s = 0; for (int i = 0; i < 3; i++) s = s + sq(i); return s + sq(sq(1) + 1) + 3; }'
+try_object 3 'int main() { return add(1, 2); }'
+echo "$TEST_TARGET --str 'int main() { return undeclared; }'"
+if ! $TEST_TARGET --str 'int main() { return undeclared; }' 2>&1 >/dev/null | grep -q 'Not declared variable'; then
+    echo 'the diagnostics are not responded'
+    exit 1
+fi
+
+# The workers which have been killed are replaced.
+# They are waited for, otherwise the dying one may accept the next request.
+worker_pids=$(pgrep -P $server_pid)
+kill -9 $worker_pids
+for pid in $worker_pids; do
+    while kill -0 $pid 2>/dev/null; do
+        sleep 0.1
+    done
+done
+TEST_TARGET="timeout 5 $LOCAL_TARGET --connect tmp.sock"
+try 42  'int main() { return 42; }'
+TEST_TARGET=$LOCAL_TARGET
+kill $server_pid
+rm -f tmp.sock
+
+# The cache returns the same assembly as the compilation, and evicts the entries over the limit.
+rm -rf tmp_cache
+LOCAL_TARGET=$TEST_TARGET
+TEST_TARGET="$LOCAL_TARGET --cache-dir tmp_cache/9mm --cache-limit 1"
+try 42  'int main() { return 42; }'
+try 42  'int main() { return 42; }'
+echo "$TEST_TARGET --stats --str 'int main() { return 42; }'"
+if ! $TEST_TARGET --stats --str 'int main() { return 42; }' 2>&1 >/dev/null | grep -q '# cache: 1 hits'; then
+    echo 'the assembly is not cached'
+    exit 1
+fi
+try 13  'int main() { size_t a = 0; size_t b = 1; for (int i = 0; i < 7; i++) { size_t t = a + b; a = b; b = t; } return a; }'
+try 12  'int sq(int x) { return x * x; } int main() { int s = 0; for (int i = 0; i < 3; i++) s = s + sq(i); return s + sq(sq(1) + 1) + 3; }'
+try 12  'int sq(int x) { return x * x; } int main() { int s = 0; for (int i = 0; i < 3; i++) s = s + sq(i); return s + sq(sq(1) + 1) + 3; }'
+if [ "$(cat tmp_cache/9mm/*.s | wc -c)" -gt 1024 ]; then
+    echo 'the cache is not evicted'
+    exit 1
+fi
+
+# The temporary file which is left by the crashed compilation is removed by the scan.
+touch -d '1 hour ago' tmp_cache/9mm/stale.s.1.tmp
+try 3   'int main() { return 3; }'
+if [ -e tmp_cache/9mm/stale.s.1.tmp ]; then
+    echo 'the stale temporary file is not removed'
+    exit 1
+fi
+
+# The directory is not scanned while the total is under the limit.
+TEST_TARGET="$LOCAL_TARGET --cache-dir tmp_cache/9mm"
+try 4   'int main() { return 4; }'
+echo "$TEST_TARGET --stats --str 'int main() { return 5; }'"
+if ! $TEST_TARGET --stats --str 'int main() { return 5; }' 2>&1 >/dev/null | grep -q '# cache: 1 stored, 0 evicted, 0 scans'; then
+    echo 'the cache directory is scanned under the limit'
+    exit 1
+fi
+TEST_TARGET=$LOCAL_TARGET
+rm -rf tmp_cache
+
+# The objects are compared with the ones which GNU as assembles by try_object.
+try_object 42  'int main() { return 42; }'
+try_object 3   'int main() { return add(1, 2); }'
+try_object 21  'int f(int a, int b, int n) { while (n) { int t = a; a = b; b = t + b; n = n - 1; } return a; } int main() { return f(0, 1, 8); }'
+try_object 5   'int g; int a[4]; int main() { g = 2; a[3] = 3; return g + a[3]; }'
+try_object 6   'int main() { char* s = "a\tb\\c\n"; return strlen(s); }'
+try_object 100 'int main() { size_t x = 4294967396; return x - 4294967296; }'
+try_object 1   'int is_odd(size_t n); int is_even(size_t n) { if (n == 0) return 1; return is_odd(n - 1); } int is_odd(size_t n) { if (n == 0) return 0; return is_even(n - 1); } int main() { return is_odd(7); }'
+try_object 55  'int f(int n) { int s = 0; for (int i = 1; i <= n; i++) { if (i == 1) { s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s + 1; s = s - 20; } s = s + i; } return s; } int main() { return f(10); }'
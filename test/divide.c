@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void check(size_t x)
+{
+    printf("%zd: %zd %zd %zd\n", x, x / 2, x / 3, x / 7);
+    printf("  %zd %zd %zd %zd\n", x / 8, x / 10, x / 641, x / 1000000007);
+    printf("  %zd %zd %zd\n", x * 3, x * 8, x * 6);
+}
+
+// Compare the division by the constant with idiv.
+static size_t count_mismatches(size_t from, size_t to)
+{
+    size_t count = 0;
+    size_t d3 = 3;
+    size_t d7 = 7;
+    size_t d16 = 16;
+    size_t d641 = 641;
+    for (size_t x = from; x < to; x++) {
+        if (x / 3 != x / d3 || x / 7 != x / d7 || x / 16 != x / d16 || x / 641 != x / d641) {
+            count = count + 1;
+        }
+    }
+    return count;
+}
+
+int main(void)
+{
+    check(0);
+    check(1);
+    check(0 - 1);
+    check(7);
+    check(0 - 7);
+    check(100);
+    check(0 - 100);
+    check(1234567890123);
+    check(0 - 1234567890123);
+    check(9223372036854775807);
+    check(0 - 9223372036854775807);
+
+    int a[4];
+    for (int i = 0; i < 4; i++) {
+        a[i] = i * 5;
+    }
+    printf("%d %d %d %d\n", a[0], a[1], a[2], a[3]);
+
+    printf("%zd\n", count_mismatches(0 - 100000, 100000));
+    return 0;
+}
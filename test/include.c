@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include "include_guard.h"
+#include "include_once.h"
+#include "include_guard.h"
+#include "include_once.h"
+#include "include_else.h"
+#include "include_else.h"
+
+int main(void)
+{
+    guarded = 1;
+    included_once = 2;
+    included_else = 3;
+
+    printf("%d\n", guarded + included_once);
+    printf("%d\n", included_else + included_else_again());
+
+    return 0;
+}
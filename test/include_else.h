@@ -0,0 +1,14 @@
+// The "#else" is used by the second inclusion, so it is not an include guard.
+#ifndef INCLUDE_ELSE_H
+#define INCLUDE_ELSE_H
+
+int included_else;
+
+#else
+
+int included_else_again(void)
+{
+    return 4;
+}
+
+#endif
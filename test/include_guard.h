@@ -0,0 +1,9 @@
+/*
+ * Defining a global variable twice is rejected by the assembler.
+ */
+#ifndef INCLUDE_GUARD_H
+#define INCLUDE_GUARD_H
+
+int guarded;
+
+#endif
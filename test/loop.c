@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t table[64];
+
+// The load of the length and "k + 3" are invariant, "i * 3" is reduced into an addition.
+static size_t weighted_sum(size_t* data, size_t* len, size_t k)
+{
+    size_t s = 0;
+    for (size_t i = 0; i < *len; i++) {
+        s = s + data[i] * (k + 3) + i * 3;
+    }
+    return s;
+}
+
+// The length is changed in the loop, so its load is not hoisted.
+static size_t drain(size_t* len)
+{
+    size_t count = 0;
+    while (0 < *len) {
+        *len = *len - 1;
+        count = count + 1;
+    }
+    return count;
+}
+
+// The inner index is multiplied by 12 and the outer one by 16.
+static void fill(void)
+{
+    for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 16; i++) {
+            table[j * 16 + i] = i * 12 + j;
+        }
+    }
+}
+
+static size_t scan(char const* s, char c)
+{
+    size_t n = 0;
+    size_t i = 0;
+    while (s[i] != 0) {
+        if (s[i] == c) {
+            n = n + 1;
+        }
+        i = i + 1;
+    }
+    return n * 10 + i;
+}
+
+int main(void)
+{
+    size_t a[10];
+    for (int i = 0; i < 10; i++) {
+        a[i] = i * 7;
+    }
+    size_t len = 10;
+    printf("%zd\n", weighted_sum(a, &len, 1));
+    len = 0;
+    printf("%zd\n", weighted_sum(a, &len, 1));
+    len = 5;
+    size_t count = drain(&len);
+    printf("%zd %zd\n", count, len);
+
+    fill();
+    size_t total = 0;
+    for (int i = 0; i < 64; i++) {
+        total = total + table[i];
+    }
+    printf("%zd %zd %zd\n", total, table[17], table[63]);
+    printf("%zd\n", scan("loops and strings", 's'));
+    return 0;
+}
@@ -29,8 +29,20 @@
 #else
 // error 6
 #endif
+#ifdef MOPP
+#ifndef MOPP
+// error 7
+#else
+int nested(void) { return NULL; }
+#endif
+#else
+#ifdef MOPP
+// error 8
+#endif
+// error 9
+#endif
 // tail
 
 int main(void) {
-    return NULL;
+    return nested();
 }